@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "portals4.h"
+#include "portals4_ext.h"
+
+/*
+ * This example shows how the NIs of a process share its send queue. The
+ * parent process floods its child with large PUTs on a non-matching NI
+ * and, meanwhile, measures the round-trip time of small PUTs the child
+ * echoes back on a matching NI of the same interface. Then it floods
+ * the child on the matching NI itself, so that the small PUTs share the
+ * connection with the flood. The round-trip time is first measured
+ * without the flood, for reference.
+ *
+ * Connections take turns to send, each getting a share set by the
+ * weight of its NI, given by PORTALS4_VC_WEIGHTS and indexed by the
+ * PTL_NI_PHYSICAL | PTL_NI_MATCHING bits of the NI options. For
+ * instance PORTALS4_VC_WEIGHTS=1,1,1,8 gives the matching NI 8 times
+ * the share of the flood. Within a connection, messages take turns as
+ * well, each sending PORTALS4_INTERLEAVE bytes in a row; 0 sends them
+ * one after another.
+ *
+ * Usage: fairness [number of pings] [flood message size] [ping size]
+ */
+
+#define FAIRNESS_FLOOD_WINDOW 16
+
+/* hdr_data of the last ping, telling the child to exit, and of the flood */
+#define FAIRNESS_STOP 1
+#define FAIRNESS_FLOOD 2
+
+/* ids of the parent and the child, in memory shared by both */
+struct fairness_ids {
+	atomic_int ready[2];
+	ptl_process_t id[2];
+};
+
+struct fairness_ni {
+	ptl_handle_ni_t nih;
+	ptl_handle_eq_t eqh;
+	ptl_index_t pti;
+	ptl_handle_md_t mdh;
+	ptl_handle_me_t meh;
+	char *buf;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Initialize an NI with the given options, with a buffer of the given
+ * size used both to send and to receive PUTs on portal index 0
+ */
+static int ni_init(struct fairness_ni *ni, unsigned int options, ptl_size_t size)
+{
+	ptl_index_t pti;
+	ptl_event_t ev;
+	ptl_me_t me;
+	ptl_md_t md;
+	int ret;
+
+	ni->buf = calloc(1, size);
+	if (ni->buf == NULL) {
+		fprintf(stderr, "can't allocate buffer\n");
+		return 1;
+	}
+
+	ret = PtlNIInit(PTL_IFACE_DEFAULT, options | PTL_NI_PHYSICAL, PTL_PID_ANY, NULL, NULL,
+			&ni->nih);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlNIInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	ret = PtlEQAlloc(ni->nih, 4 * FAIRNESS_FLOOD_WINDOW, &ni->eqh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	ret = PtlPTAlloc(ni->nih, 0, ni->eqh, 0, &pti);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlPTAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+	ni->pti = pti;
+
+	me = (ptl_me_t){ .start = ni->buf,
+			 .length = size,
+			 .ct_handle = PTL_CT_NONE,
+			 .uid = PTL_UID_ANY,
+			 .options = PTL_ME_OP_PUT,
+			 .match_id.phys = { .nid = PTL_NID_ANY, .pid = PTL_PID_ANY },
+			 .match_bits = 0,
+			 .ignore_bits = 0,
+			 .min_free = 0 };
+
+	/* the flood can't be matched, it goes to a plain list entry */
+	if (options & PTL_NI_MATCHING)
+		ret = PtlMEAppend(ni->nih, pti, &me, PTL_PRIORITY_LIST, NULL, &ni->meh);
+	else
+		ret = PtlLEAppend(ni->nih, pti, &me, PTL_PRIORITY_LIST, NULL, &ni->meh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMEAppend failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	/* wait for the LINK event */
+	ret = PtlEQWait(ni->eqh, &ev);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	/* SEND events of the flood are needed to keep its window full */
+	md = (ptl_md_t){ .start = ni->buf,
+			 .length = size,
+			 .options = 0,
+			 .eq_handle = ni->eqh,
+			 .ct_handle = PTL_CT_NONE };
+
+	ret = PtlMDBind(ni->nih, &md, &ni->mdh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMDBind failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	return 0;
+}
+
+static void ni_fini(struct fairness_ni *ni)
+{
+	PtlMDRelease(ni->mdh);
+	PtlMEUnlink(ni->meh);
+	PtlPTFree(ni->nih, ni->pti);
+	PtlEQFree(ni->eqh);
+	PtlNIFini(ni->nih);
+	free(ni->buf);
+}
+
+/*
+ * Child: echo the pings back and absorb the flood, until the last ping
+ */
+static int echo(struct fairness_ni *flood, struct fairness_ni *ping, ptl_process_t peer,
+		ptl_size_t ping_size)
+{
+	ptl_event_t ev;
+	int ret;
+
+	for (;;) {
+		/* the flood is processed while we wait */
+		ret = PtlEQWait(ping->eqh, &ev);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+		if (ev.type != PTL_EVENT_PUT || ev.hdr_data == FAIRNESS_FLOOD)
+			continue;
+		if (ev.hdr_data == FAIRNESS_STOP)
+			return 0;
+
+		ret = PtlPut(ping->mdh, 0, ping_size, PTL_NO_ACK_REQ, peer, ping->pti, 0, 0, NULL,
+			     0);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+	}
+}
+
+/*
+ * Parent: send count pings, one at a time, and report their round-trip
+ * time. If flood_size isn't 0, keep a window of PUTs of that size in
+ * flight on the flood NI meanwhile, which may be the ping NI. The SEND
+ * events of the flood are told apart by their user pointer.
+ */
+static int measure(struct fairness_ni *flood, struct fairness_ni *ping, ptl_process_t peer,
+		   ptl_size_t ping_size, int count, ptl_size_t flood_size, const char *name)
+{
+	ptl_handle_eq_t eqhs[2] = { flood->eqh, ping->eqh };
+	unsigned int neqs = flood == ping ? 1 : 2;
+	double start, t, rtt, rtt_sum = 0, rtt_max = 0;
+	unsigned long flood_count = 0;
+	int inflight = 0;
+	unsigned int which;
+	ptl_event_t ev;
+	int i, ret;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		t = now();
+		ret = PtlPut(ping->mdh, 0, ping_size, PTL_NO_ACK_REQ, peer, ping->pti, 0, 0, NULL,
+			     0);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+
+		for (;;) {
+			while (flood_size > 0 && inflight < FAIRNESS_FLOOD_WINDOW) {
+				ret = PtlPut(flood->mdh, 0, flood_size, PTL_NO_ACK_REQ, peer,
+					     flood->pti, 0, 0, flood, FAIRNESS_FLOOD);
+				if (ret != PTL_OK) {
+					fprintf(stderr, "PtlPut failed : %s \n",
+						PtlToStr(ret, PTL_STR_ERROR));
+					return 1;
+				}
+				inflight++;
+			}
+
+			ret = PtlEQPoll(eqhs, neqs, PTL_TIME_FOREVER, &ev, &which);
+			if (ret != PTL_OK || ev.ni_fail_type != PTL_NI_OK) {
+				fprintf(stderr, "PtlEQPoll failed : %s \n",
+					PtlToStr(ret, PTL_STR_ERROR));
+				return 1;
+			}
+			if (ev.type == PTL_EVENT_SEND && ev.user_ptr == flood) {
+				inflight--;
+				flood_count++;
+			} else if (ev.type == PTL_EVENT_PUT)
+				break;
+		}
+
+		rtt = now() - t;
+		rtt_sum += rtt;
+		if (rtt > rtt_max)
+			rtt_max = rtt;
+	}
+
+	printf("%-8s %10.2f us %10.2f us", name, 1e6 * rtt_sum / count, 1e6 * rtt_max);
+	if (flood_size > 0)
+		printf(" %10.1f MB/s", flood_count * (double)flood_size / (now() - start) / 1e6);
+	printf("\n");
+
+	/* wait for the rest of the flood */
+	while (inflight > 0) {
+		ret = PtlEQWait(flood->eqh, &ev);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+		if (ev.type == PTL_EVENT_SEND && ev.user_ptr == flood)
+			inflight--;
+	}
+
+	return 0;
+}
+
+static int run(struct fairness_ids *ids, int child, int count, ptl_size_t flood_size,
+	       ptl_size_t ping_size)
+{
+	struct fairness_ni flood, ping;
+	ptl_process_t peer;
+	int res = 0;
+	int ret;
+
+	ret = PtlInit();
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	if (ni_init(&flood, PTL_NI_NO_MATCHING, flood_size) ||
+	    ni_init(&ping, PTL_NI_MATCHING, ping_size > flood_size ? ping_size : flood_size)) {
+		res = 1;
+		goto fini;
+	}
+
+	/* both NIs are on the same interface, thus have the same id */
+	ret = PtlGetPhysId(ping.nih, &ids->id[child]);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlGetPhysId failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto fini;
+	}
+	atomic_store(&ids->ready[child], 1);
+	while (!atomic_load(&ids->ready[!child]))
+		;
+	peer = ids->id[!child];
+
+	if (child) {
+		res = echo(&flood, &ping, peer, ping_size);
+	} else {
+		printf("%-8s %13s %13s %15s\n", "", "avg rtt", "max rtt", "flood");
+		res = measure(&flood, &ping, peer, ping_size, count, 0, "idle") ||
+		      measure(&flood, &ping, peer, ping_size, count, flood_size, "other ni") ||
+		      measure(&ping, &ping, peer, ping_size, count, flood_size, "same ni");
+
+		/* tell the child to exit */
+		ret = PtlPut(ping.mdh, 0, ping_size, PTL_NO_ACK_REQ, peer, ping.pti, 0, 0, NULL,
+			     FAIRNESS_STOP);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			res = 1;
+		}
+	}
+
+	ni_fini(&ping);
+	ni_fini(&flood);
+fini:
+	PtlFini();
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	struct fairness_ids *ids;
+	ptl_size_t flood_size = 64 * 1024;
+	ptl_size_t ping_size = 8;
+	int count = 1000;
+	int res, status;
+	pid_t pid;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+	if (argc > 2)
+		flood_size = atol(argv[2]);
+	if (argc > 3)
+		ping_size = atol(argv[3]);
+	if (count <= 0 || flood_size == 0 || ping_size == 0) {
+		fprintf(stderr, "usage: %s [number of pings] [flood message size] [ping size]\n",
+			argv[0]);
+		return 1;
+	}
+
+	ids = mmap(NULL, sizeof(*ids), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (ids == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	atomic_init(&ids->ready[0], 0);
+	atomic_init(&ids->ready[1], 0);
+
+	/* fork before PtlInit, as required by the Portals4 specification */
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+		return run(ids, 1, count, flood_size, ping_size);
+
+	res = run(ids, 0, count, flood_size, ping_size);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "child failed\n");
+		res = 1;
+	}
+
+	return res;
+}
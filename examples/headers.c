@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include "portals4.h"
+#include "portals4_ext.h"
+
+/*
+ * This example checks that the fields of the message headers get
+ * through unchanged, whatever their size once encoded. It sends to
+ * itself PUTs, GETs and atomics with match bits, header data, offsets
+ * and lengths around the boundaries of the variable length encoding,
+ * then checks the fields of the events and the data. All atomic types
+ * are used with SUM and the swap operations.
+ */
+
+/* highest index that fits in the pte field of the headers */
+#define HEADERS_PTI 255
+
+#define HEADERS_BUFSZ 0x20000
+
+/* where the atomics are done, aligned for all types */
+#define HEADERS_ATOFFS 0x18000
+
+#define HEADERS_TIMEOUT 5000
+
+static const uint64_t values[] = {
+	0,
+	1,
+	0x7f,
+	0x80,
+	0x3fff,
+	0x4000,
+	0xffffffffULL,
+	0x100000000ULL,
+	0x8000000000000000ULL,
+	~0ULL,
+};
+
+static const ptl_size_t offsets[] = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffff };
+
+static const ptl_size_t lengths[] = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000 };
+
+static const ptl_datatype_t types[] = {
+	PTL_INT8_T,
+	PTL_UINT8_T,
+	PTL_INT16_T,
+	PTL_UINT16_T,
+	PTL_INT32_T,
+	PTL_UINT32_T,
+	PTL_INT64_T,
+	PTL_UINT64_T,
+	PTL_FLOAT,
+	PTL_FLOAT_COMPLEX,
+	PTL_DOUBLE,
+	PTL_DOUBLE_COMPLEX,
+	PTL_LONG_DOUBLE,
+	PTL_LONG_DOUBLE_COMPLEX,
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+struct headers_ni {
+	ptl_handle_ni_t nih;
+	ptl_handle_eq_t eqh;
+	ptl_handle_md_t mdh;
+	ptl_process_t id;
+	unsigned char *sbuf;
+	unsigned char *rbuf;
+};
+
+static unsigned char pattern(ptl_size_t i, int salt)
+{
+	return (unsigned char)(i * 7 + salt);
+}
+
+static int is_integer(ptl_datatype_t type)
+{
+	switch (type) {
+	case PTL_INT8_T:
+	case PTL_UINT8_T:
+	case PTL_INT16_T:
+	case PTL_UINT16_T:
+	case PTL_INT32_T:
+	case PTL_UINT32_T:
+	case PTL_INT64_T:
+	case PTL_UINT64_T:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Return the size in bytes of the given atomic type
+ */
+static ptl_size_t at_size(ptl_datatype_t type)
+{
+	switch (type) {
+	case PTL_INT8_T:
+	case PTL_UINT8_T:
+		return 1;
+	case PTL_INT16_T:
+	case PTL_UINT16_T:
+		return 2;
+	case PTL_INT32_T:
+	case PTL_UINT32_T:
+		return 4;
+	case PTL_INT64_T:
+	case PTL_UINT64_T:
+		return 8;
+	case PTL_FLOAT:
+		return sizeof(float);
+	case PTL_FLOAT_COMPLEX:
+		return sizeof(float complex);
+	case PTL_DOUBLE:
+		return sizeof(double);
+	case PTL_DOUBLE_COMPLEX:
+		return sizeof(double complex);
+	case PTL_LONG_DOUBLE:
+		return sizeof(long double);
+	case PTL_LONG_DOUBLE_COMPLEX:
+		return sizeof(long double complex);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Store the given small value in the given atomic type
+ */
+static void at_set(ptl_datatype_t type, void *p, int v)
+{
+	switch (type) {
+	case PTL_INT8_T:
+		*(int8_t *)p = v;
+		break;
+	case PTL_UINT8_T:
+		*(uint8_t *)p = v;
+		break;
+	case PTL_INT16_T:
+		*(int16_t *)p = v;
+		break;
+	case PTL_UINT16_T:
+		*(uint16_t *)p = v;
+		break;
+	case PTL_INT32_T:
+		*(int32_t *)p = v;
+		break;
+	case PTL_UINT32_T:
+		*(uint32_t *)p = v;
+		break;
+	case PTL_INT64_T:
+		*(int64_t *)p = v;
+		break;
+	case PTL_UINT64_T:
+		*(uint64_t *)p = v;
+		break;
+	case PTL_FLOAT:
+		*(float *)p = v;
+		break;
+	case PTL_FLOAT_COMPLEX:
+		*(float complex *)p = v + v * I;
+		break;
+	case PTL_DOUBLE:
+		*(double *)p = v;
+		break;
+	case PTL_DOUBLE_COMPLEX:
+		*(double complex *)p = v + v * I;
+		break;
+	case PTL_LONG_DOUBLE:
+		*(long double *)p = v;
+		break;
+	case PTL_LONG_DOUBLE_COMPLEX:
+		*(long double complex *)p = v + v * I;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Return true if the given atomic holds the given small value
+ */
+static int at_check(ptl_datatype_t type, void *p, int v)
+{
+	switch (type) {
+	case PTL_INT8_T:
+		return *(int8_t *)p == v;
+	case PTL_UINT8_T:
+		return *(uint8_t *)p == v;
+	case PTL_INT16_T:
+		return *(int16_t *)p == v;
+	case PTL_UINT16_T:
+		return *(uint16_t *)p == v;
+	case PTL_INT32_T:
+		return *(int32_t *)p == v;
+	case PTL_UINT32_T:
+		return *(uint32_t *)p == (uint32_t)v;
+	case PTL_INT64_T:
+		return *(int64_t *)p == v;
+	case PTL_UINT64_T:
+		return *(uint64_t *)p == (uint64_t)v;
+	case PTL_FLOAT:
+		return *(float *)p == v;
+	case PTL_FLOAT_COMPLEX:
+		return *(float complex *)p == v + v * I;
+	case PTL_DOUBLE:
+		return *(double *)p == v;
+	case PTL_DOUBLE_COMPLEX:
+		return *(double complex *)p == v + v * I;
+	case PTL_LONG_DOUBLE:
+		return *(long double *)p == v;
+	case PTL_LONG_DOUBLE_COMPLEX:
+		return *(long double complex *)p == v + v * I;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Wait for one event of each kind set in the mask, SEND events being
+ * always allowed, and store them in the array indexed by the kind.
+ */
+static int wait_events(struct headers_ni *ni, unsigned int mask, ptl_event_t *evs)
+{
+	unsigned int seen = 0;
+	unsigned int which;
+	ptl_event_t ev;
+	int ret;
+
+	mask |= 1U << PTL_EVENT_SEND;
+	while ((seen | (1U << PTL_EVENT_SEND)) != mask) {
+		ret = PtlEQPoll(&ni->eqh, 1, HEADERS_TIMEOUT, &ev, &which);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlEQPoll failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 0;
+		}
+		if (ev.ni_fail_type != PTL_NI_OK) {
+			fprintf(stderr, "%s event failed : %s \n", PtlToStr(ev.type, PTL_STR_EVENT),
+				PtlToStr(ev.ni_fail_type, PTL_STR_FAIL_TYPE));
+			return 0;
+		}
+		if (!(mask & (1U << ev.type)) || (seen & (1U << ev.type))) {
+			fprintf(stderr, "unexpected %s event\n", PtlToStr(ev.type, PTL_STR_EVENT));
+			return 0;
+		}
+		seen |= 1U << ev.type;
+		evs[ev.type] = ev;
+	}
+	return 1;
+}
+
+/*
+ * Check the fields of a target side event
+ */
+static int check_target(ptl_event_t *ev, uint64_t bits, uint64_t hdr_data, ptl_size_t offs,
+			ptl_size_t len)
+{
+	if (ev->match_bits != bits || ev->hdr_data != hdr_data || ev->remote_offset != offs ||
+	    ev->rlength != len || ev->mlength != len || ev->pt_index != HEADERS_PTI) {
+		fprintf(stderr,
+			"%s: bits 0x%lx/0x%lx, hdr_data 0x%lx/0x%lx, offset %lu/%lu, "
+			"rlength %lu/%lu, mlength %lu/%lu, pt %u\n",
+			PtlToStr(ev->type, PTL_STR_EVENT), ev->match_bits, bits, ev->hdr_data,
+			hdr_data, ev->remote_offset, offs, ev->rlength, len, ev->mlength, len,
+			ev->pt_index);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check the fields of an initiator side event
+ */
+static int check_initiator(ptl_event_t *ev, ptl_size_t offs, ptl_size_t len)
+{
+	if (ev->remote_offset != offs || ev->mlength != len) {
+		fprintf(stderr, "%s: offset %lu/%lu, mlength %lu/%lu\n",
+			PtlToStr(ev->type, PTL_STR_EVENT), ev->remote_offset, offs, ev->mlength,
+			len);
+		return 0;
+	}
+	return 1;
+}
+
+static int check_atomic(ptl_event_t *ev, ptl_op_t op, ptl_datatype_t type)
+{
+	if (ev->atomic_operation != op || ev->atomic_type != type) {
+		fprintf(stderr, "%s: op %d/%d, type %d/%d\n", PtlToStr(ev->type, PTL_STR_EVENT),
+			ev->atomic_operation, op, ev->atomic_type, type);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * PUT then GET back a message with the given fields, using an ack or not
+ */
+static int put_get(struct headers_ni *ni, int i, ptl_ack_req_t ack)
+{
+	ptl_event_t evs[PTL_EVENT_LINK + 1];
+	uint64_t v = values[i % NELEMS(values)];
+	ptl_size_t offs = offsets[i % NELEMS(offsets)];
+	ptl_size_t len = lengths[i % NELEMS(lengths)];
+	unsigned int mask;
+	ptl_size_t j;
+	int ret;
+
+	for (j = 0; j < len; j++)
+		ni->sbuf[j] = pattern(j, i);
+	memset(ni->rbuf, 0, HEADERS_BUFSZ);
+
+	ret = PtlPut(ni->mdh, 0, len, ack, ni->id, HEADERS_PTI, v, offs, NULL, ~v);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 0;
+	}
+	mask = 1U << PTL_EVENT_PUT;
+	if (ack == PTL_ACK_REQ)
+		mask |= 1U << PTL_EVENT_ACK;
+	if (!wait_events(ni, mask, evs))
+		return 0;
+	if (!check_target(&evs[PTL_EVENT_PUT], v, ~v, offs, len))
+		return 0;
+	if (ack == PTL_ACK_REQ && !check_initiator(&evs[PTL_EVENT_ACK], offs, len))
+		return 0;
+	for (j = 0; j < len; j++) {
+		if (ni->rbuf[offs + j] != pattern(j, i)) {
+			fprintf(stderr, "%d: put: bad byte at %lu\n", i, j);
+			return 0;
+		}
+	}
+
+	memset(ni->sbuf, 0, len);
+
+	ret = PtlGet(ni->mdh, 0, len, ni->id, HEADERS_PTI, ~v, offs, NULL);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlGet failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 0;
+	}
+	if (!wait_events(ni, (1U << PTL_EVENT_GET) | (1U << PTL_EVENT_REPLY), evs))
+		return 0;
+	if (!check_target(&evs[PTL_EVENT_GET], ~v, 0, offs, len))
+		return 0;
+	if (!check_initiator(&evs[PTL_EVENT_REPLY], offs, len))
+		return 0;
+	for (j = 0; j < len; j++) {
+		if (ni->sbuf[j] != pattern(j, i)) {
+			fprintf(stderr, "%d: get: bad byte at %lu\n", i, j);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Do the atomic, with the operand in the send buffer, and check the
+ * events. If the operation fetches, the old value goes in the second
+ * half of the send buffer.
+ */
+static int atomic(struct headers_ni *ni, int i, ptl_op_t op, ptl_datatype_t type, int fetch,
+		  void *cst)
+{
+	ptl_event_t evs[PTL_EVENT_LINK + 1];
+	uint64_t v = values[i % NELEMS(values)];
+	ptl_size_t offs = HEADERS_ATOFFS + 64 * i;
+	ptl_size_t len = at_size(type);
+	ptl_event_kind_t kind;
+	int ret;
+
+	if (cst != NULL) {
+		ret = PtlSwap(ni->mdh, HEADERS_BUFSZ / 2, ni->mdh, 0, len, ni->id, HEADERS_PTI, v,
+			      offs, NULL, ~v, cst, op, type);
+	} else if (fetch) {
+		ret = PtlFetchAtomic(ni->mdh, HEADERS_BUFSZ / 2, ni->mdh, 0, len, ni->id,
+				     HEADERS_PTI, v, offs, NULL, ~v, op, type);
+	} else {
+		ret = PtlAtomic(ni->mdh, 0, len, PTL_ACK_REQ, ni->id, HEADERS_PTI, v, offs, NULL,
+				~v, op, type);
+	}
+	if (ret != PTL_OK) {
+		fprintf(stderr, "atomic failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 0;
+	}
+
+	kind = fetch ? PTL_EVENT_FETCH_ATOMIC : PTL_EVENT_ATOMIC;
+	if (!wait_events(ni, (1U << kind) | (1U << (fetch ? PTL_EVENT_REPLY : PTL_EVENT_ACK)),
+			 evs))
+		return 0;
+	if (!check_target(&evs[kind], v, ~v, offs, len) || !check_atomic(&evs[kind], op, type))
+		return 0;
+	if (!check_initiator(&evs[fetch ? PTL_EVENT_REPLY : PTL_EVENT_ACK], offs, len))
+		return 0;
+	return 1;
+}
+
+/*
+ * Run a sequence of atomics of the given type on a fresh location,
+ * checking the target and fetched values after each one
+ */
+static int atomics(struct headers_ni *ni, int i, ptl_datatype_t type)
+{
+	unsigned char cst[64];
+	unsigned char *target = ni->rbuf + HEADERS_ATOFFS + 64 * i;
+	unsigned char *fetched = ni->sbuf + HEADERS_BUFSZ / 2;
+
+	memset(target, 0, 64);
+
+	/* 0 + 2 */
+	at_set(type, ni->sbuf, 2);
+	if (!atomic(ni, i, PTL_SUM, type, 0, NULL))
+		return 0;
+	if (!at_check(type, target, 2)) {
+		fprintf(stderr, "type %d: sum: bad target\n", type);
+		return 0;
+	}
+
+	/* 2 + 3 */
+	at_set(type, ni->sbuf, 3);
+	if (!atomic(ni, i, PTL_SUM, type, 1, NULL))
+		return 0;
+	if (!at_check(type, fetched, 2) || !at_check(type, target, 5)) {
+		fprintf(stderr, "type %d: fetch sum: bad value\n", type);
+		return 0;
+	}
+
+	/* 5 == 5, swapped with 7 */
+	at_set(type, ni->sbuf, 7);
+	at_set(type, cst, 5);
+	if (!atomic(ni, i, PTL_CSWAP, type, 1, cst))
+		return 0;
+	if (!at_check(type, fetched, 5) || !at_check(type, target, 7)) {
+		fprintf(stderr, "type %d: cswap: bad value\n", type);
+		return 0;
+	}
+
+	/* 7 != 6, not swapped */
+	at_set(type, ni->sbuf, 9);
+	at_set(type, cst, 6);
+	if (!atomic(ni, i, PTL_CSWAP, type, 1, cst))
+		return 0;
+	if (!at_check(type, fetched, 7) || !at_check(type, target, 7)) {
+		fprintf(stderr, "type %d: cswap mismatch: bad value\n", type);
+		return 0;
+	}
+
+	/* swapped with 11 */
+	at_set(type, ni->sbuf, 11);
+	if (!atomic(ni, i, PTL_SWAP, type, 1, cst))
+		return 0;
+	if (!at_check(type, fetched, 7) || !at_check(type, target, 11)) {
+		fprintf(stderr, "type %d: swap: bad value\n", type);
+		return 0;
+	}
+
+	if (!is_integer(type))
+		return 1;
+
+	/* low 4 bits of 0x34 in 0xb */
+	at_set(type, ni->sbuf, 0x34);
+	at_set(type, cst, 0x0f);
+	if (!atomic(ni, i, PTL_MSWAP, type, 1, cst))
+		return 0;
+	if (!at_check(type, fetched, 11) || !at_check(type, target, 4)) {
+		fprintf(stderr, "type %d: mswap: bad value\n", type);
+		return 0;
+	}
+
+	return 1;
+}
+
+int main(void)
+{
+	struct headers_ni ni;
+	ptl_index_t pti;
+	ptl_handle_me_t meh;
+	ptl_me_t me;
+	ptl_md_t md;
+	unsigned int i;
+	int res = 1;
+	int ret;
+
+	ni.sbuf = calloc(1, HEADERS_BUFSZ);
+	ni.rbuf = calloc(1, HEADERS_BUFSZ);
+	if (ni.sbuf == NULL || ni.rbuf == NULL) {
+		fprintf(stderr, "calloc failed\n");
+		return 1;
+	}
+
+	ret = PtlInit();
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	ret = PtlNIInit(PTL_IFACE_DEFAULT, PTL_NI_MATCHING | PTL_NI_PHYSICAL, PTL_PID_ANY, NULL,
+			NULL, &ni.nih);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlNIInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		goto fini;
+	}
+
+	ret = PtlGetId(ni.nih, &ni.id);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlGetId failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		goto ni_fini;
+	}
+
+	ret = PtlEQAlloc(ni.nih, 16, &ni.eqh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		goto ni_fini;
+	}
+
+	ret = PtlPTAlloc(ni.nih, 0, ni.eqh, HEADERS_PTI, &pti);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlPTAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		goto eq_free;
+	}
+
+	/* match everything, the offsets are the ones of the initiator */
+	me = (ptl_me_t){
+		.start = ni.rbuf,
+		.length = HEADERS_BUFSZ,
+		.ct_handle = PTL_CT_NONE,
+		.uid = PTL_UID_ANY,
+		.options = PTL_ME_OP_PUT | PTL_ME_OP_GET | PTL_ME_EVENT_LINK_DISABLE,
+		.match_id.phys = { .nid = PTL_NID_ANY, .pid = PTL_PID_ANY },
+		.match_bits = 0,
+		.ignore_bits = ~(ptl_match_bits_t)0,
+	};
+	ret = PtlMEAppend(ni.nih, pti, &me, PTL_PRIORITY_LIST, NULL, &meh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMEAppend failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		goto pt_free;
+	}
+
+	md = (ptl_md_t){
+		.start = ni.sbuf,
+		.length = HEADERS_BUFSZ,
+		.options = 0,
+		.eq_handle = ni.eqh,
+		.ct_handle = PTL_CT_NONE,
+	};
+	ret = PtlMDBind(ni.nih, &md, &ni.mdh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMDBind failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		goto me_unlink;
+	}
+
+	/*
+	 * The first message of a connection may be encoded differently, so
+	 * make sure the values are sent once the connection is established
+	 */
+	for (i = 0; i < NELEMS(values) * NELEMS(offsets); i++) {
+		if (!put_get(&ni, i, i % 2 ? PTL_NO_ACK_REQ : PTL_ACK_REQ))
+			goto md_release;
+	}
+
+	for (i = 0; i < NELEMS(types); i++) {
+		if (!atomics(&ni, i, types[i]))
+			goto md_release;
+	}
+
+	printf("headers: %zu messages, %zu atomic types ok\n", 2 * NELEMS(values) * NELEMS(offsets),
+	       NELEMS(types));
+	res = 0;
+
+md_release:
+	PtlMDRelease(ni.mdh);
+me_unlink:
+	PtlMEUnlink(meh);
+pt_free:
+	PtlPTFree(ni.nih, pti);
+eq_free:
+	PtlEQFree(ni.eqh);
+ni_fini:
+	PtlNIFini(ni.nih);
+fini:
+	PtlFini();
+	free(ni.sbuf);
+	free(ni.rbuf);
+	return res;
+}
@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "portals4.h"
+#include "portals4_ext.h"
+
+/*
+ * This example checks that messages get through intact whatever
+ * happens to the packets carrying them. In each round, the parent
+ * process PUTs a message to its child, which checks it and PUTs it
+ * back altered, then the parent GETs the original message back from
+ * the child. All payloads are checked.
+ *
+ * It's meant to be run with the knobs of the transport, for instance:
+ *  - PORTALS4_UDP_DROP and PORTALS4_UDP_REORDER to lose and reorder
+ *    the received datagrams,
+ *  - PORTALS4_SEQ_START to cross the wraparound of the sequence
+ *    numbers,
+ *  - PORTALS4_CONN_IDLE, with a pause between rounds longer than it,
+ *    to free the connections and resume them. The parent alternates
+ *    between sleeping, so that only the child frees its connection and
+ *    the parent resumes it, and waiting for events, so that both free
+ *    their connection and synchronize again.
+ *
+ * Usage: transfer [number of rounds] [message size] [pause in ms]
+ */
+
+/* hdr_data of the last PUT, telling the child to exit */
+#define TRANSFER_STOP (~(ptl_hdr_data_t)0)
+
+/* ids of the parent and the child, in memory shared by both */
+struct transfer_ids {
+	atomic_int ready[2];
+	atomic_int done[2];
+	ptl_process_t id[2];
+};
+
+/*
+ * The PUTs of the peer are received in rbuf. The first half of sbuf is
+ * the source of the PUTs, the second half the target of the GETs.
+ */
+struct transfer_ni {
+	ptl_handle_ni_t nih;
+	ptl_handle_eq_t eqh;
+	ptl_index_t pti;
+	ptl_handle_md_t mdh;
+	ptl_handle_me_t meh;
+	unsigned char *rbuf;
+	unsigned char *sbuf;
+	ptl_size_t size;
+};
+
+static unsigned char pattern(ptl_size_t i, unsigned long round, int salt)
+{
+	return (unsigned char)(i * 7 + round * 131 + salt);
+}
+
+static void fill(unsigned char *buf, ptl_size_t size, unsigned long round, int salt)
+{
+	ptl_size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = pattern(i, round, salt);
+}
+
+static int check(const char *what, unsigned char *buf, ptl_size_t size, unsigned long round,
+		 int salt)
+{
+	ptl_size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] != pattern(i, round, salt)) {
+			fprintf(stderr, "round %lu: %s: byte %lu is 0x%02x instead of 0x%02x\n",
+				round, what, (unsigned long)i, buf[i], pattern(i, round, salt));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int ni_init(struct transfer_ni *ni, ptl_size_t size)
+{
+	ptl_index_t pti;
+	ptl_event_t ev;
+	ptl_me_t me;
+	ptl_md_t md;
+	int ret;
+
+	ni->size = size;
+	ni->rbuf = calloc(1, size + 1);
+	ni->sbuf = calloc(2, size + 1);
+	if (ni->rbuf == NULL || ni->sbuf == NULL) {
+		fprintf(stderr, "can't allocate buffers\n");
+		return 1;
+	}
+
+	ret = PtlNIInit(PTL_IFACE_DEFAULT, PTL_NI_MATCHING | PTL_NI_PHYSICAL, PTL_PID_ANY, NULL,
+			NULL, &ni->nih);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlNIInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	ret = PtlEQAlloc(ni->nih, 64, &ni->eqh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	ret = PtlPTAlloc(ni->nih, 0, ni->eqh, 0, &pti);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlPTAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+	ni->pti = pti;
+
+	me = (ptl_me_t){ .start = ni->rbuf,
+			 .length = size,
+			 .ct_handle = PTL_CT_NONE,
+			 .uid = PTL_UID_ANY,
+			 .options = PTL_ME_OP_PUT | PTL_ME_OP_GET,
+			 .match_id.phys = { .nid = PTL_NID_ANY, .pid = PTL_PID_ANY },
+			 .match_bits = 0,
+			 .ignore_bits = 0,
+			 .min_free = 0 };
+
+	ret = PtlMEAppend(ni->nih, pti, &me, PTL_PRIORITY_LIST, NULL, &ni->meh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMEAppend failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	/* wait for the LINK event */
+	ret = PtlEQWait(ni->eqh, &ev);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	md = (ptl_md_t){ .start = ni->sbuf,
+			 .length = 2 * size,
+			 .options = 0,
+			 .eq_handle = ni->eqh,
+			 .ct_handle = PTL_CT_NONE };
+
+	ret = PtlMDBind(ni->nih, &md, &ni->mdh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMDBind failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	return 0;
+}
+
+static void ni_fini(struct transfer_ni *ni)
+{
+	PtlMDRelease(ni->mdh);
+	PtlMEUnlink(ni->meh);
+	PtlPTFree(ni->nih, ni->pti);
+	PtlEQFree(ni->eqh);
+	PtlNIFini(ni->nih);
+	free(ni->sbuf);
+	free(ni->rbuf);
+}
+
+/*
+ * Wait for the next event other than SEND, check that it succeeded and
+ * moved the expected number of bytes
+ */
+static int next_event(struct transfer_ni *ni, ptl_event_t *ev, ptl_size_t size)
+{
+	int ret;
+
+	do {
+		ret = PtlEQWait(ni->eqh, ev);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+	} while (ev->type == PTL_EVENT_SEND && ev->ni_fail_type == PTL_NI_OK);
+
+	if (ev->ni_fail_type != PTL_NI_OK) {
+		fprintf(stderr, "%s failed : %s\n", PtlToStr(ev->type, PTL_STR_EVENT),
+			PtlToStr(ev->ni_fail_type, PTL_STR_FAIL_TYPE));
+		return 1;
+	}
+	if (ev->mlength != size) {
+		fprintf(stderr, "%s: %lu bytes instead of %lu\n", PtlToStr(ev->type, PTL_STR_EVENT),
+			(unsigned long)ev->mlength, (unsigned long)size);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for the given time, sleeping or letting the library run
+ */
+static int wait_idle(struct transfer_ni *ni, unsigned int ms, int progress)
+{
+	struct timespec ts;
+	double end, left;
+	unsigned int which;
+	ptl_event_t ev;
+	int ret;
+
+	if (!progress) {
+		usleep(ms * 1000);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	end = ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6 + ms;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		left = end - (ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6);
+		if (left <= 0)
+			return 0;
+		ret = PtlEQPoll(&ni->eqh, 1, left + 1, &ev, &which);
+		if (ret == PTL_EQ_EMPTY || (ret == PTL_OK && ev.type == PTL_EVENT_SEND))
+			continue;
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlEQPoll failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+		fprintf(stderr, "unexpected %s\n", PtlToStr(ev.type, PTL_STR_EVENT));
+		return 1;
+	}
+}
+
+/*
+ * Child: check the PUTs and send them back altered, until the last one
+ */
+static int echo(struct transfer_ni *ni, ptl_process_t peer)
+{
+	ptl_event_t ev;
+	int ret;
+
+	for (;;) {
+		ret = PtlEQWait(ni->eqh, &ev);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+		if (ev.type != PTL_EVENT_PUT)
+			continue;
+		if (ev.hdr_data == TRANSFER_STOP)
+			return 0;
+		if (ev.ni_fail_type != PTL_NI_OK || ev.mlength != ni->size) {
+			fprintf(stderr, "round %lu: bad PUT\n", (unsigned long)ev.hdr_data);
+			return 1;
+		}
+		if (check("put", ni->rbuf, ni->size, ev.hdr_data, 0))
+			return 1;
+
+		fill(ni->sbuf, ni->size, ev.hdr_data, 1);
+		ret = PtlPut(ni->mdh, 0, ni->size, PTL_NO_ACK_REQ, peer, ni->pti, 0, 0, NULL,
+			     ev.hdr_data);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+	}
+}
+
+/*
+ * Parent: run the rounds, pausing for the given time between them
+ */
+static int drive(struct transfer_ni *ni, ptl_process_t peer, unsigned long rounds,
+		 unsigned int pause)
+{
+	int acked, echoed;
+	unsigned long r;
+	ptl_event_t ev;
+	int ret;
+
+	for (r = 0; r < rounds; r++) {
+		if (r > 0 && pause > 0 && wait_idle(ni, pause, r % 2))
+			return 1;
+
+		fill(ni->sbuf, ni->size, r, 0);
+		ret = PtlPut(ni->mdh, 0, ni->size, PTL_ACK_REQ, peer, ni->pti, 0, 0, NULL, r);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+
+		/* the ACK and the echo come in any order */
+		acked = echoed = 0;
+		while (!acked || !echoed) {
+			if (next_event(ni, &ev, ni->size))
+				return 1;
+			if (ev.type == PTL_EVENT_ACK) {
+				acked = 1;
+			} else if (ev.type == PTL_EVENT_PUT && ev.hdr_data == r) {
+				if (check("echo", ni->rbuf, ni->size, r, 1))
+					return 1;
+				echoed = 1;
+			} else {
+				fprintf(stderr, "round %lu: unexpected %s\n", r,
+					PtlToStr(ev.type, PTL_STR_EVENT));
+				return 1;
+			}
+		}
+
+		memset(ni->sbuf + ni->size, 0, ni->size);
+		ret = PtlGet(ni->mdh, ni->size, ni->size, peer, ni->pti, 0, 0, NULL);
+		if (ret != PTL_OK) {
+			fprintf(stderr, "PtlGet failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			return 1;
+		}
+		if (next_event(ni, &ev, ni->size))
+			return 1;
+		if (ev.type != PTL_EVENT_REPLY) {
+			fprintf(stderr, "round %lu: unexpected %s\n", r,
+				PtlToStr(ev.type, PTL_STR_EVENT));
+			return 1;
+		}
+		if (check("get", ni->sbuf + ni->size, ni->size, r, 0))
+			return 1;
+	}
+
+	/* tell the child to exit */
+	ret = PtlPut(ni->mdh, 0, 0, PTL_ACK_REQ, peer, ni->pti, 0, 0, NULL, TRANSFER_STOP);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlPut failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+	if (next_event(ni, &ev, 0))
+		return 1;
+
+	printf("%lu rounds of %lu bytes\n", rounds, (unsigned long)ni->size);
+	return 0;
+}
+
+static int run(struct transfer_ids *ids, int child, unsigned long rounds, ptl_size_t size,
+	       unsigned int pause)
+{
+	struct transfer_ni ni;
+	ptl_process_t peer;
+	unsigned int which;
+	ptl_event_t ev;
+	int res = 0;
+	int ret;
+
+	ret = PtlInit();
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	if (ni_init(&ni, size)) {
+		res = 1;
+		goto fini;
+	}
+
+	ret = PtlGetPhysId(ni.nih, &ids->id[child]);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlGetPhysId failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto fini;
+	}
+	atomic_store(&ids->ready[child], 1);
+	while (!atomic_load(&ids->ready[!child]))
+		;
+	peer = ids->id[!child];
+
+	if (child)
+		res = echo(&ni, peer);
+	else
+		res = drive(&ni, peer, rounds, pause);
+
+	/*
+	 * The last acks may be lost: keep acking retransmits until the
+	 * peer is done as well, or it may wait for them forever
+	 */
+	atomic_store(&ids->done[child], 1);
+	while (!atomic_load(&ids->done[!child])) {
+		ret = PtlEQPoll(&ni.eqh, 1, 10, &ev, &which);
+		if (ret != PTL_OK && ret != PTL_EQ_EMPTY) {
+			fprintf(stderr, "PtlEQPoll failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+			res = 1;
+			break;
+		}
+	}
+
+	ni_fini(&ni);
+fini:
+	PtlFini();
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	struct transfer_ids *ids;
+	unsigned long rounds = 100;
+	ptl_size_t size = 100000;
+	unsigned int pause = 0;
+	int res, status;
+	pid_t pid;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		size = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		pause = strtoul(argv[3], NULL, 0);
+	if (rounds == 0 || size == 0) {
+		fprintf(stderr, "usage: %s [number of rounds] [message size] [pause in ms]\n",
+			argv[0]);
+		return 1;
+	}
+
+	ids = mmap(NULL, sizeof(*ids), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (ids == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	atomic_init(&ids->ready[0], 0);
+	atomic_init(&ids->ready[1], 0);
+	atomic_init(&ids->done[0], 0);
+	atomic_init(&ids->done[1], 0);
+
+	/* fork before PtlInit, as required by the Portals4 specification */
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+		return run(ids, 1, rounds, size, pause);
+
+	res = run(ids, 0, rounds, size, pause);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "child failed\n");
+		res = 1;
+	}
+
+	return res;
+}
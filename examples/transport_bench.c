@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "portals4.h"
+#include "portals4_ext.h"
+
+/*
+ * This example compares the transport backends side by side. For each
+ * backend, a child process is forked with PORTALS4_TRANSPORT,
+ * PORTALS4_SHM and PORTALS4_VM_RDV set, and runs PUT transfers to itself:
+ *	- latency: one PUT at a time, waiting for its completion events
+ *	- message rate: windows of small PUTs posted back to back
+ *	- bandwidth: large PUTs, one at a time
+ *
+ * Usage: transport_bench [iterations] [large message size]
+ */
+
+#define BENCH_SMALL_SIZE 8
+#define BENCH_WINDOW 32
+
+/* SEND and ACK on the initiator side, PUT on the target side */
+#define BENCH_EVENTS_PER_PUT 3
+
+/*
+ * transfers to ourselves go through shared memory, unless disabled, and
+ * large payloads are moved with process_vm_readv, unless disabled (NULL
+ * keeps the default threshold)
+ */
+static const struct {
+	const char *name;
+	const char *transport;
+	const char *shm;
+	const char *vm_rdv;
+} transports[] = {
+	{ "udp", "udp", "0", "0" },
+	{ "uring", "uring", "0", "0" },
+	{ "shm", "udp", "1", "0" },
+	{ "vm", "udp", "1", NULL },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Issue count PUTs of the given size to ourselves, with at most window
+ * of them in flight, and return the elapsed time in seconds (or a
+ * negative value on failure)
+ */
+static double bench_put(ptl_handle_ni_t nih, ptl_handle_eq_t eqh, ptl_handle_md_t mdh,
+			ptl_process_t id, ptl_index_t pti, ptl_size_t size, int count, int window)
+{
+	ptl_event_t ev;
+	double start;
+	int i, n, ret;
+
+	start = now();
+	for (i = 0; i < count; i += n) {
+		n = count - i < window ? count - i : window;
+
+		for (int j = 0; j < n; j++) {
+			ret = PtlPut(mdh, 0, size, PTL_ACK_REQ, id, pti, 0, 0, NULL, 0);
+			if (ret != PTL_OK) {
+				fprintf(stderr, "PtlPut failed : %s \n",
+					PtlToStr(ret, PTL_STR_ERROR));
+				return -1;
+			}
+		}
+
+		for (int j = 0; j < n * BENCH_EVENTS_PER_PUT; j++) {
+			ret = PtlEQWait(eqh, &ev);
+			if (ret != PTL_OK || ev.ni_fail_type != PTL_NI_OK) {
+				fprintf(stderr, "PtlEQWait failed : %s \n",
+					PtlToStr(ret, PTL_STR_ERROR));
+				return -1;
+			}
+		}
+	}
+
+	return now() - start;
+}
+
+static int bench(const char *transport, int iterations, ptl_size_t size)
+{
+	int res = 0;
+	int ret;
+	ptl_handle_ni_t nih;
+	ptl_handle_eq_t eqh;
+	ptl_index_t pti;
+	ptl_handle_le_t leh;
+	ptl_process_t id;
+	ptl_event_t ev;
+	ptl_le_t le;
+	ptl_md_t md;
+	ptl_handle_md_t mdh;
+	char *send_buf, *recv_buf;
+	double lat, rate, bw;
+
+	send_buf = calloc(1, size);
+	recv_buf = calloc(1, size);
+	if (send_buf == NULL || recv_buf == NULL) {
+		fprintf(stderr, "%s: can't allocate buffers\n", transport);
+		return 1;
+	}
+
+	ret = PtlInit();
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlInit failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		return 1;
+	}
+
+	ret = PtlNIInit(PTL_IFACE_DEFAULT, PTL_NI_NO_MATCHING | PTL_NI_PHYSICAL, PTL_PID_ANY, NULL,
+			NULL, &nih);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "%s: PtlNIInit failed : %s \n", transport,
+			PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto fini;
+	}
+
+	ret = PtlGetId(nih, &id);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlGetId failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto ni_fini;
+	}
+
+	ret = PtlEQAlloc(nih, 4 * BENCH_WINDOW * BENCH_EVENTS_PER_PUT, &eqh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto ni_fini;
+	}
+
+	ret = PtlPTAlloc(nih, 0, eqh, PTL_PT_ANY, &pti);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlPTAlloc failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto eq_free;
+	}
+
+	le = (ptl_le_t){
+		.start = recv_buf,
+		.length = size,
+		.ct_handle = PTL_CT_NONE,
+		.uid = PTL_UID_ANY,
+		.options = PTL_LE_OP_PUT,
+	};
+
+	ret = PtlLEAppend(nih, pti, &le, PTL_PRIORITY_LIST, NULL, &leh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlLEAppend failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto pt_free;
+	}
+
+	/* wait for the LINK event */
+	ret = PtlEQWait(eqh, &ev);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlEQWait failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto le_unlink;
+	}
+
+	md = (ptl_md_t){ .start = send_buf,
+			 .length = size,
+			 .options = 0,
+			 .eq_handle = eqh,
+			 .ct_handle = PTL_CT_NONE };
+
+	ret = PtlMDBind(nih, &md, &mdh);
+	if (ret != PTL_OK) {
+		fprintf(stderr, "PtlMDBind failed : %s \n", PtlToStr(ret, PTL_STR_ERROR));
+		res = 1;
+		goto le_unlink;
+	}
+
+	/* warm up connections and buffers */
+	if (bench_put(nih, eqh, mdh, id, pti, BENCH_SMALL_SIZE, BENCH_WINDOW, BENCH_WINDOW) < 0) {
+		res = 1;
+		goto md_release;
+	}
+
+	lat = bench_put(nih, eqh, mdh, id, pti, BENCH_SMALL_SIZE, iterations, 1);
+	rate = bench_put(nih, eqh, mdh, id, pti, BENCH_SMALL_SIZE, iterations, BENCH_WINDOW);
+	bw = bench_put(nih, eqh, mdh, id, pti, size, iterations / 10 + 1, 1);
+	if (lat < 0 || rate < 0 || bw < 0) {
+		res = 1;
+		goto md_release;
+	}
+
+	printf("%-6s %10.2f us %12.0f msg/s %10.1f MB/s\n", transport, 1e6 * lat / iterations,
+	       iterations / rate, (iterations / 10 + 1) * (double)size / bw / 1e6);
+
+md_release:
+	PtlMDRelease(mdh);
+le_unlink:
+	PtlLEUnlink(leh);
+pt_free:
+	PtlPTFree(nih, pti);
+eq_free:
+	PtlEQFree(eqh);
+ni_fini:
+	PtlNIFini(nih);
+fini:
+	PtlFini();
+	free(send_buf);
+	free(recv_buf);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = 10000;
+	ptl_size_t size = 1024 * 1024;
+	int res = 0;
+	int status;
+	pid_t pid;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (argc > 2)
+		size = atol(argv[2]);
+	if (iterations <= 0 || size < BENCH_SMALL_SIZE) {
+		fprintf(stderr, "usage: %s [iterations] [large message size]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-6s %13s %18s %15s\n", "", "8B latency", "8B rate", "bandwidth");
+
+	/*
+	 * Run each transport in its own process, as PtlInit() selects
+	 * the transport once for all.
+	 */
+	for (int i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			setenv("PORTALS4_TRANSPORT", transports[i].transport, 1);
+			setenv("PORTALS4_SHM", transports[i].shm, 1);
+			if (transports[i].vm_rdv != NULL)
+				setenv("PORTALS4_VM_RDV", transports[i].vm_rdv, 1);
+			else
+				unsetenv("PORTALS4_VM_RDV");
+			return bench(transports[i].name, iterations, size);
+		}
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s: benchmark failed\n", transports[i].name);
+			res = 1;
+		}
+	}
+
+	return res;
+}
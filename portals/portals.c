@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -112,13 +113,81 @@ int PtlInit(void)
 	struct swptl_options opts;
 	struct bximsg_options msg_opts;
 	struct bxipkt_udp_options transport_opts;
+	const char *env;
 
 	bximsg_options_set_default(&msg_opts);
-	bxipkt_options_set_default(&transport_opts.global);
+	bxipkt_udp_options_set_default(&transport_opts);
 	swptl_options_set_default(&opts);
+	/* Both transports use the UDP options, "udp" is the default */
+	env = getenv("PORTALS4_TRANSPORT");
+	if (env != NULL && strcmp(env, "uring") == 0)
+		msg_opts.transport = &bxipkt_uring;
+	/* Shared memory between processes of the node, unless disabled */
+	env = getenv("PORTALS4_SHM");
+	if (env != NULL && strcmp(env, "0") == 0)
+		transport_opts.shm = false;
+	/* Min. size of datagrams sent with MSG_ZEROCOPY, 0 disables */
+	env = getenv("PORTALS4_ZEROCOPY");
+	if (env != NULL)
+		transport_opts.zerocopy = strtoul(env, NULL, 0);
+	/* Ethernet sized packets, whatever the MTU of the interface */
+	env = getenv("PORTALS4_DEFAULT_MTU");
+	if (env != NULL)
+		transport_opts.default_mtu = strcmp(env, "0") != 0;
+	/* UDP segmentation offload, disabled by default */
+	env = getenv("PORTALS4_GSO");
+	if (env != NULL)
+		transport_opts.gso = strcmp(env, "0") != 0;
+	/* Sockets receiving on the port of an interface */
+	env = getenv("PORTALS4_RX_SHARDS");
+	if (env != NULL)
+		transport_opts.rx_shards = strtoul(env, NULL, 0);
+	/* Received datagrams dropped or reordered per 1000, for testing */
+	env = getenv("PORTALS4_UDP_DROP");
+	if (env != NULL)
+		transport_opts.drop = strtoul(env, NULL, 0);
+	env = getenv("PORTALS4_UDP_REORDER");
+	if (env != NULL)
+		transport_opts.reorder = strtoul(env, NULL, 0);
+	/* Min. size of PUT/GET payloads moved with process_vm_readv/writev, 0 disables */
+	env = getenv("PORTALS4_VM_RDV");
+	if (env != NULL)
+		opts.vm_rdv = strtoul(env, NULL, 0);
+	/* Send payloads straight from user memory, unless disabled */
+	env = getenv("PORTALS4_GATHER");
+	if (env != NULL && strcmp(env, "0") == 0)
+		msg_opts.gather = false;
+	/* Max. time in microseconds an ack may be delayed, 0 disables */
+	env = getenv("PORTALS4_ACK_DELAY");
+	if (env != NULL)
+		msg_opts.ack_delay = strtoul(env, NULL, 0);
+	/* Max. retransmit timeout in microseconds */
+	env = getenv("PORTALS4_TX_TIMEOUT_MAX");
+	if (env != NULL)
+		msg_opts.tx_timeout_max = strtoul(env, NULL, 0);
+	/* Time in microseconds after which an idle connection is freed, 0 disables */
+	env = getenv("PORTALS4_CONN_IDLE");
+	if (env != NULL)
+		msg_opts.conn_idle = strtoul(env, NULL, 0);
+	/* Offset of the initial sequence numbers, to test their wraparound */
+	env = getenv("PORTALS4_SEQ_START");
+	if (env != NULL)
+		msg_opts.seq_start = strtoul(env, NULL, 0);
+	/* Pack small messages into one packet, unless disabled */
+	env = getenv("PORTALS4_AGGREGATE");
+	if (env != NULL && strcmp(env, "0") == 0)
+		msg_opts.aggregate = false;
+	env = getenv("PORTALS4_INTERLEAVE");
+	if (env != NULL)
+		msg_opts.interleave = strtoul(env, NULL, 0);
+	/* Comma-separated send queue weights of the virtual circuits */
+	env = getenv("PORTALS4_VC_WEIGHTS");
+	for (int i = 0; env != NULL && i < BXIMSG_VC_COUNT; i++) {
+		msg_opts.vc_weight[i] = strtoul(env, (char **)&env, 0);
+		env = *env == ',' ? env + 1 : NULL;
+	}
 	/* TODO: allow the user to choose the IP */
 	transport_opts.ip = "127.0.0";
-	transport_opts.default_mtu = false;
 	return swptl_func_libinit(&opts, &msg_opts, &transport_opts.global, &ctx_global);
 }
 
@@ -38,15 +38,40 @@
 #define BXIMSG_TX_TIMEOUT_MAX 1000000
 #define BXIMSG_TX_NET_TIMEOUT 20000
 #define BXIMSG_TX_NET_TIMEOUT_MAX 10000000
+/* Min. retransmit timeout once the round-trip time is measured */
+#define BXIMSG_TX_RTO_MIN 1000
 #define BXIMSG_MAX_RETRIES 30
-#define BXIMSG_NACK_MAX 10
+#define BXIMSG_NACK_MAX 256
+/* Max. packets in flight to peers using 16-bit seq. numbers */
+#define BXIMSG_SEQ16_WND_MAX 0x4000
+/* Initial congestion window, in packets */
+#define BXIMSG_CWND_INIT 10
+/* Duplicate acks triggering a fast retransmit */
+#define BXIMSG_DUPACK_THRESH 3
+/* Received packets acked at once, max. time in microseconds an ack waits for them */
+#define BXIMSG_ACK_EVERY 2
+#define BXIMSG_ACK_DELAY 200
 #define BXIMSG_NBUFS 32
-#define BXIMSG_HASHSIZE 1024
-#define BXIMSG_HASH(nid, pid, vc)                                                                  \
-	(((unsigned int)(nid) + 31 * (unsigned int)(pid) + 5 * (unsigned int)(vc)) %               \
-	 BXIMSG_HASHSIZE)
+/* Maximum number of packets passed to the transport at once */
+#define BXIMSG_SEND_BATCH 32
+#define BXIMSG_SEND_BATCH_SIZE 0x10000
+/* Initial size of the connection table, a power of 2 */
+#define BXIMSG_CONNTAB_INIT 256
+/* Number of connections allocated at once */
+#define BXIMSG_CONN_SLAB 64
+/*
+ * Time in microseconds after which an idle connection is freed, at least
+ * twice the maximum retransmit timeout
+ */
+#define BXIMSG_CONN_IDLE 30000000
+/* Bytes a message sends in a row, while the other messages of the connection wait */
+#define BXIMSG_INTERLEAVE 0x10000
+
+/* Size prefix of each message of a packed packet, 16-bit little endian */
+#define BXIMSG_AGGR_HDR 2
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #ifdef DEBUG
 /*
@@ -68,17 +93,52 @@
 	} while (0)
 #endif
 
+/*
+ * Entry of the connection table. The key is stored in the table, so
+ * looking up a connection doesn't touch the connections it skips.
+ */
+struct bximsg_connent {
+	int nid;
+	int pid;
+	int vc;
+	struct bximsg_conn *conn; /* NULL if the entry is free */
+};
+
+/*
+ * Block of connections allocated at once
+ */
+struct bximsg_conn_slab {
+	struct bximsg_conn_slab *next;
+	struct bximsg_conn conns[BXIMSG_CONN_SLAB];
+};
+
 struct bximsg_iface {
 	struct bximsg_ctx *ctx;
 
 	struct bxipkt_iface *pktif;
 
 	/*
-	 * Hash-list with all connections. The container must be such
-	 * that that given a (nid, pid) the lookup of the connection
-	 * structure is fast.
+	 * Hash table with all connections, using open addressing with
+	 * linear probing, so that given a (nid, pid, vc) the lookup of
+	 * the connection structure is fast. The table is doubled when
+	 * it gets half full.
+	 */
+	struct bximsg_connent *conntab;
+	unsigned int conntab_size;
+	unsigned int conn_count;
+
+	/*
+	 * List of all connections, the most recently active first, so
+	 * that the idle ones are found at the tail
 	 */
-	struct bximsg_conn *bximsg_connlist[BXIMSG_HASHSIZE];
+	struct bximsg_conn *conn_list, *conn_tail;
+
+	/* Free idle connections periodically */
+	struct timo reclaim_timo;
+
+	/* Connection slabs, and connections available in them */
+	struct bximsg_conn_slab *conn_slabs;
+	struct bximsg_conn *conn_free;
 
 	/*
 	 * List of connections trying to send, ie such that cansend()
@@ -92,6 +152,18 @@ struct bximsg_iface {
 	 */
 	struct bxipkt_buf *pkt_qhead, **pkt_qtail;
 
+	/* Max. number of packets produced per bximsg_send_sched() call */
+	int send_budget;
+
+	/* Bytes a connection of each virtual circuit may send per turn */
+	int quantum[BXIMSG_VC_COUNT];
+
+	/* Packets a message may send in a row, see bximsg_send_next() */
+	int burst;
+
+	/* Retransmit runs available */
+	struct bximsg_run *run_free;
+
 	/*
 	 * This links us with the caller
 	 */
@@ -106,6 +178,39 @@ struct bximsg_iface {
 
 	/* Set to true while interface is being closed. */
 	int drain;
+
+	/* Stats of the freed connections */
+	unsigned long stats[BXIMSG_MAX_STATS];
+
+	/* Counted to by connections, if stats are disabled */
+	unsigned long stats_discard[BXIMSG_MAX_STATS];
+};
+
+/*
+ * Packet received ahead of the expected one, kept until the missing
+ * packets before it are received.
+ */
+struct bximsg_ooo {
+	unsigned int seq;
+	struct bximsg_hdr hdr;
+	enum swptl_transport_status status;
+	int uid;
+	size_t size;
+	unsigned char data[];
+};
+
+/*
+ * Packets of a message sent in a row, with consecutive seq. numbers.
+ * Packets of messages sent on different lanes are interleaved, so the
+ * retransmit queue is a list of runs rather than of messages. Acked
+ * packets are removed from the head of the run.
+ */
+struct bximsg_run {
+	struct bximsg_run *next;
+	struct swptl_sodata *f;
+	unsigned int seq; /* seq. num. of the first unacked packet */
+	unsigned int index; /* its index in the message */
+	unsigned int count; /* number of unacked packets */
 };
 
 /*
@@ -113,21 +218,60 @@ struct bximsg_iface {
  *
  *	diff = x - y
  *
- * in modulo 2^16 signed arithmetic. This works for any x and y as
- * long as difference is in the [-2^15 : 2^15 - 1] range.
+ * in modulo 2^32 signed arithmetic. This works for any x and y as
+ * long as difference is in the [-2^31 : 2^31 - 1] range.
  */
 static inline int seqcmp(unsigned int x, unsigned int y)
 {
-	int diff;
+	return (int32_t)(x - y);
+}
 
-	diff = (int16_t)(x - y);
-#ifdef DEBUG
-	if (bximsg_debug >= 1) {
-		if (diff > 1000 || diff < -1000)
-			ptl_log("%u - %u = %d: seqcmp failed\n", x, y, diff);
-	}
-#endif
-	return diff;
+/*
+ * Seq. number with the given low and high 16 bits, as in the headers
+ * of the packets we send
+ */
+#define HDR_SEQ(lo, hi) ((unsigned int)(hi) << 16 | (lo))
+
+/*
+ * Return the seq. number with the given low and high 16 bits. If the
+ * high bits are not set, return the one closest to the given seq.
+ * number, which is in the [ref - 2^15 : ref + 2^15 - 1] range.
+ */
+static inline unsigned int seqext(unsigned int ref, uint16_t lo, uint16_t hi, int ext)
+{
+	if (ext)
+		return HDR_SEQ(lo, hi);
+	return ref + (int16_t)(lo - (uint16_t)ref);
+}
+
+/*
+ * Return the seq. number of the given received packet
+ */
+static inline unsigned int hdr_data_seq(struct bximsg_conn *conn, struct bximsg_hdr *hdr)
+{
+	return seqext(conn->recv_seq, hdr->data_seq, hdr->data_seq_hi,
+		      hdr->flags & BXIMSG_HDR_FLAG_EXT);
+}
+
+/*
+ * Return the seq. number the given received packet acks
+ */
+static inline unsigned int hdr_ack_seq(struct bximsg_conn *conn, struct bximsg_hdr *hdr)
+{
+	return seqext(conn->send_ack, hdr->ack_seq, hdr->ack_seq_hi,
+		      hdr->flags & BXIMSG_HDR_FLAG_EXT);
+}
+
+static inline void hdr_set_data_seq(struct bximsg_hdr *hdr, unsigned int seq)
+{
+	hdr->data_seq = seq;
+	hdr->data_seq_hi = seq >> 16;
+}
+
+static inline void hdr_set_ack_seq(struct bximsg_hdr *hdr, unsigned int seq)
+{
+	hdr->ack_seq = seq;
+	hdr->ack_seq_hi = seq >> 16;
 }
 
 int bximsg_debug = 0;
@@ -152,13 +296,32 @@ static const char *stat_msgs[] = {
 	"Number of reached max retries during retransmission",
 	"Failed called to 'bxipkt_getbuf'",
 	"Received duplicate packets",
+	"Sent packet number acked by the transport",
+	"Sent packet number with payload gathered from user memory",
+	"Received packet number with payload placed in user memory",
+	"Received out-of-order packet number kept for later",
+	"Retransmission skipped because the peer has the packet",
+	"Smoothed round-trip time in microseconds (last value)",
+	"Retransmit timeout in microseconds (last value)",
+	"Congestion window in packets (last value)",
+	"Received packet number telling the peer is busy",
+	"Number of fast retransmission",
+	"Number of delayed ack timeouts",
+	"Sent message number packed with others in one packet",
+	"Received message number packed with others in one packet",
 	NULL,
 };
 
 void bximsg_timo(void *arg);
+void bximsg_ack_timo(void *arg);
+void bximsg_aggr_timo(void *arg);
+void bximsg_reclaim(void *arg);
+static void dump_stats(const char *msg, unsigned long *stats);
 
 void bximsg_options_set_default(struct bximsg_options *opts)
 {
+	int i;
+
 	opts->debug = 0;
 	opts->stats = 0;
 	opts->max_retries = -1;
@@ -166,8 +329,17 @@ void bximsg_options_set_default(struct bximsg_options *opts)
 	opts->tx_timeout = BXIMSG_TX_NET_TIMEOUT;
 	opts->tx_timeout_max = BXIMSG_TX_NET_TIMEOUT_MAX;
 	opts->tx_timeout_var = true;
+	opts->ack_every = BXIMSG_ACK_EVERY;
+	opts->ack_delay = BXIMSG_ACK_DELAY;
+	opts->conn_idle = BXIMSG_CONN_IDLE;
+	opts->seq_start = 0;
+	opts->interleave = BXIMSG_INTERLEAVE;
+	for (i = 0; i < BXIMSG_VC_COUNT; i++)
+		opts->vc_weight[i] = 1;
 	opts->nbufs = BXIMSG_NBUFS;
 	opts->wthreads = false;
+	opts->gather = true;
+	opts->aggregate = true;
 	opts->transport = &bxipkt_udp;
 }
 
@@ -183,6 +355,12 @@ int bximsg_libinit(struct bximsg_options *opts, struct bxipkt_options *pkt_opts,
 	if (opts->wthreads)
 		bximsg_init_wthreads();
 
+	if (ctx->opts.transport->send_iov == NULL)
+		ctx->opts.gather = false;
+
+	if (ctx->opts.ack_every == 0 || ctx->opts.ack_delay == 0)
+		ctx->opts.ack_every = 1;
+
 	srand(time(NULL));
 
 	bxipkt_common_init(pkt_opts, &ctx->pkt_ctx);
@@ -195,13 +373,28 @@ void bximsg_libfini(struct bximsg_ctx *ctx)
 	ctx->opts.transport->libfini(&ctx->pkt_ctx);
 }
 
+/*
+ * Return true if a message is being received on any lane, or waits
+ * to be started
+ */
+static int bximsg_receiving(struct bximsg_conn *conn)
+{
+	int i;
+
+	if (conn->recv_aggr != NULL)
+		return 1;
+	for (i = 0; i < BXIMSG_LANE_MAX; i++) {
+		if (conn->recv_ctx[i] != NULL)
+			return 1;
+	}
+	return 0;
+}
+
 int bximsg_conn_active(struct bximsg_conn *conn)
 {
 	if (conn->send_seq != conn->send_ack || conn->recv_seq != conn->recv_ack ||
-	    conn->msg_seq != conn->send_seq ||
-	    conn->stats[BXIMSG_OUT_MSG_NB] != conn->stats[BXIMSG_SND_END_NB] ||
-	    conn->stats[BXIMSG_RCV_START_SUCCESS_NB] != conn->stats[BXIMSG_RCV_END_NB] ||
-	    conn->send_qhead != NULL || conn->onqueue || conn->retries)
+	    conn->msg_seq != conn->send_seq || conn->ret_qhead != NULL || bximsg_receiving(conn) ||
+	    conn->send_qhead != NULL || conn->sending != NULL || conn->onqueue || conn->retries)
 		return 1;
 	return 0;
 }
@@ -222,6 +415,7 @@ void bximsg_log_sent_pkt(struct bxipkt_buf *pkt)
 {
 #ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
+	unsigned int seq;
 	int buf_len;
 
 	if (bximsg_debug < 3)
@@ -230,16 +424,16 @@ void bximsg_log_sent_pkt(struct bxipkt_buf *pkt)
 	buf_len = bximsg_conn_log(pkt->conn, sizeof(buf), buf);
 	buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ": sent: size = %d", pkt->size);
 	if (pkt->size > 0) {
-		buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ", data_seq = %u",
-				    pkt->hdr.data_seq);
-		if (pkt->hdr.data_seq != pkt->conn->send_seq - 1) {
+		seq = HDR_SEQ(pkt->hdr.data_seq, pkt->hdr.data_seq_hi);
+		buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ", data_seq = %u", seq);
+		if (seq != pkt->conn->send_seq - 1) {
 			snprintf(buf + buf_len, sizeof(buf) - buf_len, "(%d)",
-				 pkt->hdr.data_seq - pkt->conn->send_seq + 1);
+				 seqcmp(seq, pkt->conn->send_seq - 1));
 		}
 	} else
 		snprintf(buf + buf_len, sizeof(buf) - buf_len, ", empty");
 
-	ptl_log("%s, ack_seq = %u\n", buf, pkt->hdr.ack_seq);
+	ptl_log("%s, ack_seq = %u\n", buf, HDR_SEQ(pkt->hdr.ack_seq, pkt->hdr.ack_seq_hi));
 #endif
 }
 
@@ -248,9 +442,9 @@ void bximsg_log_sent_pkt(struct bxipkt_buf *pkt)
  * could use zero, but having different send an receive initial
  * sequence numbers eases debugging.
  */
-static int makeseq(int nid, int pid)
+static uint32_t makeseq(struct bximsg_iface *iface, int nid, int pid)
 {
-	return 100 * ((151121 * nid + 19937 * pid) & 0x1ff);
+	return iface->ctx->opts.seq_start + 100 * ((151121 * nid + 19937 * pid) & 0x1ff);
 }
 
 /*
@@ -261,16 +455,118 @@ static inline unsigned int get_next_timo(struct bximsg_conn *conn)
 	uint64_t t;
 	uint64_t retry = MIN(31, conn->retries);
 
-	/* Calculate the timeout: (base_timeout * (2^retry)) */
-	t = conn->iface->ctx->opts.tx_timeout * (1ULL << retry);
+	/* Calculate the timeout: (rto * (2^retry)) */
+	t = conn->rto * (1ULL << retry);
 
-	/* Add a bit of variability (variability < base_timeout) */
+	/* Add a bit of variability (variability < rto / 4) */
 	if (conn->iface->ctx->opts.tx_timeout_var)
-		t += rand() % conn->iface->ctx->opts.tx_timeout;
+		t += rand() % (conn->rto / 4 + 1);
 
 	return (unsigned int)MIN(t, conn->iface->ctx->opts.tx_timeout_max);
 }
 
+/*
+ * Update the smoothed round-trip time and its variance with a new
+ * measure, as TCP does (RFC 6298), and derive the retransmit timeout
+ * from them.
+ */
+static void bximsg_rtt_update(struct bximsg_conn *conn, unsigned int rtt)
+{
+	unsigned int err;
+
+	if (conn->srtt == 0) {
+		conn->srtt = rtt;
+		conn->rttvar = rtt / 2;
+	} else {
+		err = rtt > conn->srtt ? rtt - conn->srtt : conn->srtt - rtt;
+		conn->rttvar = (3 * conn->rttvar + err) / 4;
+		conn->srtt = (7 * conn->srtt + rtt) / 8;
+		if (conn->srtt == 0)
+			conn->srtt = 1;
+	}
+
+	conn->rto = conn->srtt + MAX(4 * conn->rttvar, BXIMSG_TX_RTO_MIN);
+	if (conn->rto > conn->iface->ctx->opts.tx_timeout_max)
+		conn->rto = conn->iface->ctx->opts.tx_timeout_max;
+
+	conn->stats[BXIMSG_RTT_SMOOTHED] = conn->srtt;
+	conn->stats[BXIMSG_RTO] = conn->rto;
+}
+
+/*
+ * Return the max. number of packets in flight to the peer
+ */
+static inline unsigned int bximsg_wnd_max(struct bximsg_conn *conn)
+{
+	unsigned int max = conn->iface->ctx->opts.nack_max;
+
+	return conn->seq32 ? max : MIN(max, BXIMSG_SEQ16_WND_MAX);
+}
+
+/*
+ * Return the number of lanes messages to the peer may be sent on
+ */
+static inline unsigned int bximsg_lanes(struct bximsg_conn *conn)
+{
+	return conn->v2 ? BXIMSG_LANE_MAX : 1;
+}
+
+/*
+ * Grow the congestion window as packets are acked: by one packet per
+ * acked packet in slow start, then by one packet per window. The
+ * window grows only if it prevented us from sending, it's capped by
+ * bximsg_wnd_max().
+ */
+static void bximsg_cwnd_ack(struct bximsg_conn *conn, unsigned int acked)
+{
+	if (!conn->cwnd_limited)
+		return;
+	conn->cwnd_limited = 0;
+
+	if (conn->cwnd < conn->ssthresh)
+		conn->cwnd += acked;
+	else {
+		conn->cwnd_acked += acked;
+		if (conn->cwnd_acked >= conn->cwnd) {
+			conn->cwnd_acked -= conn->cwnd;
+			conn->cwnd++;
+		}
+	}
+	if (conn->cwnd > bximsg_wnd_max(conn))
+		conn->cwnd = bximsg_wnd_max(conn);
+
+	conn->stats[BXIMSG_CWND] = conn->cwnd;
+}
+
+/*
+ * The peer tells in its SYN and SYN_ACK packets if it uses 32-bit seq.
+ * numbers, if not shrink the window to what 16-bit ones can tell apart.
+ * It also tells if it handles lanes, packed packets and packed upper
+ * layer headers.
+ */
+static void bximsg_peer_caps(struct bximsg_conn *conn, int flags)
+{
+	conn->seq32 = (flags & BXIMSG_HDR_FLAG_EXT) != 0;
+	conn->v2 = (flags & BXIMSG_HDR_FLAG_V2) != 0;
+	conn->ssthresh = MIN(conn->ssthresh, bximsg_wnd_max(conn));
+	conn->cwnd = MIN(conn->cwnd, bximsg_wnd_max(conn));
+	conn->stats[BXIMSG_CWND] = conn->cwnd;
+}
+
+/*
+ * A packet was lost: halve the slow start threshold and continue from
+ * there if the peer reported the loss, or restart from a single packet
+ * window if the retransmit timeout expired.
+ */
+static void bximsg_cwnd_loss(struct bximsg_conn *conn, int timeout)
+{
+	conn->ssthresh = MAX(seqcmp(conn->send_seq, conn->send_ack) / 2, 2);
+	conn->cwnd = timeout ? 1 : conn->ssthresh;
+	conn->cwnd_acked = 0;
+
+	conn->stats[BXIMSG_CWND] = conn->cwnd;
+}
+
 /*
  * Return true if the connection has data: we've a context to process
  * and are not blocking.
@@ -281,8 +577,25 @@ static inline int cansend_data(struct bximsg_conn *conn)
 	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
-	/* if we're blocked (send quota exceeded) */
-	if (seqcmp(conn->send_seq, conn->send_ack) >= conn->iface->ctx->opts.nack_max) {
+	/*
+	 * if we're synchronizing or resuming, wait for the ack of the
+	 * first packet: the peer takes our seq. numbers from the first
+	 * packet it gets, so it must not get a later one first
+	 */
+	if ((conn->synchronizing || conn->resuming) && conn->send_seq != conn->send_ack) {
+#ifdef DEBUG
+		if (bximsg_debug >= 3) {
+			bximsg_conn_log(conn, sizeof(buf), buf);
+			ptl_log("%s: waiting for the peer to synchronize\n", buf);
+		}
+#endif
+		return 0;
+	}
+
+	/* if we're blocked (send window full or closed by the peer) */
+	if (seqcmp(conn->send_seq, conn->send_ack) >= conn->cwnd || conn->peer_busy) {
+		if ((conn->send_qhead != NULL || conn->sending != NULL) && !conn->peer_busy)
+			conn->cwnd_limited = 1;
 #ifdef DEBUG
 		if (bximsg_debug >= 3) {
 			bximsg_conn_log(conn, sizeof(buf), buf);
@@ -293,7 +606,7 @@ static inline int cansend_data(struct bximsg_conn *conn)
 	}
 
 	/* if there's nothing to send, return 0 */
-	if (conn->send_qhead == NULL) {
+	if (conn->send_qhead == NULL && conn->sending == NULL) {
 #ifdef DEBUG
 		if (bximsg_debug >= 3) {
 			bximsg_conn_log(conn, sizeof(buf), buf);
@@ -312,16 +625,21 @@ static inline int cansend_data(struct bximsg_conn *conn)
 }
 
 /*
- * Return true if there's an ACK to send
+ * Return true if there's an ACK to send: enough packets to ack, or an
+ * ack that can't wait anymore.
  */
 static inline int cansend_ack(struct bximsg_conn *conn)
 {
+	int delta;
 #ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
 	/* if acks need to be send, return 0 */
-	if (seqcmp(conn->recv_seq, conn->recv_ack) > 0) {
+	delta = seqcmp(conn->recv_seq, conn->recv_ack);
+	if ((delta > 0 && (delta >= conn->iface->ctx->opts.ack_every || conn->ack_now ||
+			   conn->iface->drain)) ||
+	    conn->peer_synchronizing) {
 #ifdef DEBUG
 		if (bximsg_debug >= 3) {
 			bximsg_conn_log(conn, sizeof(buf), buf);
@@ -340,6 +658,17 @@ static inline int cansend_ack(struct bximsg_conn *conn)
 	return 0;
 }
 
+/*
+ * Record that an ack up to recv_seq is being sent
+ */
+static inline void bximsg_ack_sent(struct bximsg_conn *conn)
+{
+	conn->recv_ack = conn->recv_seq;
+	conn->ack_now = 0;
+	if (conn->ack_timo.set)
+		timo_del(&conn->ack_timo);
+}
+
 /*
  * Return true if there's something to send: data or an empty ack
  * packet.
@@ -349,6 +678,152 @@ static inline int cansend(struct bximsg_conn *conn)
 	return cansend_ack(conn) || cansend_data(conn);
 }
 
+/*
+ * Return the flags of the acks we send: whether we're out of receive
+ * resources, and whether we've a gap, i.e. packets after recv_seq.
+ */
+static inline unsigned int bximsg_ack_flags(struct bximsg_conn *conn)
+{
+	return (conn->busy ? BXIMSG_HDR_FLAG_BUSY : 0) |
+	       (conn->ooo_count > 0 ? BXIMSG_HDR_FLAG_DUPACK : 0);
+}
+
+/*
+ * Return the selective ack bits for the packets following recv_seq
+ * that we already have.
+ */
+static inline unsigned int bximsg_sack(struct bximsg_conn *conn)
+{
+	struct bximsg_ooo *o;
+	unsigned int seq, sack = 0;
+	int i;
+
+	if (conn->ooo_count == 0)
+		return 0;
+
+	for (i = 0; i < BXIMSG_SACK_MAX; i++) {
+		seq = conn->recv_seq + 1 + i;
+		o = conn->ooo[seq % BXIMSG_SACK_MAX];
+		if (o != NULL && o->seq == seq)
+			sack |= 1 << i;
+	}
+	return sack;
+}
+
+/*
+ * Return true if the peer reported it has the given packet, so there's
+ * no need to retransmit it.
+ */
+static inline int bximsg_sacked(struct bximsg_conn *conn, unsigned int seq)
+{
+	int delta;
+
+	delta = seqcmp(seq, conn->sack_seq) - 1;
+	return delta >= 0 && delta < BXIMSG_SACK_MAX && (conn->sack >> delta) & 1;
+}
+
+/*
+ * Free the packets received ahead of the expected one, and the
+ * messages of a packed packet not started yet
+ */
+static void bximsg_ooo_flush(struct bximsg_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < BXIMSG_SACK_MAX; i++) {
+		if (conn->ooo[i] != NULL) {
+			xfree(conn->ooo[i]);
+			conn->ooo[i] = NULL;
+		}
+	}
+	conn->ooo_count = 0;
+
+	if (conn->recv_aggr != NULL) {
+		xfree(conn->recv_aggr);
+		conn->recv_aggr = NULL;
+	}
+	if (conn->aggr_timo.set)
+		timo_del(&conn->aggr_timo);
+}
+
+/*
+ * Return the index of the first connection table entry to probe for
+ * the given destination
+ */
+static inline unsigned int bximsg_connhash(struct bximsg_iface *iface, int nid, int pid, int vc)
+{
+	uint64_t h;
+
+	h = ((uint64_t)(uint32_t)nid << 32) | ((uint32_t)pid << 8) | (uint8_t)vc;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (h >> 32) & (iface->conntab_size - 1);
+}
+
+/*
+ * Store the given connection in the first free entry of the table
+ */
+static void bximsg_conntab_insert(struct bximsg_iface *iface, struct bximsg_conn *c)
+{
+	struct bximsg_connent *e;
+	unsigned int i;
+
+	i = bximsg_connhash(iface, c->nid, c->pid, c->vc);
+	while (iface->conntab[i].conn != NULL)
+		i = (i + 1) & (iface->conntab_size - 1);
+
+	e = &iface->conntab[i];
+	e->nid = c->nid;
+	e->pid = c->pid;
+	e->vc = c->vc;
+	e->conn = c;
+}
+
+/*
+ * Double the size of the connection table
+ */
+static void bximsg_conntab_grow(struct bximsg_iface *iface)
+{
+	struct bximsg_connent *oldtab = iface->conntab;
+	unsigned int oldsize = iface->conntab_size;
+	unsigned int i;
+
+	iface->conntab_size = 2 * oldsize;
+	iface->conntab = xmalloc(iface->conntab_size * sizeof(struct bximsg_connent),
+				 "bximsg_conntab");
+	memset(iface->conntab, 0, iface->conntab_size * sizeof(struct bximsg_connent));
+
+	for (i = 0; i < oldsize; i++) {
+		if (oldtab[i].conn != NULL)
+			bximsg_conntab_insert(iface, oldtab[i].conn);
+	}
+	xfree(oldtab);
+}
+
+/*
+ * Allocate a connection structure, from a new slab if the current
+ * ones are full
+ */
+static struct bximsg_conn *bximsg_conn_alloc(struct bximsg_iface *iface)
+{
+	struct bximsg_conn_slab *slab;
+	struct bximsg_conn *c;
+	int i;
+
+	if (iface->conn_free == NULL) {
+		slab = xmalloc(sizeof(struct bximsg_conn_slab), "bximsg_conn_slab");
+		slab->next = iface->conn_slabs;
+		iface->conn_slabs = slab;
+		for (i = BXIMSG_CONN_SLAB - 1; i >= 0; i--) {
+			slab->conns[i].next = iface->conn_free;
+			iface->conn_free = &slab->conns[i];
+		}
+	}
+
+	c = iface->conn_free;
+	iface->conn_free = c->next;
+	return c;
+}
+
 /*
  * Return the connection to the given destination. If this is the
  * first call for the given destination, the connection structure
@@ -356,44 +831,93 @@ static inline int cansend(struct bximsg_conn *conn)
  */
 struct bximsg_conn *bximsg_getconn(struct bximsg_iface *iface, int nid, int pid, int vc)
 {
-	struct bximsg_conn *c, **list;
+	struct bximsg_connent *e;
+	struct bximsg_conn *c;
+	unsigned int i;
 #ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
-	list = &iface->bximsg_connlist[BXIMSG_HASH(nid, pid, vc)];
-
 	/* try to find an existing connection */
-	for (c = *list; c != NULL; c = c->hnext) {
-		if (c->nid == nid && c->pid == pid && c->vc == vc)
-			return c;
+	i = bximsg_connhash(iface, nid, pid, vc);
+	while (1) {
+		e = &iface->conntab[i];
+		if (e->conn == NULL)
+			break;
+		if (e->nid == nid && e->pid == pid && e->vc == vc)
+			return e->conn;
+		i = (i + 1) & (iface->conntab_size - 1);
 	}
 
 	/* create a new connection */
-	c = xmalloc(sizeof(struct bximsg_conn), "bximsg_conn");
+	c = bximsg_conn_alloc(iface);
+	if (iface->ctx->opts.stats) {
+		c->stats = xmalloc(BXIMSG_MAX_STATS * sizeof(unsigned long), "bximsg_stats");
+		memset(c->stats, 0, BXIMSG_MAX_STATS * sizeof(unsigned long));
+	} else
+		c->stats = iface->stats_discard;
 	c->iface = iface;
 	c->nid = nid;
 	c->pid = pid;
 	c->vc = vc;
 	timo_set(iface->ctx->timo, &c->ret_timo, bximsg_timo, c);
-	c->ret_qhead = NULL;
-	c->ret_qtail = &c->ret_qhead;
+	timo_set(iface->ctx->timo, &c->ack_timo, bximsg_ack_timo, c);
+	timo_set(iface->ctx->timo, &c->aggr_timo, bximsg_aggr_timo, c);
+	c->ack_now = 0;
+	c->ret_qhead = c->ret_qtail = NULL;
 	c->send_qhead = NULL;
 	c->send_qtail = &c->send_qhead;
-	c->recv_ctx = NULL;
-	c->send_seq = c->send_ack = makeseq(iface->nid, iface->pid);
-	c->recv_seq = c->recv_ack = makeseq(c->nid, c->pid);
+	c->sending = c->send_cur = NULL;
+	c->send_lanes = 0;
+	c->send_burst = c->send_started = 0;
+	memset(c->recv_ctx, 0, sizeof(c->recv_ctx));
+	c->recv_aggr = NULL;
+	c->send_seq = c->send_ack = makeseq(iface, iface->nid, iface->pid);
+	c->recv_seq = c->recv_ack = makeseq(iface, c->nid, c->pid);
 	c->msg_seq = c->send_seq;
+	memset(c->ooo, 0, sizeof(c->ooo));
+	c->ooo_count = 0;
+	c->sack_seq = c->send_ack;
+	c->sack = 0;
+	c->srtt = c->rttvar = 0;
+	c->rto = iface->ctx->opts.tx_timeout;
+	c->rtt_timing = 0;
 	c->synchronizing = iface->nid != c->nid || iface->pid != c->pid;
 	c->peer_synchronizing = 0;
+	c->resuming = 0;
+	c->seq32 = !c->synchronizing;
+	c->v2 = !c->synchronizing;
+	c->cwnd = MIN(BXIMSG_CWND_INIT, bximsg_wnd_max(c));
+	c->cwnd_acked = 0;
+	c->cwnd_limited = 0;
+	c->dupacks = 0;
+	c->recovering = 0;
+	c->ssthresh = bximsg_wnd_max(c);
+	c->busy = c->peer_busy = 0;
 	c->rank = -1;
+	c->ospid = 0;
+	c->rdv_nak = 0;
 	c->onqueue = 0;
+	c->deficit = 0;
 	c->retries = 0;
-	memset(c->stats, 0, BXIMSG_MAX_STATS * sizeof(unsigned long));
+	c->refs = c->npkts = 0;
+	c->last_active = timo_now(iface->ctx->timo);
+	c->stats[BXIMSG_RTO] = c->rto;
+	c->stats[BXIMSG_CWND] = c->cwnd;
+
+	/* link connection to the interface list and to the table */
+	c->prev = NULL;
+	c->next = iface->conn_list;
+	if (c->next != NULL)
+		c->next->prev = c;
+	else
+		iface->conn_tail = c;
+	iface->conn_list = c;
 
-	/* link connection to the hash list */
-	c->hnext = *list;
-	*list = c;
+	if (2 * (iface->conn_count + 1) > iface->conntab_size)
+		bximsg_conntab_grow(iface);
+	bximsg_conntab_insert(iface, c);
+	iface->conn_count++;
 #ifdef DEBUG
 	if (bximsg_debug >= 3) {
 		bximsg_conn_log(c, sizeof(buf), buf);
@@ -405,82 +929,246 @@ struct bximsg_conn *bximsg_getconn(struct bximsg_iface *iface, int nid, int pid,
 }
 
 /*
- * Put a connection on interface send queue (aka list of active
- * connections).
+ * Remove the given connection from the table, and move back the
+ * entries after it that can't be found anymore because of the hole
  */
-void bximsg_conn_enqueue(struct bximsg_iface *iface, struct bximsg_conn *conn)
+static void bximsg_conntab_remove(struct bximsg_iface *iface, struct bximsg_conn *c)
 {
-#ifdef DEBUG
-	char buf[PTL_LOG_BUF_SIZE];
-#endif
+	unsigned int mask = iface->conntab_size - 1;
+	unsigned int i, j, k;
 
-	if (conn->onqueue)
-		return;
+	i = bximsg_connhash(iface, c->nid, c->pid, c->vc);
+	while (iface->conntab[i].conn != c)
+		i = (i + 1) & mask;
 
-	/*
-	 * move it on interface send queue
-	 */
-	conn->qnext = NULL;
-	conn->qprev = iface->conn_qtail;
-	*iface->conn_qtail = conn;
-	iface->conn_qtail = &conn->qnext;
-	conn->onqueue = 1;
-#ifdef DEBUG
-	if (bximsg_debug >= 3) {
-		bximsg_conn_log(conn, sizeof(buf), buf);
-		ptl_log("%s: enqueued\n", buf);
+	iface->conntab[i].conn = NULL;
+	for (j = (i + 1) & mask; iface->conntab[j].conn != NULL; j = (j + 1) & mask) {
+		k = bximsg_connhash(iface, iface->conntab[j].nid, iface->conntab[j].pid,
+				    iface->conntab[j].vc);
+
+		/* the entry is still reachable if its slot is in (i, j] */
+		if (((j - k) & mask) < ((j - i) & mask))
+			continue;
+
+		iface->conntab[i] = iface->conntab[j];
+		iface->conntab[j].conn = NULL;
+		i = j;
 	}
-#endif
 }
 
 /*
- * Remove the given connection from the interface send queue, i.e. the
- * connection becomes inactive and will not be processed by the send logic.
+ * Record that a packet was sent to or received from the peer: move
+ * the connection at the head of the interface list
  */
-void bximsg_conn_dequeue(struct bximsg_iface *iface, struct bximsg_conn *conn)
+static inline void bximsg_conn_touch(struct bximsg_iface *iface, struct bximsg_conn *conn)
 {
-#ifdef DEBUG
-	char buf[PTL_LOG_BUF_SIZE];
-#endif
+	conn->last_active = timo_now(iface->ctx->timo);
 
-	if (!conn->onqueue)
+	/* bximsg_done() walks through the list */
+	if (conn == iface->conn_list || iface->drain)
 		return;
 
-	*conn->qprev = conn->qnext;
-
-	if (conn->qnext == NULL)
-		iface->conn_qtail = conn->qprev;
+	conn->prev->next = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
 	else
-		conn->qnext->qprev = conn->qprev;
+		iface->conn_tail = conn->prev;
 
-	conn->onqueue = 0;
-#ifdef DEBUG
-	if (bximsg_debug >= 3) {
-		bximsg_conn_log(conn, sizeof(buf), buf);
-		ptl_log("%s: dequeued\n", buf);
+	conn->prev = NULL;
+	conn->next = iface->conn_list;
+	conn->next->prev = conn;
+	iface->conn_list = conn;
+}
+
+/*
+ * Return true if the connection can be freed: all messages are
+ * delivered and acked, and nothing refers to it anymore
+ */
+static int bximsg_conn_idle(struct bximsg_conn *conn)
+{
+	return conn->refs == 0 && conn->npkts == 0 && conn->msg_seq == conn->send_ack &&
+	       conn->send_qhead == NULL && conn->sending == NULL && conn->ret_qhead == NULL &&
+	       !bximsg_receiving(conn) && conn->recv_seq == conn->recv_ack &&
+	       conn->ooo_count == 0 && !conn->onqueue && !conn->peer_synchronizing &&
+	       !conn->ret_timo.set && !conn->ack_timo.set;
+}
+
+/*
+ * Add the given connection stats to the given totals
+ */
+static void bximsg_stats_add(unsigned long *totals, unsigned long *stats)
+{
+	int i;
+
+	for (i = 0; i < BXIMSG_MAX_STATS; i++) {
+		/* report the worst round-trip time and timeout */
+		if (i == BXIMSG_RTT_SMOOTHED || i == BXIMSG_RTO || i == BXIMSG_CWND)
+			totals[i] = MAX(totals[i], stats[i]);
+		else
+			totals[i] += stats[i];
 	}
-#endif
 }
 
 /*
- * Enqueue a new message to the given connection. This makes the
- * connection active, unless it's blocked.
+ * Free the given connection, it must be idle or the interface closed
  */
-void bximsg_enqueue(struct bximsg_iface *iface, struct swptl_sodata *f, size_t msgsize)
+static void bximsg_conn_free(struct bximsg_iface *iface, struct bximsg_conn *c)
 {
-	struct bximsg_conn *conn = f->conn;
-#ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
-#endif
 
-	conn->stats[BXIMSG_OUT_MSG_NB]++;
+	bximsg_conntab_remove(iface, c);
+	iface->conn_count--;
+
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		iface->conn_list = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		iface->conn_tail = c->prev;
+
+	if (c->stats != iface->stats_discard) {
+		if (iface->ctx->opts.stats >= 2) {
+			bximsg_conn_log(c, sizeof(buf), buf);
+			dump_stats(buf, c->stats);
+		}
+		bximsg_stats_add(iface->stats, c->stats);
+		xfree(c->stats);
+	}
+
+	bximsg_ooo_flush(c);
+	if (c->ack_timo.set)
+		timo_del(&c->ack_timo);
+
+	c->next = iface->conn_free;
+	iface->conn_free = c;
+}
+
+/*
+ * Reclaim time-out expired: free the connections idle for more than
+ * the conn_idle option. The peer keeps its connection, and resumes
+ * it with the RESUME flag, see bximsg_send_data().
+ */
+void bximsg_reclaim(void *arg)
+{
+	struct bximsg_iface *iface = arg;
+	struct bximsg_conn *c, *prev;
+	unsigned long long now;
+#ifdef DEBUG
+	char buf[PTL_LOG_BUF_SIZE];
+#endif
+
+	now = timo_now(iface->ctx->timo);
+	for (c = iface->conn_tail; c != NULL; c = prev) {
+		if (now - c->last_active < iface->ctx->opts.conn_idle)
+			break;
+		prev = c->prev;
+		if (!bximsg_conn_idle(c))
+			continue;
+#ifdef DEBUG
+		if (bximsg_debug >= 2) {
+			bximsg_conn_log(c, sizeof(buf), buf);
+			ptl_log("%s: idle, freed\n", buf);
+		}
+#endif
+		bximsg_conn_free(iface, c);
+	}
+
+	timo_add(&iface->reclaim_timo, MIN(iface->ctx->opts.conn_idle / 4 + 1, UINT_MAX));
+}
+
+void bximsg_conn_ref(struct bximsg_conn *conn)
+{
+	conn->refs++;
+}
+
+void bximsg_conn_unref(struct bximsg_conn *conn)
+{
+	if (conn->refs == 0)
+		ptl_panic("bximsg_conn_unref: no references\n");
+	conn->refs--;
+}
+
+/*
+ * Put a connection on interface send queue (aka list of active
+ * connections).
+ */
+void bximsg_conn_enqueue(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+#ifdef DEBUG
+	char buf[PTL_LOG_BUF_SIZE];
+#endif
+
+	if (conn->onqueue)
+		return;
+
+	/*
+	 * move it on interface send queue
+	 */
+	conn->qnext = NULL;
+	conn->qprev = iface->conn_qtail;
+	*iface->conn_qtail = conn;
+	iface->conn_qtail = &conn->qnext;
+	conn->onqueue = 1;
+#ifdef DEBUG
+	if (bximsg_debug >= 3) {
+		bximsg_conn_log(conn, sizeof(buf), buf);
+		ptl_log("%s: enqueued\n", buf);
+	}
+#endif
+}
+
+/*
+ * Remove the given connection from the interface send queue, i.e. the
+ * connection becomes inactive and will not be processed by the send logic.
+ */
+void bximsg_conn_dequeue(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+#ifdef DEBUG
+	char buf[PTL_LOG_BUF_SIZE];
+#endif
+
+	if (!conn->onqueue)
+		return;
+
+	*conn->qprev = conn->qnext;
+
+	if (conn->qnext == NULL)
+		iface->conn_qtail = conn->qprev;
+	else
+		conn->qnext->qprev = conn->qprev;
+
+	conn->onqueue = 0;
+
+	/* nothing to send anymore, don't keep credit for later */
+	conn->deficit = 0;
+#ifdef DEBUG
+	if (bximsg_debug >= 3) {
+		bximsg_conn_log(conn, sizeof(buf), buf);
+		ptl_log("%s: dequeued\n", buf);
+	}
+#endif
+}
+
+/*
+ * Enqueue a new message to the given connection. This makes the
+ * connection active, unless it's blocked.
+ */
+void bximsg_enqueue(struct bximsg_iface *iface, struct swptl_sodata *f, size_t msgsize)
+{
+	struct bximsg_conn *conn = f->conn;
+#ifdef DEBUG
+	char buf[PTL_LOG_BUF_SIZE];
+#endif
+
+	conn->stats[BXIMSG_OUT_MSG_NB]++;
 
 	f->msgsize = msgsize;
 
 	f->pkt_count = (msgsize + f->hdrsize + iface->mtu - 1) / iface->mtu;
 	f->pkt_next = 0;
 	f->pkt_acked = 0;
-	f->seq = conn->msg_seq;
 	conn->msg_seq += f->pkt_count;
 #ifdef DEBUG
 	if (bximsg_debug >= 3) {
@@ -497,46 +1185,109 @@ void bximsg_enqueue(struct bximsg_iface *iface, struct swptl_sodata *f, size_t m
 }
 
 /*
- * Send as many enqueued packets as the packet interface accepts.
+ * Send a vector of packets, return the number of packets sent.
+ */
+static int bximsg_send_batch(struct bximsg_iface *iface, struct bxipkt_buf **pkts, int count)
+{
+	struct bxipkt_ops *transport = iface->ctx->opts.transport;
+	int i;
+
+	if (transport->send_batch != NULL)
+		return transport->send_batch(iface->pktif, pkts, count);
+
+	for (i = 0; i < count; i++) {
+		if (pkts[i]->iovcnt > 0) {
+			if (!transport->send_iov(iface->pktif, pkts[i], pkts[i]->nid,
+						 pkts[i]->pid))
+				break;
+		} else if (!transport->send(iface->pktif, pkts[i], pkts[i]->size, pkts[i]->nid,
+					    pkts[i]->pid))
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * Send as many enqueued packets as the packet interface accepts, in
+ * batches of up to BXIMSG_SEND_BATCH packets.
  */
 int bximsg_send_do(struct bximsg_iface *iface)
 {
-	int rc = 0;
+	struct bxipkt_buf *pkts[BXIMSG_SEND_BATCH];
+	struct bximsg_conn *conns[BXIMSG_SEND_BATCH];
+	int sizes[BXIMSG_SEND_BATCH];
 	struct bxipkt_buf *pkt;
 	struct bximsg_conn *conn;
-	struct bxipkt_buf *next_pkt;
+	int i, count, sent, rc = 0;
 
-	while ((pkt = iface->pkt_qhead) != NULL) {
-		if (pkt->send_pending_memcpy != 0)
+	for (;;) {
+		/*
+		 * Take the longest prefix of the queue that is ready to
+		 * be sent and fill in the most recent ack.
+		 */
+		count = 0;
+		for (pkt = iface->pkt_qhead; pkt != NULL && count < BXIMSG_SEND_BATCH;
+		     pkt = pkt->next) {
+			if (pkt->send_pending_memcpy != 0)
+				break;
+			conn = pkt->conn;
+			hdr_set_ack_seq(&pkt->hdr, conn->recv_seq);
+			pkt->hdr.sack = bximsg_sack(conn);
+			pkt->hdr.flags &= ~(BXIMSG_HDR_FLAG_BUSY | BXIMSG_HDR_FLAG_DUPACK);
+			pkt->hdr.flags |= bximsg_ack_flags(conn);
+			pkt->hdr.vc = BXIMSG_HDR_VCLANE(conn->vc, BXIMSG_HDR_LANE(&pkt->hdr));
+			pkt->nid = conn->nid;
+			pkt->pid = conn->pid;
+			pkt->reliable = 0;
+			pkts[count] = pkt;
+			conns[count] = conn;
+			sizes[count] = pkt->size;
+			count++;
+		}
+		if (count == 0)
 			break;
 
 		/*
-		 * Save a pointer to the next packet for later because
-		 * bxipkt_send might put the packet back to the freelist.
+		 * Unlink the packets before sending them, because the
+		 * transport might put them back to the freelist.
 		 */
-		next_pkt = pkt->next;
-		conn = pkt->conn;
-		pkt->hdr.ack_seq = conn->recv_seq;
-		pkt->hdr.vc = conn->vc;
-
-		if (!iface->ctx->opts.transport->send(iface->pktif, pkt, pkt->size, conn->nid,
-						      conn->pid)) {
-			conn->stats[BXIMSG_OUT_PKT_ERROR_NB]++;
-			break;
-		}
+		iface->pkt_qhead = pkt;
+		if (iface->pkt_qhead == NULL)
+			iface->pkt_qtail = &iface->pkt_qhead;
 
-		/* save ack we're sending in this packet */
-		conn->recv_ack = conn->recv_seq;
+		sent = bximsg_send_batch(iface, pkts, count);
 
-		if (!cansend_data(conn))
-			bximsg_conn_dequeue(iface, conn);
+		for (i = 0; i < sent; i++) {
+			conn = conns[i];
 
-		conn->stats[BXIMSG_OUT_PKT_NB]++;
-		rc = 1;
+			/* save ack we're sending in this packet */
+			bximsg_ack_sent(conn);
 
-		iface->pkt_qhead = next_pkt;
-		if (iface->pkt_qhead == NULL)
-			iface->pkt_qtail = &iface->pkt_qhead;
+			if (!cansend(conn))
+				bximsg_conn_dequeue(iface, conn);
+
+			if (sizes[i] == 0)
+				conn->stats[BXIMSG_OUT_INLINE_PKT_NB]++;
+			else
+				conn->stats[BXIMSG_OUT_PKT_NB]++;
+			rc = 1;
+		}
+
+		if (sent < count) {
+			/* put back unsent packets at the head of the queue */
+			if (sizes[sent] == 0)
+				conns[sent]->stats[BXIMSG_OUT_INLINE_PKT_ERROR_NB]++;
+			else
+				conns[sent]->stats[BXIMSG_OUT_PKT_ERROR_NB]++;
+			if (iface->pkt_qhead == NULL)
+				iface->pkt_qtail = &pkts[count - 1]->next;
+			for (i = count - 1; i >= sent; i--) {
+				pkts[i]->next = iface->pkt_qhead;
+				iface->pkt_qhead = pkts[i];
+			}
+			break;
+		}
 	}
 
 	return rc;
@@ -547,6 +1298,10 @@ int bximsg_send_do(struct bximsg_iface *iface)
  */
 void bximsg_sendpkt(struct bximsg_iface *iface, struct bxipkt_buf *pkt)
 {
+	pkt->conn->npkts++;
+	pkt->conn->deficit -= sizeof(struct bximsg_hdr) + pkt->size;
+	bximsg_conn_touch(iface, pkt->conn);
+
 	/*
 	 * Link to the interface send queue
 	 */
@@ -555,15 +1310,28 @@ void bximsg_sendpkt(struct bximsg_iface *iface, struct bxipkt_buf *pkt)
 	iface->pkt_qtail = &pkt->next;
 }
 
-size_t bximsg_pkt_fill(struct bximsg_iface *iface, struct swptl_sodata *f, unsigned char *buf,
-		       unsigned int index, volatile uint64_t *pending_memcpy)
+/*
+ * Fill the given packet with the index-th packet of the given message.
+ * If the transport supports it, the payload is not copied in the
+ * packet buffer, but described by the packet segments and gathered
+ * when it's sent; if there are too many segments, the remaining
+ * payload is copied in the buffer.
+ */
+void bximsg_pkt_fill(struct bximsg_iface *iface, struct swptl_sodata *f, struct bxipkt_buf *pkt,
+		     unsigned int index)
 {
+	volatile uint64_t *pending_memcpy = &pkt->send_pending_memcpy;
+	unsigned char *buf = pkt->addr;
+	struct iovec *tail = NULL;
 	size_t todo, msgoffs, size;
+	int gather;
 	void *data;
 
 	if (index >= f->pkt_count)
 		ptl_panic("bximsg_pkt_fill: bad index\n");
 
+	gather = iface->ctx->opts.gather;
+	pkt->iovcnt = 0;
 	todo = iface->mtu;
 
 	if (index == 0) {
@@ -590,14 +1358,120 @@ size_t bximsg_pkt_fill(struct bximsg_iface *iface, struct swptl_sodata *f, unsig
 		if (size > todo)
 			size = todo;
 
-		bximsg_async_memcpy(buf, data, size, index, pending_memcpy);
+		if (gather && pkt->iovcnt < BXIPKT_IOV_MAX - 1) {
+			pkt->iov[pkt->iovcnt].iov_base = data;
+			pkt->iov[pkt->iovcnt].iov_len = size;
+			pkt->iovcnt++;
+		} else {
+			if (gather && tail == NULL) {
+				/* last segment: the copied data, in the buffer */
+				tail = &pkt->iov[pkt->iovcnt++];
+				tail->iov_base = buf;
+				tail->iov_len = 0;
+			}
+			bximsg_async_memcpy(buf, data, size, index, pending_memcpy);
+			buf += size;
+			if (tail != NULL)
+				tail->iov_len += size;
+		}
 
-		buf += size;
 		msgoffs += size;
 		todo -= size;
 	}
 
-	return iface->mtu - todo;
+	pkt->size = iface->mtu - todo;
+	if (pkt->iovcnt > 0) {
+		pkt->inlen = index == 0 ? f->hdrsize : 0;
+		f->conn->stats[BXIMSG_OUT_GATHER_PKT_NB]++;
+	}
+}
+
+/*
+ * Return the room the given message takes in a packed packet
+ */
+static inline size_t bximsg_aggr_size(struct swptl_sodata *f)
+{
+	return BXIMSG_AGGR_HDR + f->hdrsize + f->msgsize;
+}
+
+/*
+ * Pack the given chain of messages, each fitting in one packet, back
+ * to back in the given packet. Each message is preceded by the size of
+ * its header and payload. They are small, so they're copied. The
+ * packet goes on lane BXIMSG_LANE_AGGR, to peers with BXIMSG_HDR_FLAG_V2.
+ */
+static void bximsg_pkt_fill_aggr(struct bximsg_iface *iface, struct swptl_sodata *f,
+				 struct bxipkt_buf *pkt)
+{
+	unsigned char *buf = pkt->addr;
+	size_t msgoffs, size, len;
+	void *data;
+
+	pkt->iovcnt = 0;
+	for (; f != NULL; f = f->aggr_next) {
+		len = f->hdrsize + f->msgsize;
+		buf[0] = len;
+		buf[1] = len >> 8;
+		buf += BXIMSG_AGGR_HDR;
+
+		iface->ops->snd_start(iface->arg, f, buf);
+		f->conn->stats[BXIMSG_SND_START_NB]++;
+
+		for (msgoffs = 0; msgoffs < f->msgsize; msgoffs += size) {
+			iface->ops->snd_data(iface->arg, f, msgoffs, &data, &size);
+			f->conn->stats[BXIMSG_SND_DATA_NB]++;
+			if (size > f->msgsize - msgoffs)
+				size = f->msgsize - msgoffs;
+			memcpy(buf + f->hdrsize + msgoffs, data, size);
+		}
+
+		buf += len;
+	}
+	pkt->size = buf - (unsigned char *)pkt->addr;
+}
+
+/*
+ * If the given message, about to be sent, and the ones queued after it
+ * fit in one packet, chain them to it, so that they're packed in the
+ * same packet. Return the number of messages chained.
+ */
+static int bximsg_aggr_chain(struct bximsg_iface *iface, struct bximsg_conn *conn,
+			     struct swptl_sodata *f)
+{
+	struct swptl_sodata *next;
+	size_t room;
+	int count = 0;
+
+	f->aggr_next = NULL;
+	/* older peers don't know packed packets */
+	if (!iface->ctx->opts.aggregate || !conn->v2 || f->pkt_next != 0)
+		return 0;
+
+	/* the size of each message must fit in its prefix */
+	room = MIN(iface->mtu, BXIMSG_AGGR_HDR + 0xffff);
+	if (bximsg_aggr_size(f) > room)
+		return 0;
+	room -= bximsg_aggr_size(f);
+
+	while ((next = conn->send_qhead) != NULL && bximsg_aggr_size(next) <= room) {
+		room -= bximsg_aggr_size(next);
+		conn->send_qhead = next->next;
+		if (conn->send_qhead == NULL)
+			conn->send_qtail = &conn->send_qhead;
+
+		/* it's sent and acked along with f */
+		next->lane = f->lane;
+		next->pkt_next = next->pkt_count;
+		next->aggr_next = NULL;
+		f->aggr_next = next;
+		f = next;
+		count++;
+	}
+
+	/* the packed messages share the seq. num. of the packet */
+	conn->msg_seq -= count;
+	conn->stats[BXIMSG_OUT_AGGR_MSG_NB] += count > 0 ? count + 1 : 0;
+	return count;
 }
 
 void bximsg_pkt_handle(struct bximsg_iface *iface, struct swptl_sodata *f, unsigned char *buf,
@@ -633,11 +1507,75 @@ void bximsg_pkt_handle(struct bximsg_iface *iface, struct swptl_sodata *f, unsig
 	}
 }
 
+/*
+ * Return the message of the given connection to send the next packet
+ * of. Each message being sent has its own lane, so that their packets
+ * may be interleaved (peers without BXIMSG_HDR_FLAG_V2 get a single
+ * lane): a message sends up to burst packets in a row, then its turn
+ * ends. Turns go to the oldest message, except that the
+ * next message of the queue starts as soon as a lane is free and gets
+ * one turn. So a small message doesn't wait for the large ones queued
+ * before it to be sent completely, messages still start in order, and
+ * the oldest one progresses even if new messages keep coming.
+ */
+static struct swptl_sodata *bximsg_send_next(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+	struct swptl_sodata *f, **pf;
+
+	f = conn->send_cur;
+	if (f != NULL && conn->send_burst < iface->burst)
+		return f;
+
+	if (conn->send_qhead != NULL && __builtin_ctz(~conn->send_lanes) < bximsg_lanes(conn) &&
+	    (!conn->send_started || conn->sending == NULL)) {
+		f = conn->send_qhead;
+		conn->send_qhead = f->next;
+		if (conn->send_qhead == NULL)
+			conn->send_qtail = &conn->send_qhead;
+
+		f->lane = __builtin_ctz(~conn->send_lanes);
+		conn->send_lanes |= 1u << f->lane;
+		f->next = NULL;
+		for (pf = &conn->sending; *pf != NULL; pf = &(*pf)->next)
+			;
+		*pf = f;
+		conn->send_started = 1;
+	} else {
+		f = conn->sending;
+		conn->send_started = 0;
+	}
+
+	conn->send_cur = f;
+	conn->send_burst = 0;
+	return f;
+}
+
+/*
+ * Get a retransmit run, allocate it if none is available
+ */
+static struct bximsg_run *bximsg_run_get(struct bximsg_iface *iface)
+{
+	struct bximsg_run *run;
+
+	run = iface->run_free;
+	if (run == NULL)
+		return xmalloc(sizeof(struct bximsg_run), "bximsg_run");
+
+	iface->run_free = run->next;
+	return run;
+}
+
+static void bximsg_run_put(struct bximsg_iface *iface, struct bximsg_run *run)
+{
+	run->next = iface->run_free;
+	iface->run_free = run;
+}
+
 int bximsg_send_data(struct bximsg_iface *iface, struct bximsg_conn *conn)
 {
 	struct bxipkt_buf *pkt;
-	struct swptl_sodata *f;
-	unsigned char *buf;
+	struct bximsg_run *run;
+	struct swptl_sodata *f, **pf;
 	char msg[PTL_LOG_BUF_SIZE];
 #ifdef DEBUG
 	int msg_len;
@@ -651,23 +1589,39 @@ int bximsg_send_data(struct bximsg_iface *iface, struct bximsg_conn *conn)
 		return 0;
 	}
 
+	/*
+	 * If we were idle long enough for the peer to free its side of
+	 * the connection, send a single packet flagged RESUME until it's
+	 * acked: the peer recreates the connection with our seq. numbers
+	 */
+	if (iface->ctx->opts.conn_idle > 0 && conn->send_seq == conn->send_ack &&
+	    !conn->synchronizing &&
+	    timo_now(iface->ctx->timo) - conn->last_active >= iface->ctx->opts.conn_idle / 2)
+		conn->resuming = 1;
+
 	/* initialize the packet structure and the packet header */
 	pkt->conn = conn;
-	pkt->hdr.data_seq = conn->send_seq;
+	hdr_set_data_seq(&pkt->hdr, conn->send_seq);
 	/* Start synchronization handshake on first packet to transmit */
-	pkt->hdr.flags = conn->synchronizing ? BXIMSG_HDR_FLAG_SYN : 0;
-	if (conn->peer_synchronizing) {
+	pkt->hdr.flags = BXIMSG_HDR_FLAG_EXT | BXIMSG_HDR_FLAG_V2 |
+			 (conn->synchronizing ? BXIMSG_HDR_FLAG_SYN : 0) |
+			 (conn->resuming ? BXIMSG_HDR_FLAG_RESUME : 0);
+	/*
+	 * The peer takes our seq. numbers from the SYN_ACK, so if packets
+	 * are in flight, let an ack-only packet carry it, see
+	 * bximsg_send_ack()
+	 */
+	if (conn->peer_synchronizing && conn->send_seq == conn->send_ack) {
 		pkt->hdr.flags |= BXIMSG_HDR_FLAG_SYN_ACK;
 		conn->peer_synchronizing = 0;
 	}
 	pkt->send_pending_memcpy = 0;
-	buf = pkt->addr;
 
 	/*
 	 * There's necesserily a message, otherwise
 	 * cansend_data() wouldn't be true.
 	 */
-	f = conn->send_qhead;
+	f = bximsg_send_next(iface, conn);
 	if (f == NULL) {
 		bximsg_conn_log(conn, sizeof(msg), msg);
 		ptl_panic("%s: connection has no msg to send\n", msg);
@@ -684,7 +1638,20 @@ int bximsg_send_data(struct bximsg_iface *iface, struct bximsg_conn *conn)
 			f->use_async_memcpy = 1;
 	}
 
-	pkt->size = bximsg_pkt_fill(iface, f, buf, f->pkt_next, &pkt->send_pending_memcpy);
+	if (bximsg_aggr_chain(iface, conn, f) > 0) {
+		pkt->hdr.vc = BXIMSG_HDR_VCLANE(conn->vc, BXIMSG_LANE_AGGR);
+		bximsg_pkt_fill_aggr(iface, f, pkt);
+	} else {
+		pkt->hdr.vc = BXIMSG_HDR_VCLANE(conn->vc, f->lane);
+		bximsg_pkt_fill(iface, f, pkt, f->pkt_next);
+	}
+
+	/* measure the round-trip time of one packet at a time */
+	if (!conn->rtt_timing) {
+		conn->rtt_timing = 1;
+		conn->rtt_seq = conn->send_seq;
+		conn->rtt_start = timo_now(iface->ctx->timo);
+	}
 
 	/* calculate next packet we expect */
 	conn->send_seq++;
@@ -692,6 +1659,12 @@ int bximsg_send_data(struct bximsg_iface *iface, struct bximsg_conn *conn)
 	/* enqueue the packet to the interface send queue */
 	bximsg_sendpkt(iface, pkt);
 
+	/*
+	 * The packet will carry the most recent ack when it's actually
+	 * sent, so there's no need for an extra ack-only packet.
+	 */
+	bximsg_ack_sent(conn);
+
 	/*
 	 * if this is the first packet for retransmit, start a
 	 * retransmit time-out for the connection
@@ -700,31 +1673,46 @@ int bximsg_send_data(struct bximsg_iface *iface, struct bximsg_conn *conn)
 		timo_add(&conn->ret_timo, get_next_timo(conn));
 
 	/*
-	 * Attach packet to the retransmit queue, it will
-	 * stay there until it's ack'ed.
+	 * Attach packet to the retransmit queue, it will stay there
+	 * until it's ack'ed. If the previous packet is of the same
+	 * message, it's in the last run.
 	 */
-	if (f->pkt_acked == f->pkt_next) {
-		f->ret_next = NULL;
-		*conn->ret_qtail = f;
-		conn->ret_qtail = &f->ret_next;
+	run = conn->ret_qtail;
+	if (run != NULL && run->f == f && run->index + run->count == f->pkt_next)
+		run->count++;
+	else {
+		run = bximsg_run_get(iface);
+		run->next = NULL;
+		run->f = f;
+		run->seq = conn->send_seq - 1;
+		run->index = f->pkt_next;
+		run->count = 1;
+		if (conn->ret_qtail != NULL)
+			conn->ret_qtail->next = run;
+		else
+			conn->ret_qhead = run;
+		conn->ret_qtail = run;
 #ifdef DEBUG
 		if (bximsg_debug >= 3) {
 			msg_len = bximsg_conn_log(conn, sizeof(msg), msg);
 			msg_len += snprintf(msg + msg_len, sizeof(msg) - msg_len, ": ");
 			swptl_ctx_log(f, sizeof(msg) - msg_len, msg + msg_len);
-			ptl_log("%s: message append to retq\n", msg);
+			ptl_log("%s: packet %u append to retq\n", msg, f->pkt_next);
 		}
 #endif
 	}
 
 	/* move to next packet */
 	f->pkt_next++;
+	conn->send_burst++;
 
 	if (f->pkt_next == f->pkt_count) {
-		/* remove from queue */
-		conn->send_qhead = f->next;
-		if (conn->send_qhead == NULL)
-			conn->send_qtail = &conn->send_qhead;
+		/* free its lane */
+		for (pf = &conn->sending; *pf != f; pf = &(*pf)->next)
+			;
+		*pf = f->next;
+		conn->send_lanes &= ~(1u << f->lane);
+		conn->send_cur = NULL;
 #ifdef DEBUG
 		if (bximsg_debug >= 3) {
 			msg_len = bximsg_conn_log(conn, sizeof(msg), msg);
@@ -742,53 +1730,105 @@ int bximsg_send_data(struct bximsg_iface *iface, struct bximsg_conn *conn)
 }
 
 /*
- * Reset sequence numbers for the given connection and enter synchronization
- * state.
+ * Reset receive sequence numbers for the given connection and enter
+ * synchronization state. Keep the send ones: the packets in flight are
+ * retransmitted with the SYN flag and the peer continues with them.
  */
 static void bximsg_reset_conn(struct bximsg_iface *iface, struct bximsg_conn *conn)
 {
-	conn->send_seq = conn->send_ack = makeseq(iface->nid, iface->pid);
-	conn->recv_seq = conn->recv_ack = makeseq(conn->nid, conn->pid);
-	conn->msg_seq = conn->send_seq;
+	conn->recv_seq = conn->recv_ack = makeseq(iface, conn->nid, conn->pid);
 	conn->synchronizing = 1;
+	conn->resuming = 0;
+	conn->seq32 = 0;
+	conn->v2 = 0;
+	conn->ospid = 0;
+	conn->rdv_nak = 0;
+	conn->sack_seq = conn->send_ack;
+	conn->sack = 0;
+	conn->rtt_timing = 0;
+	conn->cwnd = MIN(BXIMSG_CWND_INIT, bximsg_wnd_max(conn));
+	conn->cwnd_acked = 0;
+	conn->cwnd_limited = 0;
+	conn->dupacks = 0;
+	conn->recovering = 0;
+	conn->ssthresh = bximsg_wnd_max(conn);
+	conn->busy = conn->peer_busy = 0;
+	bximsg_ooo_flush(conn);
 
 	ptl_log("reset connection seq numbers send=%d/recv=%d\n", conn->send_seq, conn->recv_seq);
 }
 
+/*
+ * Send an ack-only packet. If a packet buffer is available, it's
+ * enqueued to the interface send queue, so that acks are batched with
+ * the data packets. Otherwise it's sent inline.
+ */
 int bximsg_send_ack(struct bximsg_iface *iface, struct bximsg_conn *conn)
 {
+	struct bxipkt_buf *pkt;
 	struct bximsg_hdr hdr;
 #ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
-	hdr.data_seq = conn->send_seq;
-	hdr.ack_seq = conn->recv_seq;
+	/*
+	 * Carry the first unacked packet, so that a peer adopting our
+	 * seq. numbers from a SYN_ACK doesn't skip packets in flight
+	 */
+	hdr_set_data_seq(&hdr, conn->send_ack);
+	hdr_set_ack_seq(&hdr, conn->recv_seq);
 	/* If we are synchronizing, send a NACK_RST */
-	hdr.flags = conn->synchronizing ? BXIMSG_HDR_FLAG_NACK_RST : 0;
+	hdr.flags = BXIMSG_HDR_FLAG_EXT | BXIMSG_HDR_FLAG_V2 |
+		    (conn->synchronizing ? BXIMSG_HDR_FLAG_NACK_RST : 0);
+	hdr.flags |= bximsg_ack_flags(conn);
 	if (conn->peer_synchronizing) {
 		hdr.flags |= BXIMSG_HDR_FLAG_SYN_ACK;
 		conn->peer_synchronizing = 0;
 	}
 	hdr.vc = conn->vc;
-	hdr.__pad = 0;
+	hdr.sack = bximsg_sack(conn);
 
-	if (!iface->ctx->opts.transport->send_inline(iface->pktif, &hdr, conn->nid, conn->pid)) {
-		conn->stats[BXIMSG_OUT_INLINE_PKT_ERROR_NB]++;
-		return 0;
-	}
+	pkt = iface->ctx->opts.transport->getbuf(iface->pktif);
+	if (pkt != NULL) {
+		pkt->conn = conn;
+		pkt->hdr = hdr;
+		pkt->size = 0;
+		pkt->iovcnt = 0;
+		pkt->send_pending_memcpy = 0;
+		bximsg_sendpkt(iface, pkt);
 
-	/* save ack we're sending in this packet */
-	conn->recv_ack = conn->recv_seq;
+		/*
+		 * The ack will be refreshed when the packet is actually
+		 * sent, but consider it done to not enqueue another one.
+		 */
+		bximsg_ack_sent(conn);
+#ifdef DEBUG
+		if (bximsg_debug >= 3) {
+			bximsg_conn_log(conn, sizeof(buf), buf);
+			ptl_log("%s: ack queued: data_seq = %u, ack_seq = %u\n", buf,
+				conn->send_ack, conn->recv_seq);
+		}
+#endif
+	} else {
+		if (!iface->ctx->opts.transport->send_inline(iface->pktif, &hdr, conn->nid,
+							     conn->pid)) {
+			conn->stats[BXIMSG_OUT_INLINE_PKT_ERROR_NB]++;
+			return 0;
+		}
+
+		/* save ack we're sending in this packet */
+		bximsg_ack_sent(conn);
+		bximsg_conn_touch(iface, conn);
 
-	conn->stats[BXIMSG_OUT_INLINE_PKT_NB]++;
+		conn->stats[BXIMSG_OUT_INLINE_PKT_NB]++;
 #ifdef DEBUG
-	if (bximsg_debug >= 3) {
-		bximsg_conn_log(conn, sizeof(buf), buf);
-		ptl_log("%s: inline sent: data_seq = %u, ack_seq = %u\n", buf, hdr.data_seq,
-			hdr.ack_seq);
-	}
+		if (bximsg_debug >= 3) {
+			bximsg_conn_log(conn, sizeof(buf), buf);
+			ptl_log("%s: inline sent: data_seq = %u, ack_seq = %u\n", buf,
+				conn->send_ack, conn->recv_seq);
+		}
 #endif
+	}
 	if (!cansend_data(conn))
 		bximsg_conn_dequeue(iface, conn);
 
@@ -796,20 +1836,52 @@ int bximsg_send_ack(struct bximsg_iface *iface, struct bximsg_conn *conn)
 }
 
 /*
- * Attempt to send: get the first connection in the send queue (ie
- * first active connection) and send a data packet or an ack packet.
+ * Move the connection at the head of the send queue to its tail
  */
-int bximsg_send(struct bximsg_iface *iface)
+static void bximsg_conn_rotate(struct bximsg_iface *iface)
 {
-	struct bximsg_conn *conn;
-	char buf[PTL_LOG_BUF_SIZE];
+	struct bximsg_conn *conn = iface->conn_qhead;
 
-	/* get the first active connection */
-	conn = iface->conn_qhead;
-	if (conn == NULL) {
-		LOGN(5, "bximsg_send: no active connections\n");
-		return 0;
-	}
+	if (conn->qnext == NULL)
+		return;
+
+	iface->conn_qhead = conn->qnext;
+	conn->qnext->qprev = &iface->conn_qhead;
+
+	conn->qnext = NULL;
+	conn->qprev = iface->conn_qtail;
+	*iface->conn_qtail = conn;
+	iface->conn_qtail = &conn->qnext;
+}
+
+/*
+ * Attempt to send: get the first connection in the send queue (ie
+ * first active connection) and send a data packet or an ack packet.
+ *
+ * Active connections take turns in deficit round-robin: a connection
+ * gets the quantum of its virtual circuit when its turn comes, each
+ * packet it sends is charged to it, and once it has used its credit
+ * it waits at the tail of the queue for its next turn.
+ */
+int bximsg_send(struct bximsg_iface *iface)
+{
+	struct bximsg_conn *conn;
+	char buf[PTL_LOG_BUF_SIZE];
+	int rc = 0;
+
+	/* get the first active connection, and start its turn */
+	conn = iface->conn_qhead;
+	if (conn == NULL) {
+		LOGN(5, "bximsg_send: no active connections\n");
+		return 0;
+	}
+	while (conn->deficit <= 0) {
+		conn->deficit += iface->quantum[conn->vc];
+		if (conn->deficit > 0)
+			break;
+		bximsg_conn_rotate(iface);
+		conn = iface->conn_qhead;
+	}
 
 	/* we've data to send (prepare a data + ack packet) */
 	if (!cansend(conn)) {
@@ -817,15 +1889,32 @@ int bximsg_send(struct bximsg_iface *iface)
 		ptl_panic("%s: conn on queue, but nothing to send\n", buf);
 	}
 
-	if (cansend_data(conn)) {
-		if (bximsg_send_data(iface, conn))
-			return 1;
-	}
+	if (cansend_data(conn))
+		rc = bximsg_send_data(iface, conn);
 
-	if (cansend_ack(conn))
-		return bximsg_send_ack(iface, conn);
+	if (!rc && cansend_ack(conn))
+		rc = bximsg_send_ack(iface, conn);
 
-	return 0;
+	/* end of its turn */
+	if (conn == iface->conn_qhead && conn->deficit <= 0)
+		bximsg_conn_rotate(iface);
+
+	return rc;
+}
+
+/*
+ * Produce up to send_budget packets, taking them in turn from the
+ * active connections, until we run out of packet buffers or of
+ * connections able to send.
+ */
+static void bximsg_send_sched(struct bximsg_iface *iface)
+{
+	int i;
+
+	for (i = 0; i < iface->send_budget; i++) {
+		if (!bximsg_send(iface))
+			break;
+	}
 }
 
 /*
@@ -833,9 +1922,9 @@ int bximsg_send(struct bximsg_iface *iface)
  */
 void bximsg_ack(struct bximsg_iface *iface, struct bximsg_conn *conn, unsigned int ack_seq)
 {
-	struct swptl_sodata *f;
+	struct bximsg_run *run;
+	struct swptl_sodata *f, *next;
 	int delta;
-	int pkt_avail;
 	int pkt_delta;
 #ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
@@ -847,8 +1936,18 @@ void bximsg_ack(struct bximsg_iface *iface, struct bximsg_conn *conn, unsigned i
 	if (delta <= 0)
 		return;
 
+	bximsg_cwnd_ack(conn, delta);
+	conn->dupacks = 0;
+	if (conn->recovering && seqcmp(ack_seq, conn->recover_seq) >= 0)
+		conn->recovering = 0;
+
 	/* advance send position, restart timeer */
 	conn->send_ack = ack_seq;
+	conn->resuming = 0;
+	if (conn->rtt_timing && seqcmp(ack_seq, conn->rtt_seq) > 0) {
+		conn->rtt_timing = 0;
+		bximsg_rtt_update(conn, timo_now(iface->ctx->timo) - conn->rtt_start);
+	}
 	if (conn->ret_qhead) {
 		timo_del(&conn->ret_timo);
 		conn->retries = 0;
@@ -862,19 +1961,21 @@ void bximsg_ack(struct bximsg_iface *iface, struct bximsg_conn *conn, unsigned i
 #endif
 	/* trash unneeded packets from the retransmit buffer */
 	for (;;) {
-		f = conn->ret_qhead;
-		if (f == NULL) {
+		run = conn->ret_qhead;
+		if (run == NULL) {
 			timo_del(&conn->ret_timo);
 			break;
 		}
 
-		pkt_avail = f->pkt_next - f->pkt_acked;
-
 		pkt_delta = delta;
-		if (pkt_delta > pkt_avail)
-			pkt_delta = pkt_avail;
+		if (pkt_delta > run->count)
+			pkt_delta = run->count;
 
+		f = run->f;
 		f->pkt_acked += pkt_delta;
+		run->seq += pkt_delta;
+		run->index += pkt_delta;
+		run->count -= pkt_delta;
 		delta -= pkt_delta;
 
 		/*
@@ -882,249 +1983,852 @@ void bximsg_ack(struct bximsg_iface *iface, struct bximsg_conn *conn, unsigned i
 		 * is OK because retransmit queue is sorted
 		 * with increasing sequence numbers
 		 */
-		if (f->pkt_next > f->pkt_acked)
+		if (run->count > 0)
 			break;
 
 		/* detach from retransmit queue */
-		conn->ret_qhead = f->ret_next;
+		conn->ret_qhead = run->next;
 		if (conn->ret_qhead == NULL)
-			conn->ret_qtail = &conn->ret_qhead;
+			conn->ret_qtail = NULL;
+		bximsg_run_put(iface, run);
+
+		/* the messages packed after f are acked along with it */
+		for (; f != NULL; f = next) {
+			next = f->aggr_next;
+			if (next != NULL)
+				next->pkt_acked = next->pkt_count;
+			if (f->pkt_acked != f->pkt_count)
+				continue;
 #ifdef DEBUG
-		if (bximsg_debug >= 3) {
-			buf_len = bximsg_conn_log(conn, sizeof(buf), buf);
-			buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ": ");
-			swptl_ctx_log(f, sizeof(buf) - buf_len, buf + buf_len);
-			ptl_log("%s: releasing message\n", buf);
-		}
+			if (bximsg_debug >= 3) {
+				buf_len = bximsg_conn_log(conn, sizeof(buf), buf);
+				buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ": ");
+				swptl_ctx_log(f, sizeof(buf) - buf_len, buf + buf_len);
+				ptl_log("%s: releasing message\n", buf);
+			}
 #endif
-		if (f->pkt_acked == f->pkt_count) {
 			iface->ops->snd_end(iface->arg, f, SWPTL_TRP_OK);
 			conn->stats[BXIMSG_SND_END_NB]++;
 		}
 	}
 
-	/* if this unblocks the connection, reactivate it */
-	if (cansend_data(conn))
-		bximsg_conn_enqueue(iface, conn);
+	/* if this unblocks the connection, reactivate it */
+	if (cansend_data(conn))
+		bximsg_conn_enqueue(iface, conn);
+}
+
+/*
+ * Process the selective ack bits of an incoming packet. For a given
+ * ack_seq the set of received packets only grows, so bits of packets
+ * arriving out of order are merged.
+ */
+static void bximsg_sack_input(struct bximsg_conn *conn, struct bximsg_hdr *hdr,
+			      unsigned int ack_seq)
+{
+	int delta;
+
+	delta = seqcmp(ack_seq, conn->sack_seq);
+	if (delta > 0) {
+		conn->sack_seq = ack_seq;
+		conn->sack = hdr->sack;
+	} else if (delta == 0)
+		conn->sack |= hdr->sack;
+}
+
+/*
+ * Build again the i-th packet of the given run and queue it for
+ * sending. Return 0 if we run out of buffers.
+ */
+static int bximsg_resend(struct bximsg_iface *iface, struct bximsg_conn *conn,
+			 struct bximsg_run *run, unsigned int i)
+{
+	struct swptl_sodata *f = run->f;
+	unsigned int index = run->index + i;
+	struct bxipkt_buf *pkt;
+#ifdef DEBUG
+	char buf[PTL_LOG_BUF_SIZE];
+	int buf_len;
+#endif
+
+	pkt = iface->ctx->opts.transport->getbuf(iface->pktif);
+	if (pkt == NULL) {
+		conn->stats[BXIMSG_GET_BUF_ERROR_NB]++;
+		return 0;
+	}
+
+	hdr_set_data_seq(&pkt->hdr, run->seq + i);
+	pkt->hdr.flags = BXIMSG_HDR_FLAG_EXT | BXIMSG_HDR_FLAG_V2 |
+			 (conn->synchronizing ? BXIMSG_HDR_FLAG_SYN : 0) |
+			 (conn->resuming ? BXIMSG_HDR_FLAG_RESUME : 0);
+	pkt->conn = conn;
+	pkt->send_pending_memcpy = 0;
+#ifdef DEBUG
+	if (bximsg_debug >= 3) {
+		buf_len = bximsg_conn_log(conn, sizeof(buf), buf);
+		buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ": ");
+		swptl_ctx_log(f, sizeof(buf) - buf_len, buf + buf_len);
+		ptl_log("%s: regen packet %u\n", buf, index);
+	}
+#endif
+	if (f->aggr_next != NULL) {
+		pkt->hdr.vc = BXIMSG_HDR_VCLANE(conn->vc, BXIMSG_LANE_AGGR);
+		bximsg_pkt_fill_aggr(iface, f, pkt);
+	} else {
+		pkt->hdr.vc = BXIMSG_HDR_VCLANE(conn->vc, f->lane);
+		bximsg_pkt_fill(iface, f, pkt, index);
+	}
+#ifdef DEBUG
+	if (bximsg_debug >= 2) {
+		bximsg_conn_log(conn, sizeof(buf), buf);
+		ptl_log("%s: data = %u: resending\n", buf, run->seq + i);
+	}
+#endif
+	conn->stats[BXIMSG_RTX_PKT_NB]++;
+	bximsg_sendpkt(iface, pkt);
+
+	return 1;
+}
+
+/*
+ * The peer reported it's missing the packet at send_ack: resend it and
+ * the packets up to the last one the peer has, except the ones it
+ * reported, without waiting for the retransmit timeout.
+ */
+static void bximsg_fast_rtx(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+	struct bximsg_run *run;
+	unsigned int index, end;
+	int i;
+
+	conn->stats[BXIMSG_RTX_FAST_NB]++;
+	conn->rtt_timing = 0;
+	bximsg_cwnd_loss(conn, 0);
+	if (!cansend(conn))
+		bximsg_conn_dequeue(iface, conn);
+
+	/* sequence number following the last packet the peer has */
+	for (i = BXIMSG_SACK_MAX - 1; i >= 0; i--) {
+		if ((conn->sack >> i) & 1)
+			break;
+	}
+	end = conn->sack_seq + 2 + i;
+
+	run = conn->ret_qhead;
+	index = 0;
+	while (seqcmp(run->seq + index, end) < 0) {
+		if (bximsg_sacked(conn, run->seq + index))
+			conn->stats[BXIMSG_RTX_SACKED_NB]++;
+		else if (!bximsg_resend(iface, conn, run, index))
+			break;
+
+		if (++index == run->count) {
+			run = run->next;
+			if (run == NULL)
+				break;
+			index = 0;
+		}
+	}
+
+	/* the retransmitted packets need a full timeout to be acked */
+	timo_del(&conn->ret_timo);
+	timo_add(&conn->ret_timo, get_next_timo(conn));
+}
+
+/*
+ * Process an ack reporting a gap. Once we get enough of them in a row
+ * for the same packet, or the peer reported enough packets after it
+ * (acks may be coalesced), consider the packet lost and start a fast
+ * retransmit, unless we're already recovering from a loss. If there are
+ * few packets in flight, there can't be many duplicate acks, so
+ * require fewer of them.
+ */
+static void bximsg_dupack(struct bximsg_iface *iface, struct bximsg_conn *conn,
+			  unsigned int ack_seq)
+{
+	int thresh;
+
+	if (conn->ret_qhead == NULL || conn->synchronizing || conn->recovering ||
+	    ack_seq != conn->send_ack)
+		return;
+
+	thresh = MIN(BXIMSG_DUPACK_THRESH, seqcmp(conn->send_seq, conn->send_ack) - 1);
+	conn->dupacks++;
+	if (MAX(conn->dupacks, __builtin_popcount(conn->sack)) < MAX(thresh, 1))
+		return;
+
+	conn->dupacks = 0;
+	conn->recovering = 1;
+	conn->recover_seq = conn->send_seq;
+	bximsg_fast_rtx(iface, conn);
+}
+
+/*
+ * Connection retransmit time-out expired: i.e. we didn't receive the
+ * ACK within the given time frame. Retransmit all packets in the
+ * retransmit buffer, except the ones the peer reported it has.
+ */
+void bximsg_timo(void *arg)
+{
+	struct bximsg_conn *conn = arg;
+	struct bximsg_iface *iface = conn->iface;
+	struct bximsg_run *run;
+	struct swptl_sodata *f;
+	unsigned int index;
+	int max_retries, i;
+	char buf[PTL_LOG_BUF_SIZE];
+
+	conn->stats[BXIMSG_RTX_CALL_NB]++;
+
+	/*
+	 * The ack of a retransmitted packet can't tell which copy it
+	 * acks, so don't measure the round-trip time (Karn's algorithm)
+	 */
+	conn->rtt_timing = 0;
+	conn->dupacks = 0;
+	conn->recovering = 0;
+	bximsg_cwnd_loss(conn, 1);
+	if (!cansend(conn))
+		bximsg_conn_dequeue(iface, conn);
+#ifdef DEBUG
+	if (bximsg_debug >= 2) {
+		bximsg_conn_log(conn, sizeof(buf), buf);
+		ptl_log("%s: timeout expired\n", buf);
+	}
+#endif
+	max_retries = (conn->iface->ctx->opts.max_retries >= 0) ?
+			      conn->iface->ctx->opts.max_retries :
+		      iface->drain ? BXIMSG_MAX_RETRIES :
+				     INT_MAX;
+
+	if (conn->retries < max_retries) {
+		run = conn->ret_qhead;
+		if (run == NULL) {
+			bximsg_conn_log(conn, sizeof(buf), buf);
+			ptl_panic("%s: no packets to retransmit\n", buf);
+		}
+
+		/*
+		 * Resend all packets in the retransmit queue, but stop if we
+		 * run out of buffers. We'll retry later anyway.
+		 */
+		index = 0;
+		while (1) {
+			if (!conn->synchronizing && bximsg_sacked(conn, run->seq + index))
+				conn->stats[BXIMSG_RTX_SACKED_NB]++;
+			else if (!bximsg_resend(iface, conn, run, index))
+				break;
+
+			if (++index == run->count) {
+				run = run->next;
+				if (run == NULL)
+					break;
+				index = 0;
+			}
+		}
+
+		conn->retries++;
+		timo_add(&conn->ret_timo, get_next_timo(conn));
+		return;
+	}
+
+	/*
+	 * reached max retransmit count with no progress,
+	 * trash the retransmit buffer.
+	 */
+	conn->stats[BXIMSG_RTX_MAX_RETRIES_NB]++;
+	conn->sack = 0;
+	while ((run = conn->ret_qhead) != NULL) {
+		conn->ret_qhead = run->next;
+#ifdef DEBUG
+		if (bximsg_debug >= 3) {
+			bximsg_conn_log(conn, sizeof(buf), buf);
+			ptl_log("%s: %u..%u: nret max reached\n", buf, (uint16_t)run->seq,
+				(uint16_t)(run->seq + run->count));
+		}
+#endif
+		/* stop waiting for ack */
+		conn->send_ack = run->seq + run->count;
+		bximsg_run_put(iface, run);
+	}
+	conn->ret_qtail = NULL;
+
+	/* abort incoming messages in progress */
+	bximsg_ooo_flush(conn);
+	for (i = 0; i < BXIMSG_LANE_MAX; i++) {
+		if (conn->recv_ctx[i]) {
+			iface->ops->rcv_end(iface->arg, conn->recv_ctx[i], SWPTL_TRP_UNREACHABLE);
+			conn->stats[BXIMSG_RCV_END_NB]++;
+			conn->recv_ctx[i] = NULL;
+		}
+	}
+
+	while ((f = conn->sending) != NULL) {
+		conn->sending = f->next;
+		iface->ops->snd_end(iface->arg, f, 1);
+		conn->stats[BXIMSG_SND_END_NB]++;
+	}
+	conn->send_lanes = 0;
+	conn->send_cur = NULL;
+
+	while ((f = conn->send_qhead) != NULL) {
+		conn->send_qhead = f->next;
+		iface->ops->snd_end(iface->arg, f, 1);
+		conn->stats[BXIMSG_SND_END_NB]++;
+	}
+	conn->send_qtail = &conn->send_qhead;
+
+	/* free associated contexts in upper layer */
+	iface->ops->conn_err(iface->arg, conn);
+	conn->retries = 0;
+}
+
+/*
+ * Delayed ack time-out expired: send the pending ack without waiting
+ * for more packets.
+ */
+void bximsg_ack_timo(void *arg)
+{
+	struct bximsg_conn *conn = arg;
+
+	conn->stats[BXIMSG_ACK_TIMO_NB]++;
+	conn->ack_now = 1;
+	if (cansend(conn))
+		bximsg_conn_enqueue(conn->iface, conn);
+}
+
+/*
+ * Packet placement call-back, invoked by the transport before it receives
+ * a packet. If the packet is the next one of the message being received,
+ * return the segments of the receive buffer its payload goes to, as
+ * bximsg_pkt_handle() would copy it. Otherwise, return 0 and let
+ * bximsg_input() process it.
+ */
+int bximsg_place(void *arg, struct bximsg_hdr *hdr, int nid, int pid, size_t size,
+		 struct iovec *iov, int iovmax)
+{
+	struct bximsg_iface *iface = arg;
+	struct bximsg_conn *conn;
+	struct swptl_sodata *f;
+	size_t msgoffs, len;
+	void *data;
+	int cnt;
+
+	if (BXIMSG_HDR_VC(hdr) >= BXIMSG_VC_COUNT || BXIMSG_HDR_LANE(hdr) >= BXIMSG_LANE_MAX ||
+	    iface->drain)
+		return 0;
+
+	/* packets bximsg_input() may not accept, or not as data */
+	if (hdr->flags & (BXIMSG_HDR_FLAG_NACK_RST | BXIMSG_HDR_FLAG_SYN))
+		return 0;
+
+	conn = bximsg_getconn(iface, nid, pid, BXIMSG_HDR_VC(hdr));
+	f = conn->recv_ctx[BXIMSG_HDR_LANE(hdr)];
+	if (conn->synchronizing || conn->recv_aggr != NULL || f == NULL ||
+	    hdr_data_seq(conn, hdr) != conn->recv_seq || f->pkt_next == 0 ||
+	    f->pkt_next >= f->pkt_count)
+		return 0;
+
+	msgoffs = f->pkt_next * iface->mtu - f->hdrsize;
+	cnt = 0;
+	while (size > 0 && msgoffs < f->msgsize) {
+		if (cnt == iovmax)
+			return 0;
+		iface->ops->rcv_data(iface->arg, f, msgoffs, &data, &len);
+		f->conn->stats[BXIMSG_RCV_DATA_NB]++;
+		if (len > size)
+			len = size;
+
+		iov[cnt].iov_base = data;
+		iov[cnt].iov_len = len;
+		cnt++;
+
+		msgoffs += len;
+		size -= len;
+	}
+
+	/* more payload than expected, let bximsg_pkt_handle() ignore it */
+	if (size > 0)
+		return 0;
+
+	return cnt;
+}
+
+/*
+ * A message of the packet following the last received one couldn't be
+ * started: drop the packet, it will be retransmitted later, hopefully
+ * we'll have resources soon.
+ */
+static void bximsg_rcv_busy(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+#ifdef DEBUG
+	char buf[PTL_LOG_BUF_SIZE];
+
+	if (bximsg_debug >= 2) {
+		bximsg_conn_log(conn, sizeof(buf), buf);
+		ptl_log("%s: %u: couldn't start, packet"
+			" dropped\n",
+			buf, conn->recv_seq - 1);
+	}
+#endif
+	conn->recv_seq--;
+	conn->stats[BXIMSG_RCV_START_ERROR_NB]++;
+
+	/*
+	 * ask the peer to stop sending new packets, we'll
+	 * accept the retransmitted ones once we've resources
+	 */
+	if (!conn->busy) {
+		conn->busy = 1;
+		conn->recv_ack = conn->recv_seq - 1;
+		conn->ack_now = 1;
+		bximsg_conn_enqueue(iface, conn);
+	}
+}
+
+/*
+ * Start and receive the messages of a packed packet, made of whole
+ * messages, see bximsg_pkt_fill_aggr(). Return the number of bytes
+ * processed, less than size if a message couldn't be started.
+ */
+static size_t bximsg_aggr_recv(struct bximsg_iface *iface, struct bximsg_conn *conn,
+			       enum swptl_transport_status status, unsigned char *data,
+			       size_t size, int uid)
+{
+	struct swptl_sodata *f;
+	size_t len, msgsize, done;
+
+	for (done = 0; size - done >= BXIMSG_AGGR_HDR; done += len) {
+		len = data[done] | data[done + 1] << 8;
+		if (len > size - done - BXIMSG_AGGR_HDR) {
+			ptl_log("bximsg_aggr_recv: %zu: bad message size\n", len);
+			return size;
+		}
+
+		if (!iface->ops->rcv_start(iface->arg, data + done + BXIMSG_AGGR_HDR, len,
+					   conn->nid, conn->pid, conn->vc, uid, &f, &msgsize))
+			return done;
+		conn->stats[BXIMSG_RCV_START_SUCCESS_NB]++;
+		conn->stats[BXIMSG_IN_AGGR_MSG_NB]++;
+
+		f->pkt_count = 1;
+		f->pkt_next = 0;
+		f->pkt_acked = 0;
+		f->msgsize = msgsize;
+		f->recv_pending_memcpy = 0;
+		f->use_async_memcpy = 0;
+		bximsg_pkt_handle(iface, f, data + done + BXIMSG_AGGR_HDR, len, f->pkt_next++,
+				  NULL);
+
+		iface->ops->rcv_end(iface->arg, f, status);
+		conn->stats[BXIMSG_RCV_END_NB]++;
+
+		len += BXIMSG_AGGR_HDR;
+	}
+
+	return size;
+}
+
+/*
+ * Start the messages of a packed packet left by bximsg_accept_aggr().
+ * Return 0 if some of them still can't be started.
+ */
+static int bximsg_aggr_resume(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+	struct bximsg_ooo *o = conn->recv_aggr;
+	size_t done;
+
+	done = bximsg_aggr_recv(iface, conn, o->status, o->data, o->size, o->uid);
+	if (done < o->size) {
+		memmove(o->data, o->data + done, o->size - done);
+		o->size -= done;
+		return 0;
+	}
+
+	xfree(o);
+	conn->recv_aggr = NULL;
+	if (conn->aggr_timo.set)
+		timo_del(&conn->aggr_timo);
+	conn->busy = 0;
+	return 1;
+}
+
+/*
+ * Retry time-out of the messages of a packed packet not started yet:
+ * try again, and tell the peer if it may send again.
+ */
+void bximsg_aggr_timo(void *arg)
+{
+	struct bximsg_conn *conn = arg;
+
+	if (!bximsg_aggr_resume(conn->iface, conn)) {
+		conn->stats[BXIMSG_RCV_START_ERROR_NB]++;
+		timo_add(&conn->aggr_timo, conn->rto);
+		return;
+	}
+
+	conn->ack_now = 1;
+	if (cansend(conn))
+		bximsg_conn_enqueue(conn->iface, conn);
+}
+
+/*
+ * Process the packed packet following the last received one. If none
+ * of its messages can be started, the packet is dropped. Otherwise,
+ * it's accepted, as the peer must see the messages we started acked
+ * before anything we send in response to them, and the ones left are
+ * kept, to be started before any other packet is accepted. Return 0
+ * if the packet was dropped.
+ */
+static int bximsg_accept_aggr(struct bximsg_iface *iface, struct bximsg_conn *conn,
+			      enum swptl_transport_status status, unsigned char *data,
+			      size_t size, int uid)
+{
+	struct bximsg_ooo *o;
+	size_t done;
+
+	done = bximsg_aggr_recv(iface, conn, status, data, size, uid);
+	if (done == 0) {
+		bximsg_rcv_busy(iface, conn);
+		return 0;
+	}
+
+	conn->busy = 0;
+	conn->ack_now = 1;
+	if (done == size)
+		return 1;
+
+	o = xmalloc(sizeof(struct bximsg_ooo) + size - done, "bximsg_ooo");
+	o->seq = conn->recv_seq - 1;
+	o->status = status;
+	o->uid = uid;
+	o->size = size - done;
+	memcpy(o->data, data + done, size - done);
+	conn->recv_aggr = o;
+	conn->stats[BXIMSG_RCV_START_ERROR_NB]++;
+	timo_add(&conn->aggr_timo, conn->rto);
+	return 1;
 }
 
 /*
- * Connection retransmit time-out expired: i.e. we didn't receive the
- * ACK within the given time frame. Retransmit all packets in the
- * retransmit buffer.
+ * Process the packet following the last received one, as part of the
+ * message being received on its lane. Return 0 if it was dropped for
+ * lack of receive resources.
  */
-void bximsg_timo(void *arg)
+static int bximsg_accept(struct bximsg_iface *iface, struct bximsg_conn *conn,
+			 enum swptl_transport_status status, void *data, size_t size,
+			 struct bximsg_hdr *hdr, int uid)
 {
-	struct bxipkt_buf *pkt;
-	struct bximsg_conn *conn = arg;
-	struct bximsg_iface *iface = conn->iface;
 	struct swptl_sodata *f;
-	unsigned int index;
-	int max_retries;
-	char buf[PTL_LOG_BUF_SIZE];
+	size_t msgsize;
+	int rc;
 #ifdef DEBUG
-	int buf_len;
+	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
-	conn->stats[BXIMSG_RTX_CALL_NB]++;
+	conn->recv_seq++;
 #ifdef DEBUG
-	if (bximsg_debug >= 2) {
+	if (bximsg_debug >= 3) {
 		bximsg_conn_log(conn, sizeof(buf), buf);
-		ptl_log("%s: timeout expired\n", buf);
+		ptl_log("%s: conn->recv_seq -> %u\n", buf, conn->recv_seq);
 	}
 #endif
-	max_retries = (conn->iface->ctx->opts.max_retries >= 0) ?
-			      conn->iface->ctx->opts.max_retries :
-		      iface->drain ? BXIMSG_MAX_RETRIES :
-				     INT_MAX;
+	if (conn->recv_aggr != NULL && !bximsg_aggr_resume(iface, conn)) {
+		bximsg_rcv_busy(iface, conn);
+		return 0;
+	}
+	if (BXIMSG_HDR_LANE(hdr) == BXIMSG_LANE_AGGR)
+		return bximsg_accept_aggr(iface, conn, status, data, size, uid);
 
-	if (conn->retries < max_retries) {
-		f = conn->ret_qhead;
-		if (f == NULL) {
-			bximsg_conn_log(conn, sizeof(buf), buf);
-			ptl_panic("%s: no packets to retransmit\n", buf);
-		}
+	f = conn->recv_ctx[BXIMSG_HDR_LANE(hdr)];
+	if (f == NULL) {
+		if (data == NULL)
+			ptl_panic("bximsg_accept: placed packet without message\n");
+
+		rc = iface->ops->rcv_start(iface->arg, data, size, conn->nid, conn->pid, conn->vc,
+					   uid, &f, &msgsize);
 
 		/*
-		 * Resend all packets in the retransmit queue, but stop if we
-		 * run out of buffers. We'll retry later anyway.
+		 * if we run out of context (receive resources)
+		 * then just drop the packet, it will retransmitted
+		 * later, hopefully we'll have resources soon
 		 */
-		index = f->pkt_acked;
-		while (1) {
-			pkt = conn->iface->ctx->opts.transport->getbuf(iface->pktif);
-			if (pkt == NULL) {
-				conn->stats[BXIMSG_GET_BUF_ERROR_NB]++;
-				break;
-			}
+		if (rc) {
+			conn->stats[BXIMSG_RCV_START_SUCCESS_NB]++;
+		} else {
+			bximsg_rcv_busy(iface, conn);
+			return 0;
+		}
+		conn->busy = 0;
 
-			pkt->hdr.data_seq = f->seq + index;
-			pkt->hdr.flags = conn->synchronizing ? BXIMSG_HDR_FLAG_SYN : 0;
-			pkt->conn = conn;
-			pkt->send_pending_memcpy = 0;
-#ifdef DEBUG
-			if (bximsg_debug >= 3) {
-				buf_len = bximsg_conn_log(conn, sizeof(buf), buf);
-				buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, ": ");
-				swptl_ctx_log(f, sizeof(buf) - buf_len, buf + buf_len);
-				ptl_log("%s: regen packet %u\n", buf, index);
-			}
-#endif
-			pkt->size = bximsg_pkt_fill(iface, f, pkt->addr, index,
-						    &pkt->send_pending_memcpy);
-#ifdef DEBUG
-			if (bximsg_debug >= 2) {
-				bximsg_conn_log(conn, sizeof(buf), buf);
-				ptl_log("%s: data = %u: resending\n", buf, pkt->hdr.data_seq);
-			}
-#endif
-			conn->stats[BXIMSG_RTX_PKT_NB]++;
-			bximsg_sendpkt(iface, pkt);
+		conn->recv_ctx[BXIMSG_HDR_LANE(hdr)] = f;
 
-			if (++index == f->pkt_next) {
-				f = f->ret_next;
-				if (f == NULL)
-					break;
-				index = f->pkt_acked;
-			}
-		}
+		f->pkt_count = (msgsize + f->hdrsize + iface->mtu - 1) / iface->mtu;
+		f->pkt_next = 0;
+		f->pkt_acked = 0;
+		f->msgsize = msgsize;
+		f->recv_pending_memcpy = 0;
 
-		conn->retries++;
-		timo_add(&conn->ret_timo, get_next_timo(conn));
-		return;
+		if (msgsize < bximsg_async_memcpy_min_msg_size)
+			f->use_async_memcpy = 0;
+		else
+			f->use_async_memcpy = 1;
 	}
 
-	/*
-	 * reached max retransmit count with no progress,
-	 * trash the retransmit buffer.
-	 */
-	conn->stats[BXIMSG_RTX_MAX_RETRIES_NB]++;
-	while ((f = conn->ret_qhead) != NULL) {
-		conn->ret_qhead = f->ret_next;
-#ifdef DEBUG
-		if (bximsg_debug >= 3) {
-			bximsg_conn_log(conn, sizeof(buf), buf);
-			ptl_log("%s: %u..%u: nret max reached\n", buf,
-				(uint16_t)(f->pkt_acked + f->seq),
-				(uint16_t)(f->pkt_next + f->seq));
-		}
-#endif
-		/* stop waiting for ack */
-		conn->send_ack = f->seq + f->pkt_next;
+	if (data != NULL)
+		bximsg_pkt_handle(iface, f, data, size, f->pkt_next++, &f->recv_pending_memcpy);
+	else {
+		f->pkt_next++;
+		conn->stats[BXIMSG_IN_PLACED_PKT_NB]++;
 	}
-	conn->ret_qtail = &conn->ret_qhead;
 
-	/* abort incoming message in progress */
-	if (conn->recv_ctx) {
-		iface->ops->rcv_end(iface->arg, conn->recv_ctx, SWPTL_TRP_UNREACHABLE);
+	if (f->pkt_count == f->pkt_next) {
+		while (f->recv_pending_memcpy != 0)
+			;
+
+		conn->recv_ctx[BXIMSG_HDR_LANE(hdr)] = NULL;
+
+		/*
+		 * the sender completes the message once its last packet
+		 * is acked, don't make it wait for the ack timer
+		 */
+		conn->ack_now = 1;
+
+		/* Consider transport error reply as an ack, to avoid retransmits */
+		if (status != SWPTL_TRP_OK)
+			bximsg_ack(iface, conn, conn->send_ack + 1);
+
+		iface->ops->rcv_end(iface->arg, f, status);
 		conn->stats[BXIMSG_RCV_END_NB]++;
-		conn->recv_ctx = NULL;
 	}
 
-	while ((f = conn->send_qhead) != NULL) {
-		conn->send_qhead = f->next;
-		iface->ops->snd_end(iface->arg, f, 1);
-		conn->stats[BXIMSG_SND_END_NB]++;
+
+	return 1;
+}
+
+/*
+ * Keep a packet received ahead of the expected one, so that it needs
+ * not to be retransmitted. Packets too far ahead are dropped.
+ */
+static void bximsg_ooo_store(struct bximsg_conn *conn, enum swptl_transport_status status,
+			     void *data, size_t size, struct bximsg_hdr *hdr, unsigned int seq,
+			     int uid)
+{
+	struct bximsg_ooo *o, **slot;
+
+	if (data == NULL || seqcmp(seq, conn->recv_seq) > BXIMSG_SACK_MAX)
+		return;
+
+	slot = &conn->ooo[seq % BXIMSG_SACK_MAX];
+	if (*slot != NULL) {
+		if ((*slot)->seq == seq)
+			return;
+		xfree(*slot);
+		conn->ooo_count--;
 	}
-	conn->send_qtail = &conn->send_qhead;
 
-	/* free associated contexts in upper layer */
-	iface->ops->conn_err(iface->arg, conn);
-	conn->retries = 0;
+	o = xmalloc(sizeof(struct bximsg_ooo) + size, "bximsg_ooo");
+	o->seq = seq;
+	o->hdr = *hdr;
+	o->status = status;
+	o->uid = uid;
+	o->size = size;
+	memcpy(o->data, data, size);
+
+	*slot = o;
+	conn->ooo_count++;
+	conn->stats[BXIMSG_IN_OOO_PKT_NB]++;
+}
+
+/*
+ * Process the packets received early that follow the last received
+ * one. If one can't be processed, drop it: as it's not reported in
+ * selective acks anymore, it will be retransmitted.
+ */
+static void bximsg_ooo_drain(struct bximsg_iface *iface, struct bximsg_conn *conn)
+{
+	struct bximsg_ooo *o, **slot;
+
+	while (conn->ooo_count > 0) {
+		slot = &conn->ooo[conn->recv_seq % BXIMSG_SACK_MAX];
+		o = *slot;
+		if (o == NULL || o->seq != conn->recv_seq)
+			break;
+
+		*slot = NULL;
+		conn->ooo_count--;
+		bximsg_accept(iface, conn, o->status, o->data, o->size, &o->hdr, o->uid);
+		xfree(o);
+	}
 }
 
 /*
  * Packet input call-back, invoked whenever a new packet is received.
+ * Return 0 if the packet was dropped for lack of receive resources.
+ * If data is NULL, the payload was stored by bximsg_place().
  */
-void bximsg_input(void *arg, enum swptl_transport_status status, void *data, size_t size,
-		  struct bximsg_hdr *hdr, int nid, int pid, int uid)
+int bximsg_input(void *arg, enum swptl_transport_status status, void *data, size_t size,
+		 struct bximsg_hdr *hdr, int nid, int pid, int uid)
 {
 	struct bximsg_iface *iface = arg;
 	struct bximsg_conn *conn;
-	struct swptl_sodata *f;
-	size_t msgsize;
-	int rc;
+	unsigned int data_seq, ack_seq;
 #ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
-	if (hdr->vc >= BXIMSG_VC_COUNT) {
-		ptl_log("%d: bad vc from nid %d, pid = %d\n", hdr->vc, nid, pid);
-		return;
+	if (BXIMSG_HDR_VC(hdr) >= BXIMSG_VC_COUNT) {
+		ptl_log("%d: bad vc from nid %d, pid = %d\n", BXIMSG_HDR_VC(hdr), nid, pid);
+		return 1;
+	}
+	if (BXIMSG_HDR_LANE(hdr) >= BXIMSG_LANE_MAX && BXIMSG_HDR_LANE(hdr) != BXIMSG_LANE_AGGR) {
+		ptl_log("%d: bad lane from nid %d, pid = %d\n", BXIMSG_HDR_LANE(hdr), nid, pid);
+		return 1;
 	}
 
 	/* find connection this packet belongs to */
-	conn = bximsg_getconn(iface, nid, pid, hdr->vc);
+	conn = bximsg_getconn(iface, nid, pid, BXIMSG_HDR_VC(hdr));
+	data_seq = hdr_data_seq(conn, hdr);
+	ack_seq = hdr_ack_seq(conn, hdr);
 #ifdef DEBUG
 	if (bximsg_debug >= 3) {
 		bximsg_conn_log(conn, sizeof(buf), buf);
 		ptl_log("%s: received: size = %lu, data_seq = %u, ack_seq ="
 			" %u\n",
-			buf, size, hdr->data_seq, hdr->ack_seq);
+			buf, size, data_seq, ack_seq);
 	}
 #endif
 	conn->stats[BXIMSG_IN_PKT_NB]++;
+	bximsg_conn_touch(iface, conn);
 
 	if (hdr->flags & BXIMSG_HDR_FLAG_NACK_RST) {
 		bximsg_reset_conn(iface, conn);
-		return;
+		return 1;
+	}
+	if ((hdr->flags & BXIMSG_HDR_FLAG_RESUME) && conn->synchronizing) {
+		/*
+		 * We freed the connection, and the peer resumes it: it
+		 * acked all we sent and sends one packet at a time, so
+		 * continue with its seq. numbers. If we started sending
+		 * meanwhile, wait for the SYN_ACK of the peer instead.
+		 */
+		if (conn->msg_seq != conn->send_ack)
+			return 1;
+		conn->recv_seq = conn->recv_ack = data_seq;
+		conn->send_seq = conn->send_ack = conn->msg_seq = ack_seq;
+		conn->sack_seq = conn->send_ack;
+		conn->synchronizing = 0;
+		bximsg_peer_caps(conn, hdr->flags);
 	}
 	if (conn->synchronizing) {
 		if (hdr->flags & BXIMSG_HDR_FLAG_SYN_ACK) {
 			/* End of the synchronization handshake */
-			conn->recv_seq = conn->recv_ack = hdr->data_seq;
+			conn->recv_seq = conn->recv_ack = data_seq;
 			conn->synchronizing = 0;
+			bximsg_peer_caps(conn, hdr->flags);
 			/* Let the ACK go through */
 		} else if (!(hdr->flags & BXIMSG_HDR_FLAG_SYN)) {
+			/* our SYN is in flight, the peer will answer it */
+			if (conn->send_seq != conn->send_ack)
+				return 1;
+
 			/* We just restarted, and the peer is not synchronizing,
 			 * drop the packet and send a NACK_RST */
 			conn->recv_seq++; /* Force sending ack */
+			conn->ack_now = 1;
 			goto done_ack;
 		}
 	}
 	if (hdr->flags & BXIMSG_HDR_FLAG_SYN) {
-		/* Peer informs us that it has restarted */
-		conn->recv_seq = conn->recv_ack = hdr->data_seq;
+		/*
+		 * The peer sends one packet until it gets our SYN_ACK, so
+		 * if it's the one we just accepted, our SYN_ACK was lost
+		 */
+		if (conn->synchronizing || data_seq != conn->recv_seq - 1) {
+			/* Peer informs us that it has restarted */
+			conn->recv_seq = conn->recv_ack = data_seq;
+			conn->ospid = 0;
+			conn->rdv_nak = 0;
+	conn->rdv_nak = 0;
+			bximsg_peer_caps(conn, hdr->flags);
+			bximsg_ooo_flush(conn);
+
+			/*
+			 * If we've nothing in flight, our SYN_ACK tells the
+			 * peer the seq. numbers we use, so we're done too
+			 */
+			if (conn->synchronizing && conn->msg_seq == conn->send_ack)
+				conn->synchronizing = 0;
+		}
 		/* Let the packet through and remember to send a SYN_ACK */
 		conn->peer_synchronizing = 1;
+		conn->ack_now = 1;
+	}
+
+	/*
+	 * if the peer is busy, it's alive: don't count retransmits that it
+	 * drops as failures, and stop sending new packets
+	 */
+	if (hdr->flags & BXIMSG_HDR_FLAG_BUSY) {
+		conn->stats[BXIMSG_IN_BUSY_NB]++;
+		conn->peer_busy = 1;
+		conn->retries = 0;
+		if (!cansend(conn))
+			bximsg_conn_dequeue(iface, conn);
+	} else if (conn->peer_busy) {
+		conn->peer_busy = 0;
+		if (cansend_data(conn))
+			bximsg_conn_enqueue(iface, conn);
 	}
 
 	/* handle the send ack, the rest is receive-specific*/
-	bximsg_ack(iface, conn, hdr->ack_seq);
+	bximsg_ack(iface, conn, ack_seq);
+	bximsg_sack_input(conn, hdr, ack_seq);
+	if (hdr->flags & BXIMSG_HDR_FLAG_DUPACK)
+		bximsg_dupack(iface, conn, ack_seq);
 
 	/* if this is an empty (aka ack-only) packet, we're done */
 	if (size == 0)
-		return;
+		return 1;
 
-	/* closing the interface, don't accept more data */
-	if (iface->drain) {
+	/*
+	 * closing the interface, don't accept more data, but ack again the
+	 * retransmits of what we got, or the peer would retransmit forever
+	 */
+	if (iface->drain && seqcmp(data_seq, conn->recv_seq) >= 0) {
 #ifdef DEBUG
 		if (bximsg_debug >= 2) {
 			bximsg_conn_log(conn, sizeof(buf), buf);
-			ptl_log("%s: %u: connection closing, dropped\n", buf, hdr->data_seq);
+			ptl_log("%s: %u: connection closing, dropped\n", buf, data_seq);
 		}
 #endif
-		return;
+		return 1;
 	}
 
-	/* if we missed a previous packet, wait for retransmit */
-	if (seqcmp(hdr->data_seq, conn->recv_seq) > 0) {
+	/*
+	 * if we missed a previous packet, keep this one until the missing
+	 * one is retransmitted, and ack again to report we have it
+	 */
+	if (seqcmp(data_seq, conn->recv_seq) > 0) {
 #ifdef DEBUG
 		if (bximsg_debug >= 2) {
 			bximsg_conn_log(conn, sizeof(buf), buf);
 			ptl_log("%s: %u: lost packet, got %u instead\n", buf, conn->recv_seq,
-				hdr->data_seq);
+				data_seq);
 		}
 #endif
-		return;
+		bximsg_ooo_store(conn, status, data, size, hdr, data_seq, uid);
+		conn->recv_ack = conn->recv_seq - 1;
+		conn->ack_now = 1;
+		goto done_ack;
 	}
 
 	/* if we already got this packet, retransmit ack for it */
-	if (seqcmp(hdr->data_seq, conn->recv_seq) < 0) {
+	if (seqcmp(data_seq, conn->recv_seq) < 0) {
 		conn->stats[BXIMSG_IN_PKT_DUPLICATES]++;
 #ifdef DEBUG
 		if (bximsg_debug >= 2) {
 			bximsg_conn_log(conn, sizeof(buf), buf);
-			ptl_log("%s: %u: duplicate, expected %u\n", buf, hdr->data_seq,
+			ptl_log("%s: %u: duplicate, expected %u\n", buf, data_seq,
 				conn->recv_seq);
 		}
 #endif
@@ -1133,82 +2837,34 @@ void bximsg_input(void *arg, enum swptl_transport_status status, void *data, siz
 		 * Move the receive-ack position backwards, this will
 		 * trigger (re-)transmission of the old acks
 		 */
-		conn->recv_ack = hdr->data_seq;
+		conn->recv_ack = data_seq;
+		conn->ack_now = 1;
 		goto done_ack;
 	}
 
-	/* accept the packet */
-	conn->recv_seq++;
-#ifdef DEBUG
-	if (bximsg_debug >= 3) {
-		bximsg_conn_log(conn, sizeof(buf), buf);
-		ptl_log("%s: conn->recv_seq -> %u\n", buf, conn->recv_seq);
-	}
-#endif
-	f = conn->recv_ctx;
-	if (f == NULL) {
-		rc = iface->ops->rcv_start(iface->arg, data, size, nid, pid, hdr->vc, uid, &f,
-					   &msgsize);
-
-		/*
-		 * if we run out of context (receive resources)
-		 * then just drop the packet, it will retransmitted
-		 * later, hopefully we'll have resources soon
-		 */
-		if (rc) {
-			conn->stats[BXIMSG_RCV_START_SUCCESS_NB]++;
-		} else {
-#ifdef DEBUG
-			if (bximsg_debug >= 2) {
-				bximsg_conn_log(conn, sizeof(buf), buf);
-				ptl_log("%s: %u: couldn't start, packet"
-					" dropped\n",
-					buf, hdr->data_seq);
-			}
-#endif
-			conn->recv_seq--;
-			conn->stats[BXIMSG_RCV_START_ERROR_NB]++;
-			return;
-		}
-
-		conn->recv_ctx = f;
-
-		f->pkt_count = (msgsize + f->hdrsize + iface->mtu - 1) / iface->mtu;
-		f->pkt_next = 0;
-		f->pkt_acked = 0;
-		f->msgsize = msgsize;
-		f->recv_pending_memcpy = 0;
-
-		if (msgsize < bximsg_async_memcpy_min_msg_size)
-			f->use_async_memcpy = 0;
-		else
-			f->use_async_memcpy = 1;
-	}
-
-	bximsg_pkt_handle(iface, f, data, size, f->pkt_next++, &f->recv_pending_memcpy);
-
-	if (f->pkt_count == f->pkt_next) {
-		while (f->recv_pending_memcpy != 0)
-			;
-
-		conn->recv_ctx = NULL;
-
-		/* Consider transport error reply as an ack, to avoid retransmits */
-		if (status != SWPTL_TRP_OK)
-			bximsg_ack(iface, conn, conn->send_ack + 1);
-
-		iface->ops->rcv_end(iface->arg, f, status);
-		conn->stats[BXIMSG_RCV_END_NB]++;
-	}
+	/* accept the packet, then the ones received early that follow it */
+	if (!bximsg_accept(iface, conn, status, data, size, hdr, uid))
+		return 0;
+	bximsg_ooo_drain(iface, conn);
 
 done_ack:
 
+	/*
+	 * if the ack may wait, give it a chance to be sent along with the
+	 * acks of the next packets or with data
+	 */
+	if (seqcmp(conn->recv_seq, conn->recv_ack) > 0 && !cansend_ack(conn) &&
+	    !conn->ack_timo.set)
+		timo_add(&conn->ack_timo, iface->ctx->opts.ack_delay);
+
 	/*
 	 * if an ACK needs to be sent back, put the connection on send
 	 * queue
 	 */
 	if (cansend(conn))
 		bximsg_conn_enqueue(iface, conn);
+
+	return 1;
 }
 
 /*
@@ -1218,16 +2874,29 @@ done_ack:
 void bximsg_output(void *arg, struct bxipkt_buf *pkt)
 {
 	struct bximsg_iface *iface = arg;
-#ifdef DEBUG
 	struct bximsg_conn *conn = pkt->conn;
+#ifdef DEBUG
 	char buf[PTL_LOG_BUF_SIZE];
 #endif
 
+	/*
+	 * The transport can't lose this packet and delivers it in order,
+	 * so if all previous packets are acked, there's no need to wait
+	 * for the peer to ack it, nor to keep it for retransmission. Not
+	 * while synchronizing or resuming, as the peer may reject it.
+	 */
+	if (pkt->reliable && pkt->size > 0 && !conn->synchronizing && !conn->resuming &&
+	    HDR_SEQ(pkt->hdr.data_seq, pkt->hdr.data_seq_hi) == conn->send_ack) {
+		bximsg_ack(iface, conn, conn->send_ack + 1);
+		conn->stats[BXIMSG_OUT_RELIABLE_PKT_NB]++;
+	}
+
+	conn->npkts--;
 	iface->ctx->opts.transport->putbuf(iface->pktif, pkt);
 #ifdef DEBUG
 	if (bximsg_debug >= 3) {
 		bximsg_conn_log(conn, sizeof(buf), buf);
-		ptl_log("%s: %u: freeed\n", buf, pkt->hdr.data_seq);
+		ptl_log("%s: %u: freeed\n", buf, HDR_SEQ(pkt->hdr.data_seq, pkt->hdr.data_seq_hi));
 	}
 #endif
 }
@@ -1239,17 +2908,23 @@ bool swptl_transport_make_error_rsp(void *input_pkt, size_t input_len, void *rsp
 	size_t swptl_len = *rsp_len;
 	bool res;
 
-	if (input_len < sizeof(*erroring_hdr))
+	if (input_len < sizeof(*erroring_hdr) || BXIMSG_HDR_LANE(erroring_hdr) == BXIMSG_LANE_AGGR)
 		return false;
 
 	if (*rsp_len < sizeof(*rsp_hdr))
 		return false;
 
-	rsp_hdr->vc = erroring_hdr->vc;
+	rsp_hdr->vc = BXIMSG_HDR_VC(erroring_hdr);
 	/* Arbitrary sequence number, does not matter */
 	rsp_hdr->data_seq = 42;
 	rsp_hdr->ack_seq = erroring_hdr->data_seq;
 	rsp_hdr->flags = BXIMSG_HDR_FLAG_SYN | BXIMSG_HDR_FLAG_SYN_ACK;
+	if (erroring_hdr->flags & BXIMSG_HDR_FLAG_EXT) {
+		rsp_hdr->data_seq_hi = 0;
+		rsp_hdr->ack_seq_hi = erroring_hdr->data_seq_hi;
+		rsp_hdr->flags |= BXIMSG_HDR_FLAG_EXT;
+	}
+	rsp_hdr->sack = 0;
 
 	swptl_len -= sizeof(*rsp_hdr);
 	res = swptl_transport_make_error_reply(erroring_hdr + 1, input_len - sizeof(*erroring_hdr),
@@ -1276,12 +2951,20 @@ struct bximsg_iface *bximsg_init(struct bximsg_ctx *ctx, void *arg, struct bxims
 
 	iface->ctx = ctx;
 
-	for (i = 0; i < BXIMSG_HASHSIZE; i++)
-		iface->bximsg_connlist[i] = NULL;
+	iface->conntab_size = BXIMSG_CONNTAB_INIT;
+	iface->conntab = xmalloc(iface->conntab_size * sizeof(struct bximsg_connent),
+				 "bximsg_conntab");
+	memset(iface->conntab, 0, iface->conntab_size * sizeof(struct bximsg_connent));
+	iface->conn_count = 0;
+	iface->conn_list = iface->conn_tail = NULL;
+	iface->conn_slabs = NULL;
+	iface->conn_free = NULL;
+	memset(iface->stats, 0, sizeof(iface->stats));
 
 	iface->pktif =
 		ctx->opts.transport->init(&ctx->pkt_ctx, 0, nic_iface, uid, pid, ctx->opts.nbufs,
-					  iface, bximsg_input, bximsg_output, bximsg_log_sent_pkt,
+					  iface, bximsg_input, bximsg_place, bximsg_output,
+					  bximsg_log_sent_pkt,
 					  &iface->nid, &iface->pid, &iface->mtu);
 	if (iface->pktif == NULL)
 		return NULL;
@@ -1289,6 +2972,25 @@ struct bximsg_iface *bximsg_init(struct bximsg_ctx *ctx, void *arg, struct bxims
 	iface->pkt_qhead = NULL;
 	iface->pkt_qtail = &iface->pkt_qhead;
 
+	/*
+	 * enough packets to fill a transport batch, but not more than
+	 * the receiver socket buffer can absorb at once
+	 */
+	iface->send_budget = MIN(BXIMSG_SEND_BATCH,
+				 (BXIMSG_SEND_BATCH_SIZE + iface->mtu - 1) / iface->mtu);
+
+	/* a quantum is at least one packet, so connections always progress */
+	for (i = 0; i < BXIMSG_VC_COUNT; i++)
+		iface->quantum[i] = MAX(1, MIN(ctx->opts.vc_weight[i], INT_MAX / 2 / iface->mtu)) *
+				    iface->mtu;
+
+	/* with interleaving disabled, a message is sent to its end */
+	if (ctx->opts.interleave > 0)
+		iface->burst = MIN((ctx->opts.interleave + iface->mtu - 1) / iface->mtu, INT_MAX);
+	else
+		iface->burst = INT_MAX;
+	iface->run_free = NULL;
+
 	iface->conn_qhead = NULL;
 	iface->conn_qtail = &iface->conn_qhead;
 
@@ -1298,6 +3000,18 @@ struct bximsg_iface *bximsg_init(struct bximsg_ctx *ctx, void *arg, struct bxims
 	iface->ops = ops;
 	iface->drain = 0;
 
+	/*
+	 * The peer retransmits unacked packets at least every
+	 * tx_timeout_max, don't free the connection in between as it
+	 * would reject them
+	 */
+	if (ctx->opts.conn_idle > 0 && ctx->opts.conn_idle < 2 * ctx->opts.tx_timeout_max)
+		ctx->opts.conn_idle = 2 * ctx->opts.tx_timeout_max;
+
+	timo_set(ctx->timo, &iface->reclaim_timo, bximsg_reclaim, iface);
+	if (ctx->opts.conn_idle > 0)
+		timo_add(&iface->reclaim_timo, MIN(ctx->opts.conn_idle / 4 + 1, UINT_MAX));
+
 	return iface;
 }
 
@@ -1318,36 +3032,37 @@ static void dump_stats(const char *msg, unsigned long *stats)
  */
 void bximsg_done(struct bximsg_iface *iface)
 {
-	struct bximsg_conn *c, **l;
-	int i;
-	int j;
-	unsigned long totals[BXIMSG_MAX_STATS];
+	struct bximsg_conn_slab *slab;
+	struct bximsg_run *run;
+	struct bximsg_conn *c;
 	char buf[PTL_LOG_BUF_SIZE];
 
 	iface->drain = 1;
+	if (iface->reclaim_timo.set)
+		timo_del(&iface->reclaim_timo);
 
 	/*
 	 * Drain all connections
 	 */
-	for (i = 0; i < BXIMSG_HASHSIZE; i++) {
-		l = &iface->bximsg_connlist[i];
-		for (c = *l; c != NULL; c = c->hnext) {
-			if (c->ret_qhead || cansend_ack(c)) {
+	for (c = iface->conn_list; c != NULL; c = c->next) {
+		/* delayed acks are due now */
+		if (cansend(c))
+			bximsg_conn_enqueue(iface, c);
+		if (c->ret_qhead || cansend_ack(c)) {
 #ifdef DEBUG
-				if (bximsg_debug >= 2) {
-					bximsg_conn_log(c, sizeof(buf), buf);
-					ptl_log("%s: draining\n", buf);
-				}
+			if (bximsg_debug >= 2) {
+				bximsg_conn_log(c, sizeof(buf), buf);
+				ptl_log("%s: draining\n", buf);
+			}
 #endif
-				while (c->ret_qhead || cansend_ack(c))
-					swptl_dev_progress(iface->arg, 1);
+			while (c->ret_qhead || cansend_ack(c))
+				swptl_dev_progress(iface->arg, 1);
 #ifdef DEBUG
-				if (bximsg_debug >= 2) {
-					bximsg_conn_log(c, sizeof(buf), buf);
-					ptl_log("%s: drained\n", buf);
-				}
-#endif
+			if (bximsg_debug >= 2) {
+				bximsg_conn_log(c, sizeof(buf), buf);
+				ptl_log("%s: drained\n", buf);
 			}
+#endif
 		}
 	}
 
@@ -1364,27 +3079,21 @@ void bximsg_done(struct bximsg_iface *iface)
 	/*
 	 * Free connections
 	 */
-	memset(totals, 0, BXIMSG_MAX_STATS * sizeof(unsigned long));
-
-	for (i = 0; i < BXIMSG_HASHSIZE; i++) {
-		l = &iface->bximsg_connlist[i];
-		while ((c = *l) != NULL) {
-			*l = c->hnext;
+	while ((c = iface->conn_list) != NULL)
+		bximsg_conn_free(iface, c);
 
-			for (j = 0; j < BXIMSG_MAX_STATS; j++)
-				totals[j] += c->stats[j];
-
-			if (iface->ctx->opts.stats >= 2) {
-				bximsg_conn_log(c, sizeof(buf), buf);
-				dump_stats(buf, c->stats);
-			}
-
-			xfree(c);
-		}
+	while ((slab = iface->conn_slabs) != NULL) {
+		iface->conn_slabs = slab->next;
+		xfree(slab);
+	}
+	while ((run = iface->run_free) != NULL) {
+		iface->run_free = run->next;
+		xfree(run);
 	}
+	xfree(iface->conntab);
 
 	if (iface->ctx->opts.stats >= 1) {
-		dump_stats("bximsg stats", totals);
+		dump_stats("bximsg stats", iface->stats);
 	}
 	xfree(iface);
 }
@@ -1395,8 +3104,10 @@ void bximsg_pkt_dump(struct bxipkt_buf *pkt)
 
 void bximsg_conn_dump(struct bximsg_conn *conn)
 {
+	struct bximsg_run *run;
 	struct swptl_sodata *f;
 	char buf[PTL_LOG_BUF_SIZE];
+	int i;
 
 	bximsg_conn_log(conn, sizeof(buf), buf);
 	ptl_log("%s\n", buf);
@@ -1404,21 +3115,35 @@ void bximsg_conn_dump(struct bximsg_conn *conn)
 	snprintf(buf, sizeof(buf), "  recv_seq = %u, recv_ack = %u, send_seq = %u, send_ack = %u",
 		 conn->recv_seq, conn->recv_ack, conn->send_seq, conn->send_ack);
 
-	dump_stats(buf, conn->stats);
-
-	ptl_log("  retries = %lu\n", conn->retries);
-
-	if (conn->recv_ctx) {
-		ptl_log("  receiving message:\n");
-		swptl_ctx_dump(conn->recv_ctx);
+	if (conn->stats != conn->iface->stats_discard)
+		dump_stats(buf, conn->stats);
+	else
+		ptl_log("%s\n", buf);
+
+	ptl_log("  retries = %lu, srtt = %u, rttvar = %u, rto = %u\n", conn->retries, conn->srtt,
+		conn->rttvar, conn->rto);
+	ptl_log("  cwnd = %u, ssthresh = %u, busy = %d, peer_busy = %d\n", conn->cwnd,
+		conn->ssthresh, conn->busy, conn->peer_busy);
+	ptl_log("  sack_seq = %u, sack = 0x%02x, out-of-order packets = %d\n", conn->sack_seq,
+		conn->sack, conn->ooo_count);
+
+	for (i = 0; i < BXIMSG_LANE_MAX; i++) {
+		if (conn->recv_ctx[i]) {
+			ptl_log("  receiving message on lane %d:\n", i);
+			swptl_ctx_dump(conn->recv_ctx[i]);
+		}
+	}
+	for (f = conn->sending; f != NULL; f = f->next) {
+		ptl_log("  sending message on lane %u:\n", f->lane);
+		swptl_ctx_dump(f);
 	}
 	ptl_log("  output message queue:\n");
 	for (f = conn->send_qhead; f != NULL; f = f->next)
 		swptl_ctx_dump(f);
 	ptl_log("  retransmit queue:\n");
-	for (f = conn->ret_qhead; f != NULL; f = f->ret_next) {
-		ptl_log("  data_seq = %u..%u\n", (uint16_t)(f->seq + f->pkt_acked),
-			(uint16_t)(f->seq + f->pkt_next));
+	for (run = conn->ret_qhead; run != NULL; run = run->next) {
+		ptl_log("  data_seq = %u..%u, lane %u\n", (uint16_t)run->seq,
+			(uint16_t)(run->seq + run->count), run->f->lane);
 	}
 }
 
@@ -1427,22 +3152,19 @@ void bximsg_conn_dump(struct bximsg_conn *conn)
  */
 void bximsg_dump(struct bximsg_iface *iface)
 {
-	struct bximsg_conn *conn, *list;
+	struct bximsg_conn *conn;
 	struct bxipkt_buf *pkt;
-	int i;
 	char buf[PTL_LOG_BUF_SIZE];
 
 	ptl_log("connections:\n");
-	for (i = 0; i < BXIMSG_HASHSIZE; i++) {
-		list = iface->bximsg_connlist[i];
-		for (conn = list; conn != NULL; conn = conn->hnext)
-			bximsg_conn_dump(conn);
-	}
+	for (conn = iface->conn_list; conn != NULL; conn = conn->next)
+		bximsg_conn_dump(conn);
 
 	ptl_log("output queue:\n");
 	for (pkt = iface->pkt_qhead; pkt != NULL; pkt = pkt->next) {
 		bximsg_conn_log(pkt->conn, sizeof(buf), buf);
-		ptl_log("%s:  data_seq = %u\n", buf, pkt->hdr.data_seq);
+		ptl_log("%s:  data_seq = %u\n", buf,
+			HDR_SEQ(pkt->hdr.data_seq, pkt->hdr.data_seq_hi));
 	}
 
 	iface->ctx->opts.transport->dump(iface->pktif);
@@ -1458,7 +3180,7 @@ int bximsg_pollfd(struct bximsg_iface *iface, struct pollfd *pfds)
 	int events = 0;
 
 	/* produce packets to send */
-	bximsg_send(iface);
+	bximsg_send_sched(iface);
 
 	/* if there are packets to send, check if we can send */
 	if (iface->pkt_qhead != NULL && iface->pkt_qhead->send_pending_memcpy == 0)
@@ -54,8 +54,6 @@
 #define VAL_ATOMIC_ADD(x, val) __atomic_fetch_add(&x, val, __ATOMIC_RELAXED)
 #define VAL_ATOMIC_SUB(x, val) __atomic_fetch_sub(&x, val, __ATOMIC_RELAXED)
 
-#define BXIMSG_VC_COUNT 4
-
 struct swptl_sodata;
 
 struct bximsg_ctx {
@@ -80,7 +78,7 @@ struct bximsg_ops {
 	 *	ctx:	ctx pointer passed to bximsg_enqueue()
 	 *
 	 *	hdr:	pointer to location when the routine must write
-	 *		the message header. Its size is swptl_hdr.
+	 *		the message header. Its size is ctx->hdrsize.
 	 *
 	 * The routine must set ctx->data and ctx->start to
 	 * the first chuck of the message payload. It must return 1
@@ -128,10 +126,10 @@ struct bximsg_ops {
 	 *
 	 *	arg:	pointer passed to bximsg_init()
 	 *
-	 *	hdr:	location of the header, of size of struct
-	 *		swptl_hdr
+	 *	hdr:	location of the header, at most avail bytes,
+	 *		ctx->hdrsize must be set to its size
 	 *
-	 *	avail:	packet size (used for debug only)
+	 *	avail:	packet size
 	 *
 	 *	nid:	sender nid
 	 *
@@ -217,39 +215,87 @@ struct bximsg_ops {
 #define BXIMSG_RTX_MAX_RETRIES_NB 15
 #define BXIMSG_GET_BUF_ERROR_NB 16
 #define BXIMSG_IN_PKT_DUPLICATES 17
-#define BXIMSG_MAX_STATS 18 /* Should be the last one */
+#define BXIMSG_OUT_RELIABLE_PKT_NB 18
+#define BXIMSG_OUT_GATHER_PKT_NB 19
+#define BXIMSG_IN_PLACED_PKT_NB 20
+#define BXIMSG_IN_OOO_PKT_NB 21
+#define BXIMSG_RTX_SACKED_NB 22
+#define BXIMSG_RTT_SMOOTHED 23
+#define BXIMSG_RTO 24
+#define BXIMSG_CWND 25
+#define BXIMSG_IN_BUSY_NB 26
+#define BXIMSG_RTX_FAST_NB 27
+#define BXIMSG_ACK_TIMO_NB 28
+#define BXIMSG_OUT_AGGR_MSG_NB 29
+#define BXIMSG_IN_AGGR_MSG_NB 30
+#define BXIMSG_MAX_STATS 31 /* Should be the last one */
+
+struct bximsg_ooo;
+struct bximsg_run;
 
+/*
+ * Connection to a peer. The fields used to process each packet come
+ * first, the ones used only to create, free or dump the connection
+ * come last, and the stats are allocated separately, only if they are
+ * enabled.
+ */
 struct bximsg_conn {
-	struct bximsg_conn *hnext; /* next on hash list */
-
 	struct bximsg_conn *qnext; /* next on send queue */
 	struct bximsg_conn **qprev; /* previous on send queue */
 
-	struct swptl_sodata *send_qhead, **send_qtail; /* send queue */
+	struct swptl_sodata *send_qhead, **send_qtail; /* messages not started yet */
+
+	/*
+	 * Messages being sent, oldest first, each on its own lane, and
+	 * the one whose turn it is, see bximsg_send_next()
+	 */
+	struct swptl_sodata *sending;
+	unsigned int send_lanes;
+	struct swptl_sodata *send_cur;
+	int send_burst, send_started;
+
+	struct swptl_sodata *recv_ctx[BXIMSG_LANE_MAX]; /* messages being received */
 
-	struct swptl_sodata *recv_ctx; /* receive context */
+	/* messages of a packed packet not started yet, and retry timeout */
+	struct bximsg_ooo *recv_aggr;
+	struct timo aggr_timo;
 
 	struct bximsg_iface *iface; /* owner */
 
 	int onqueue;
 
-	/* seq. num of next message queued */
-	uint16_t msg_seq;
+	/* bytes the connection may still send in its turn, see bximsg_send() */
+	int deficit;
+
+	/* seq. num. following the packets of all queued messages */
+	uint32_t msg_seq;
 
 	/* seq. num. of next packet that will be sent */
-	uint16_t send_seq;
+	uint32_t send_seq;
 
 	/* seq. num. of first unacked packed we sent */
-	uint16_t send_ack;
+	uint32_t send_ack;
 
 	/* seq. num. of next packet we'll receive */
-	uint16_t recv_seq;
+	uint32_t recv_seq;
 
 	/* seq. num. of next un-acked packet */
-	uint16_t recv_ack;
+	uint32_t recv_ack;
+
+	/* delayed ack timeout, ack must not be delayed anymore */
+	struct timo ack_timo;
+	int ack_now;
+
+	/* packets received ahead of recv_seq, indexed by seq. num. */
+	struct bximsg_ooo *ooo[BXIMSG_SACK_MAX];
+	int ooo_count;
+
+	/* packets after sack_seq the peer reported as received */
+	uint32_t sack_seq;
+	uint8_t sack;
 
-	/* packet retransmit buffers */
-	struct swptl_sodata *ret_qhead, **ret_qtail;
+	/* packets to retransmit, in seq. num. order */
+	struct bximsg_run *ret_qhead, *ret_qtail;
 
 	/* retransmit timeout */
 	struct timo ret_timo;
@@ -257,11 +303,37 @@ struct bximsg_conn {
 	/* num. transmit retries */
 	unsigned long retries;
 
-	/* stats */
-	unsigned long stats[BXIMSG_MAX_STATS];
+	/* smoothed round-trip time, its variance and retransmit timeout */
+	unsigned int srtt, rttvar, rto;
+
+	/* if rtt_timing, packet rtt_seq was sent at rtt_start */
+	int rtt_timing;
+	uint32_t rtt_seq;
+	unsigned long long rtt_start;
+
+	/* congestion window, slow start threshold, in packets */
+	unsigned int cwnd, ssthresh;
+
+	/* packets acked since the window last grew */
+	unsigned int cwnd_acked;
+
+	/* set if the window prevented us from sending */
+	int cwnd_limited;
+
+	/* acks reporting a gap at send_ack */
+	int dupacks;
+
+	/* if recovering, packets before recover_seq were fast retransmitted */
+	int recovering;
+	uint32_t recover_seq;
+
+	/* we're out of receive resources, the peer is */
+	int busy, peer_busy;
 
 	/* read-only data */
 	int nid, pid, rank; /* peer id */
+	int ospid; /* peer OS pid vouched by the kernel, 0 if unknown */
+	int rdv_nak; /* peer can't access our memory, don't use rendezvous */
 
 	/* virtual circuit number */
 	int vc;
@@ -269,6 +341,30 @@ struct bximsg_conn {
 	/* in seq number synchronization handshake */
 	int synchronizing;
 	int peer_synchronizing;
+
+	/* idle for a while, packets are sent one at a time with the RESUME flag */
+	int resuming;
+
+	/* the peer sends and accepts 32-bit seq. numbers */
+	int seq32;
+
+	/*
+	 * the peer sets BXIMSG_HDR_FLAG_V2, so it handles lanes, packed
+	 * packets, and packed upper layer headers
+	 */
+	int v2;
+
+	/* upper layer contexts and packet buffers using the connection */
+	int refs, npkts;
+
+	/* time of the last packet sent or received */
+	unsigned long long last_active;
+
+	/* interface list, most recently active first, or free list */
+	struct bximsg_conn *next, *prev;
+
+	/* stats, a shared scratch array if disabled */
+	unsigned long *stats;
 };
 
 #ifdef DEBUG
@@ -324,6 +420,14 @@ int bximsg_progress(struct bximsg_iface *);
  */
 struct bximsg_conn *bximsg_getconn(struct bximsg_iface *, int, int, int);
 
+/*
+ * Tell that a context of the upper layer keeps a pointer to the given
+ * connection, or that it doesn't anymore. Idle connections are freed
+ * only if no context refers to them.
+ */
+void bximsg_conn_ref(struct bximsg_conn *conn);
+void bximsg_conn_unref(struct bximsg_conn *conn);
+
 /*
  * Enqueue a new message to send.
  *
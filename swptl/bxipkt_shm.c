@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bxipkt_shm.h"
+#include "utils.h"
+#include "ptl_log.h"
+
+#ifdef DEBUG
+/*
+ * log to stderr, with the give debug level
+ */
+#define LOGN(n, ...)                                                                               \
+	do {                                                                                       \
+		if (bxipkt_debug >= (n))                                                           \
+			ptl_log(__VA_ARGS__);                                                      \
+	} while (0)
+
+#define LOG(...) LOGN(1, __VA_ARGS__)
+#else
+#define LOGN(n, ...)                                                                               \
+	do {                                                                                       \
+	} while (0)
+#define LOG(...)                                                                                   \
+	do {                                                                                       \
+	} while (0)
+#endif
+
+/* Changed whenever the segment layout changes, as the size of the packet header */
+#define BXIPKT_SHM_MAGIC ((uint32_t)0x82D6A1A1)
+
+/*
+ * Number of rings of a segment, i.e. max number of processes of the
+ * node sending to us through shared memory; the others use the
+ * network.
+ */
+#define BXIPKT_SHM_RINGS 32
+
+/* Approximate size of a ring, and bounds of its number of slots */
+#define BXIPKT_SHM_RING_SIZE (1024 * 1024)
+#define BXIPKT_SHM_SLOTS_MIN 8
+#define BXIPKT_SHM_SLOTS_MAX 256
+
+/* Delay before trying again to open the segment of a peer, in ns */
+#define BXIPKT_SHM_RETRY_DELAY 100000000ULL
+
+#define BXIPKT_SHM_CACHELINE 64
+
+/*
+ * Segment header, followed by the ring headers, then by the slots of
+ * all rings
+ */
+struct bxipkt_shm_seg {
+	uint32_t magic;
+	uint32_t nrings;
+	uint32_t nslots;
+	uint32_t slot_size;
+	int32_t ospid; /* process the segment belongs to */
+	uint32_t ready; /* cleared when the process stops receiving */
+	uint32_t waiting; /* set while the process sleeps in poll() */
+} __attribute__((aligned(BXIPKT_SHM_CACHELINE)));
+
+/*
+ * Sender and receiver positions are in separate cache lines, they are
+ * free running counters
+ */
+struct bxipkt_shm_ring {
+	int32_t owner; /* sender process, 0 if the ring is free */
+	uint32_t tail; /* written by the sender */
+	uint32_t head __attribute__((aligned(BXIPKT_SHM_CACHELINE))); /* written by the receiver */
+} __attribute__((aligned(BXIPKT_SHM_CACHELINE)));
+
+struct bxipkt_shm_slot {
+	uint32_t size;
+	int32_t pid; /* portals pid of the sender */
+	struct bximsg_hdr hdr;
+	unsigned char data[];
+};
+
+/*
+ * A mapped segment, either ours or the one of a peer
+ */
+struct bxipkt_shm_map {
+	struct bxipkt_shm_seg *seg;
+	size_t len;
+	struct bxipkt_shm_ring *rings;
+	unsigned char *slots;
+	uint32_t nslots;
+	size_t slot_size;
+};
+
+struct bxipkt_shm_peer {
+	struct bxipkt_shm_map map;
+	struct bxipkt_shm_ring *ring; /* ring we've claimed, NULL if none */
+	unsigned char *slots; /* slots of our ring */
+	uint32_t tail; /* our copy of ring->tail */
+	uint32_t head; /* last known ring->head */
+	int unreachable; /* don't try anymore, use the network */
+	unsigned long long retry; /* date of the next attempt to open the segment */
+};
+
+struct bxipkt_shm {
+	uint32_t addr;
+	int pid;
+	size_t mtu;
+	char name[NAME_MAX];
+	struct bxipkt_shm_map map;
+	struct bxipkt_shm_peer *peers[PTL_PID_MAX + 1];
+
+	unsigned long ipkts;
+	unsigned long opkts;
+	unsigned long full;
+	unsigned long wakeups;
+	unsigned long fallbacks;
+};
+
+static unsigned long long bxipkt_shm_gettime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bxipkt_shm_mkname(char *name, uint32_t addr, int pid)
+{
+	snprintf(name, NAME_MAX, "/bxipkt-%08x-%d", addr, pid);
+}
+
+static size_t bxipkt_shm_slot_size(size_t mtu)
+{
+	return align_to(sizeof(struct bxipkt_shm_slot) + mtu, BXIPKT_SHM_CACHELINE);
+}
+
+static size_t bxipkt_shm_seg_size(uint32_t nrings, uint32_t nslots, size_t slot_size)
+{
+	return sizeof(struct bxipkt_shm_seg) + nrings * sizeof(struct bxipkt_shm_ring) +
+	       (size_t)nrings * nslots * slot_size;
+}
+
+/*
+ * Set the pointers of a segment mapped at the given address, the
+ * geometry must have been checked
+ */
+static void bxipkt_shm_map_set(struct bxipkt_shm_map *map, void *addr, size_t len)
+{
+	map->seg = addr;
+	map->len = len;
+	map->rings = (struct bxipkt_shm_ring *)(map->seg + 1);
+	map->slots = (unsigned char *)(map->rings + map->seg->nrings);
+	map->nslots = map->seg->nslots;
+	map->slot_size = map->seg->slot_size;
+}
+
+static struct bxipkt_shm_slot *bxipkt_shm_slot(struct bxipkt_shm_map *map, unsigned char *slots,
+					       uint32_t pos)
+{
+	return (struct bxipkt_shm_slot *)(slots + (pos & (map->nslots - 1)) * map->slot_size);
+}
+
+struct bxipkt_shm *bxipkt_shm_create(uint32_t addr, int pid, size_t mtu)
+{
+	struct bxipkt_shm *shm;
+	struct bxipkt_shm_seg *seg;
+	uint32_t nslots;
+	size_t slot_size, len;
+	void *p;
+	int fd;
+
+	shm = calloc(1, sizeof(struct bxipkt_shm));
+	if (shm == NULL) {
+		LOGN(0, "malloc(%s): %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	shm->addr = addr;
+	shm->pid = pid;
+	shm->mtu = mtu;
+
+	slot_size = bxipkt_shm_slot_size(mtu);
+	for (nslots = BXIPKT_SHM_SLOTS_MIN;
+	     nslots < BXIPKT_SHM_SLOTS_MAX && 2 * nslots * slot_size <= BXIPKT_SHM_RING_SIZE;
+	     nslots *= 2)
+		;
+	len = bxipkt_shm_seg_size(BXIPKT_SHM_RINGS, nslots, slot_size);
+
+	/*
+	 * We own the socket of this pid, so a segment with the same name
+	 * can only be a leftover of a process that didn't exit cleanly
+	 */
+	bxipkt_shm_mkname(shm->name, addr, pid);
+	shm_unlink(shm->name);
+
+	fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		LOGN(1, "%s: %s: shm_open: %s\n", __func__, shm->name, strerror(errno));
+		free(shm);
+		return NULL;
+	}
+
+	/* pages are only allocated when the rings are used */
+	if (ftruncate(fd, len) < 0) {
+		LOGN(1, "%s: %s: ftruncate: %s\n", __func__, shm->name, strerror(errno));
+		close(fd);
+		shm_unlink(shm->name);
+		free(shm);
+		return NULL;
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		LOGN(1, "%s: %s: mmap: %s\n", __func__, shm->name, strerror(errno));
+		shm_unlink(shm->name);
+		free(shm);
+		return NULL;
+	}
+
+	seg = p;
+	seg->magic = BXIPKT_SHM_MAGIC;
+	seg->nrings = BXIPKT_SHM_RINGS;
+	seg->nslots = nslots;
+	seg->slot_size = slot_size;
+	seg->ospid = getpid();
+	seg->waiting = 0;
+	bxipkt_shm_map_set(&shm->map, p, len);
+
+	/* let senders in */
+	__atomic_store_n(&seg->ready, 1, __ATOMIC_RELEASE);
+
+	LOGN(2, "%s: %s: %u rings of %u slots of %zu bytes\n", __func__, shm->name,
+	     BXIPKT_SHM_RINGS, nslots, slot_size);
+
+	return shm;
+}
+
+/*
+ * Release the ring we've claimed in the segment of a peer and unmap it
+ */
+static void bxipkt_shm_peer_close(struct bxipkt_shm_peer *peer)
+{
+	if (peer->ring != NULL) {
+		__atomic_store_n(&peer->ring->owner, 0, __ATOMIC_RELEASE);
+		peer->ring = NULL;
+	}
+	if (peer->map.seg != NULL) {
+		munmap(peer->map.seg, peer->map.len);
+		peer->map.seg = NULL;
+	}
+}
+
+/*
+ * Stop using shared memory with the given peer, because it's gone or
+ * it has restarted, and let the network path resynchronize with it.
+ */
+static void bxipkt_shm_peer_fail(struct bxipkt_shm *shm, struct bxipkt_shm_peer *peer, int pid)
+{
+	LOGN(1, "%s: pid %d: segment gone, using the network\n", __func__, pid);
+	bxipkt_shm_peer_close(peer);
+	peer->unreachable = 1;
+	shm->fallbacks++;
+}
+
+/*
+ * Claim a ring in the segment of the peer: either a free one or one
+ * of a process that doesn't exist anymore.
+ */
+static int bxipkt_shm_peer_claim(struct bxipkt_shm_peer *peer)
+{
+	struct bxipkt_shm_ring *ring;
+	int32_t owner, self = getpid();
+	int i;
+
+	for (i = 0; i < peer->map.seg->nrings; i++) {
+		ring = &peer->map.rings[i];
+		owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE);
+		if (owner != 0 && (owner == self || kill(owner, 0) == 0 || errno != ESRCH))
+			continue;
+		if (!__atomic_compare_exchange_n(&ring->owner, &owner, self, 0, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			continue;
+
+		/* continue after the packets possibly left by the previous owner */
+		peer->ring = ring;
+		peer->slots = peer->map.slots + (size_t)i * peer->map.nslots * peer->map.slot_size;
+		peer->tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		peer->head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Map the segment of the given peer and claim a ring in it. Return 0
+ * if it's not available (yet)
+ */
+static int bxipkt_shm_peer_open(struct bxipkt_shm *shm, struct bxipkt_shm_peer *peer, int pid)
+{
+	struct bxipkt_shm_seg *seg;
+	char name[NAME_MAX];
+	struct stat st;
+	void *p;
+	int fd;
+
+	bxipkt_shm_mkname(name, shm->addr, pid);
+
+	fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		LOGN(3, "%s: %s: shm_open: %s\n", __func__, name, strerror(errno));
+		return 0;
+	}
+
+	/* the segment may still be being created */
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct bxipkt_shm_seg)) {
+		close(fd);
+		return 0;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		LOGN(1, "%s: %s: mmap: %s\n", __func__, name, strerror(errno));
+		return 0;
+	}
+
+	/* the segment may be a leftover of a process that didn't exit cleanly */
+	seg = p;
+	if (!__atomic_load_n(&seg->ready, __ATOMIC_ACQUIRE) ||
+	    (kill(seg->ospid, 0) < 0 && errno == ESRCH)) {
+		munmap(p, st.st_size);
+		return 0;
+	}
+
+	if (seg->magic != BXIPKT_SHM_MAGIC || seg->nrings == 0 || seg->nslots == 0 ||
+	    (seg->nslots & (seg->nslots - 1)) != 0 ||
+	    seg->slot_size < bxipkt_shm_slot_size(shm->mtu) ||
+	    bxipkt_shm_seg_size(seg->nrings, seg->nslots, seg->slot_size) > st.st_size) {
+		LOGN(1, "%s: %s: incompatible segment\n", __func__, name);
+		munmap(p, st.st_size);
+		peer->unreachable = 1;
+		return 0;
+	}
+
+	bxipkt_shm_map_set(&peer->map, p, st.st_size);
+
+	if (!bxipkt_shm_peer_claim(peer)) {
+		LOGN(1, "%s: %s: no free ring\n", __func__, name);
+		bxipkt_shm_peer_close(peer);
+		return 0;
+	}
+
+	LOGN(2, "%s: %s: using ring %ld\n", __func__, name, peer->ring - peer->map.rings);
+	return 1;
+}
+
+static struct bxipkt_shm_peer *bxipkt_shm_getpeer(struct bxipkt_shm *shm, int pid)
+{
+	struct bxipkt_shm_peer *peer;
+	unsigned long long now;
+
+	peer = shm->peers[pid];
+	if (peer == NULL) {
+		peer = calloc(1, sizeof(struct bxipkt_shm_peer));
+		if (peer == NULL)
+			return NULL;
+		shm->peers[pid] = peer;
+	}
+
+	if (peer->ring != NULL)
+		return peer;
+
+	if (peer->unreachable)
+		return NULL;
+
+	now = bxipkt_shm_gettime();
+	if (now < peer->retry)
+		return NULL;
+
+	if (!bxipkt_shm_peer_open(shm, peer, pid)) {
+		peer->retry = now + BXIPKT_SHM_RETRY_DELAY;
+		return NULL;
+	}
+
+	return peer;
+}
+
+int bxipkt_shm_send(struct bxipkt_shm *shm, int pid, struct bximsg_hdr *hdr,
+		    const struct iovec *iov, int iovcnt, int *wakeup)
+{
+	struct bxipkt_shm_peer *peer;
+	struct bxipkt_shm_slot *slot;
+	struct bxipkt_shm_seg *seg;
+	size_t size;
+	int i;
+
+	size = 0;
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	if (pid < 0 || pid > PTL_PID_MAX || size > shm->mtu)
+		return -1;
+
+	peer = bxipkt_shm_getpeer(shm, pid);
+	if (peer == NULL)
+		return -1;
+
+	seg = peer->map.seg;
+	if (!__atomic_load_n(&seg->ready, __ATOMIC_ACQUIRE)) {
+		bxipkt_shm_peer_fail(shm, peer, pid);
+		return -1;
+	}
+
+	if (peer->tail - peer->head == peer->map.nslots) {
+		peer->head = __atomic_load_n(&peer->ring->head, __ATOMIC_ACQUIRE);
+		if (peer->tail - peer->head == peer->map.nslots) {
+			/* a process that died doesn't clear the ready flag */
+			if (kill(seg->ospid, 0) < 0 && errno == ESRCH) {
+				bxipkt_shm_peer_fail(shm, peer, pid);
+				return -1;
+			}
+			shm->full++;
+			return 0;
+		}
+	}
+
+	slot = bxipkt_shm_slot(&peer->map, peer->slots, peer->tail);
+	slot->size = size;
+	slot->pid = shm->pid;
+	slot->hdr = *hdr;
+	size = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(slot->data + size, iov[i].iov_base, iov[i].iov_len);
+		size += iov[i].iov_len;
+	}
+
+	peer->tail++;
+	__atomic_store_n(&peer->ring->tail, peer->tail, __ATOMIC_RELEASE);
+
+	/*
+	 * Pairs with bxipkt_shm_arm(): either the receiver sees the new
+	 * tail, or we see it's going to sleep.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	*wakeup = __atomic_load_n(&seg->waiting, __ATOMIC_RELAXED);
+	if (*wakeup)
+		shm->wakeups++;
+
+	shm->opkts++;
+	return 1;
+}
+
+int bxipkt_shm_arm(struct bxipkt_shm *shm)
+{
+	struct bxipkt_shm_ring *ring;
+	int i;
+
+	__atomic_store_n(&shm->map.seg->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < shm->map.seg->nrings; i++) {
+		ring = &shm->map.rings[i];
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+			return 1;
+	}
+
+	return 0;
+}
+
+int bxipkt_shm_progress(struct bxipkt_shm *shm,
+			int (*input)(void *arg, void *data, size_t size, struct bximsg_hdr *hdr,
+				     int pid),
+			void *arg)
+{
+	struct bxipkt_shm_map *map = &shm->map;
+	struct bxipkt_shm_ring *ring;
+	struct bxipkt_shm_slot *slot;
+	unsigned char *slots;
+	uint32_t head, tail;
+	int i, count = 0;
+
+	__atomic_store_n(&map->seg->waiting, 0, __ATOMIC_RELAXED);
+
+	for (i = 0; i < map->seg->nrings; i++) {
+		ring = &map->rings[i];
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			continue;
+
+		/* don't process more than a ring worth, for fairness */
+		if (tail - head > map->nslots)
+			tail = head + map->nslots;
+
+		slots = map->slots + (size_t)i * map->nslots * map->slot_size;
+		while (head != tail) {
+			slot = bxipkt_shm_slot(map, slots, head);
+			if (slot->size > shm->mtu || slot->pid < 0 || slot->pid > PTL_PID_MAX) {
+				LOGN(0, "%s: ring %d: bad packet, dropped\n", __func__, i);
+			} else if (!input(arg, slot->data, slot->size, &slot->hdr, slot->pid)) {
+				break;
+			}
+			head++;
+			count++;
+		}
+
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+
+	shm->ipkts += count;
+	return count;
+}
+
+void bxipkt_shm_dump(struct bxipkt_shm *shm)
+{
+	ptl_log("shm: ipkts = %lu, opkts = %lu, ring full = %lu, wakeups = %lu, fallbacks = %lu\n",
+		shm->ipkts, shm->opkts, shm->full, shm->wakeups, shm->fallbacks);
+}
+
+void bxipkt_shm_destroy(struct bxipkt_shm *shm)
+{
+	int i;
+
+	for (i = 0; i <= PTL_PID_MAX; i++) {
+		if (shm->peers[i] == NULL)
+			continue;
+		bxipkt_shm_peer_close(shm->peers[i]);
+		free(shm->peers[i]);
+	}
+
+	/* senders still mapping the segment will fall back to the network */
+	__atomic_store_n(&shm->map.seg->ready, 0, __ATOMIC_RELEASE);
+	munmap(shm->map.seg, shm->map.len);
+	shm_unlink(shm->name);
+	free(shm);
+}
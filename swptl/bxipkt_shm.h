@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#ifndef BXIPKT_SHM_H
+#define BXIPKT_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "bxipkt.h"
+
+/*
+ * Shared memory channel between processes of the same node. Each
+ * process creates a segment with a set of single-producer,
+ * single-consumer rings, every sender claims one ring of the segment
+ * of each peer it sends to. Packets are copied in the ring slots and
+ * are never lost, so they are delivered in order.
+ */
+struct bxipkt_shm;
+
+/*
+ * Create the receive segment of the process with the given address
+ * and portals pid, able to hold packets of mtu bytes of payload
+ */
+struct bxipkt_shm *bxipkt_shm_create(uint32_t addr, int pid, size_t mtu);
+
+void bxipkt_shm_destroy(struct bxipkt_shm *shm);
+
+/*
+ * Copy a packet, gathered from the given segments, in the ring of
+ * the given peer. Return 1 on success
+ * (and set *wakeup if the peer is sleeping and must be notified), 0
+ * if the ring is full and -1 if the peer can't be reached through
+ * shared memory, in which case another path must be used.
+ */
+int bxipkt_shm_send(struct bxipkt_shm *shm, int pid, struct bximsg_hdr *hdr,
+		    const struct iovec *iov, int iovcnt, int *wakeup);
+
+/*
+ * Tell senders we're about to sleep, return 1 if there are packets
+ * to process, in which case we must not sleep.
+ */
+int bxipkt_shm_arm(struct bxipkt_shm *shm);
+
+/*
+ * Invoke the input call-back for each received packet. If it returns
+ * 0, the packet is kept in the ring and delivered again later.
+ */
+int bxipkt_shm_progress(struct bxipkt_shm *shm,
+			int (*input)(void *arg, void *data, size_t size, struct bximsg_hdr *hdr,
+				     int pid),
+			void *arg);
+
+void bxipkt_shm_dump(struct bxipkt_shm *shm);
+
+#endif
@@ -17,8 +17,12 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +33,8 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <assert.h>
@@ -37,8 +43,12 @@
 #include <net/ethernet.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
 
 #include "bxipkt.h"
+#include "bxipkt_udp.h"
+#include "bxipkt_shm.h"
 #include "utils.h"
 #include "ptl_log.h"
 
@@ -49,15 +59,67 @@
  */
 #define IP_MAX_HDR_SIZE (sizeof(struct iphdr) + MAX_IPOPTLEN)
 
-#define BXIPKT_UDP_PORT_MIN 8000
+/* Default and maximum number of datagrams received per recvmmsg() call */
+#define BXIPKT_UDP_RX_BATCH 32
+#define BXIPKT_UDP_RX_BATCH_MAX 1024
+
+/* Maximum number of datagrams sent per sendmmsg() call */
+#define BXIPKT_UDP_TX_BATCH 64
+
+/* Maximum number of segments of a payload received at its final location */
+#define BXIPKT_UDP_RX_IOV_MAX 16
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/*
+ * Default min. size of datagrams sent with MSG_ZEROCOPY: below it,
+ * pinning the pages and reading the completion costs more than the copy
+ */
+#define BXIPKT_UDP_ZEROCOPY 0x4000
+
+/*
+ * The kernel attaches the pages of a zero-copy datagram to a single
+ * buffer, with at most MAX_SKB_FRAGS (17 by default) of them. Pages are
+ * counted with the smallest page size, to stay on the safe side.
+ */
+#define BXIPKT_UDP_ZC_FRAGS_MAX 17
+#define BXIPKT_UDP_ZC_PAGE_SIZE 4096
 
-#define BXIPKT_MAGIC_NUMBER ((uint32_t)0x82D6A19F)
+/* Max. time in ms to wait for the zero-copy completions when closing */
+#define BXIPKT_UDP_ZC_DRAIN_MS 1000
 
-/* A + 4 is added to align header address on 8 bytes.
- * The BXIPKT_MAGIC_NUMBER length is 4 and the struct bximsg_hdr is 8.
- * It is used in the header buffer which is allocated to send/receive messages
+/*
+ * Limits of a single GSO super-packet: the kernel refuses more than 64
+ * segments (UDP_MAX_SEGMENTS on older kernels) and the whole payload
+ * must fit in a single UDP datagram. The receive buffer of a GRO
+ * super-packet is sized accordingly.
  */
-#define BXIPKT_UDP_HDR_SIZE (sizeof(BXIPKT_MAGIC_NUMBER) + sizeof(struct bximsg_hdr) + 4)
+#define BXIPKT_UDP_GSO_SEGS_MAX 64
+#define BXIPKT_UDP_GSO_SIZE_MAX (0xffff - sizeof(struct iphdr) - sizeof(struct udphdr))
+#define BXIPKT_UDP_GRO_BUFSIZE 0x10000
 
 #ifdef DEBUG
 /*
@@ -81,46 +143,19 @@
 
 #include "ptl_getenv.h"
 
-struct bxipkt_buflist {
-	struct bxipkt_buf *freelist, *pool_data;
-	size_t size;
-	unsigned int count;
-};
-
-struct bxipkt_iface {
-	void *arg;
-	void (*input)(void *arg, enum swptl_transport_status status, void *data, size_t size,
-		      struct bximsg_hdr *hdr, int nid, int pid, int uid);
-	void (*output)(void *arg, struct bxipkt_buf *pkt);
-	void (*sent_pkt)(struct bxipkt_buf *pkt);
-	unsigned long ipkts;
-	unsigned long opkts;
-	unsigned long apkts;
-	unsigned long iipkts;
-	unsigned long iopkts;
-	struct bxipkt_buflist tx_buflist;
-
-	unsigned char *rx_buf;
-	size_t rx_bufsize;
-
-	uint32_t net_addr;
-	uint32_t net_mask;
-	int nid;
-
-	struct bxipkt_ctx *ctx;
-
-	/*
-	 * The portals pid is based on the port of the socket and follow
-	 * this rule: <socket port> = <portals pid> + 1024
-	 */
-	int pid;
-	int sockfd;
-};
-
-struct bxipkt_udp_ctx {
-	int mtu;
-	uint32_t net;
-};
+void bxipkt_udp_options_set_default(struct bxipkt_udp_options *opts)
+{
+	bxipkt_options_set_default(&opts->global);
+	opts->default_mtu = false;
+	opts->ip = NULL;
+	opts->rx_batch = BXIPKT_UDP_RX_BATCH;
+	opts->gso = false;
+	opts->shm = true;
+	opts->zerocopy = BXIPKT_UDP_ZEROCOPY;
+	opts->rx_shards = 1;
+	opts->drop = 0;
+	opts->reorder = 0;
+}
 
 /* Library initialization. */
 int bxipktudp_libinit(struct bxipkt_options *o, struct bxipkt_ctx *ctx)
@@ -141,6 +176,29 @@ int bxipktudp_libinit(struct bxipkt_options *o, struct bxipkt_ctx *ctx)
 	if (opts->default_mtu)
 		udp_ctx->mtu = ETHERMTU;
 
+	udp_ctx->rx_batch = opts->rx_batch;
+	if (udp_ctx->rx_batch == 0)
+		udp_ctx->rx_batch = 1;
+	else if (udp_ctx->rx_batch > BXIPKT_UDP_RX_BATCH_MAX)
+		udp_ctx->rx_batch = BXIPKT_UDP_RX_BATCH_MAX;
+
+	udp_ctx->gso = opts->gso;
+	udp_ctx->shm = opts->shm;
+	udp_ctx->zerocopy = opts->zerocopy;
+
+	udp_ctx->rx_shards = opts->rx_shards;
+	if (udp_ctx->rx_shards == 0)
+		udp_ctx->rx_shards = 1;
+	else if (udp_ctx->rx_shards > BXIPKT_UDP_SHARDS_MAX)
+		udp_ctx->rx_shards = BXIPKT_UDP_SHARDS_MAX;
+
+	udp_ctx->drop = opts->drop;
+	udp_ctx->reorder = opts->reorder;
+	if (udp_ctx->drop + udp_ctx->reorder > 1000) {
+		LOGN(0, "%s: drop + reorder can't exceed 1000\n", __func__);
+		ret = PTL_FAIL;
+	}
+
 	if (inet_aton(opts->ip, &addr) != 0) {
 		udp_ctx->net = ntohl(addr.s_addr);
 	} else {
@@ -239,7 +297,18 @@ int bxipktudp_netconfig(struct bxipkt_iface *iface)
 
 	iface->tx_buflist.size = mtu - max_hdr_size;
 
+	if (iface->tx_gso) {
+		/*
+		 * Segments are received back to back in a single buffer,
+		 * keep them 8-byte aligned like separate buffers
+		 */
+		iface->tx_buflist.size &= ~(size_t)7;
+		iface->gso_size = BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size;
+	}
+
 	iface->rx_bufsize = BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size;
+	if (iface->rx_gro)
+		iface->rx_bufsize = BXIPKT_UDP_GRO_BUFSIZE;
 
 	LOGN(2, "%s: using %s: nid=%u, tx size=%lu, rx size=%lu, net addr=0x%x, net mask=0x%x\n",
 	     __func__, tmp->ifa_name, iface->nid, iface->tx_buflist.size, iface->rx_bufsize,
@@ -252,7 +321,7 @@ int bxipktudp_netconfig(struct bxipkt_iface *iface)
 
 int bxipktudp_createsocket(struct bxipkt_iface *iface, int port, char *err_msg)
 {
-	int sock;
+	int sock, on = 1;
 	struct sockaddr_in server_address;
 
 	memset(&server_address, 0, sizeof(server_address));
@@ -268,6 +337,13 @@ int bxipktudp_createsocket(struct bxipkt_iface *iface, int port, char *err_msg)
 
 	dump_sockaddr_in(__func__, &server_address);
 
+	if (iface->rx_nfds > 1 &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		snprintf(err_msg, PTL_LOG_BUF_SIZE, "SO_REUSEPORT error: %s", strerror(errno));
+		close(sock);
+		return -1;
+	}
+
 	if ((bind(sock, (struct sockaddr *)&server_address, sizeof(server_address))) < 0) {
 		snprintf(err_msg, PTL_LOG_BUF_SIZE, "bind call error: %s", strerror(errno));
 		close(sock);
@@ -279,6 +355,109 @@ int bxipktudp_createsocket(struct bxipkt_iface *iface, int port, char *err_msg)
 	return sock;
 }
 
+/*
+ * Reserve the given port of the interface address among the processes
+ * of the node, by binding an abstract unix socket named after it. It's
+ * released when the process exits.
+ */
+static int bxipktudp_claim(struct bxipkt_iface *iface, int port, char *err_msg)
+{
+	struct sockaddr_un addr;
+	int fd, len;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		snprintf(err_msg, PTL_LOG_BUF_SIZE, "socket call error: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "bxipkt-%08x-%d",
+		       iface->net_addr, port);
+	if (bind(fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) <
+	    0) {
+		snprintf(err_msg, PTL_LOG_BUF_SIZE, "port claim error: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Create the socket of the interface bound to the given port, claimed
+ * first if it's shared with other receive shards
+ */
+static int bxipktudp_openport(struct bxipkt_iface *iface, int port, char *err_msg)
+{
+	if (iface->rx_nfds > 1) {
+		iface->claimfd = bxipktudp_claim(iface, port, err_msg);
+		if (iface->claimfd < 0)
+			return -1;
+	}
+
+	iface->sockfd = bxipktudp_createsocket(iface, port, err_msg);
+	if (iface->sockfd < 0 && iface->claimfd >= 0) {
+		close(iface->claimfd);
+		iface->claimfd = -1;
+	}
+
+	iface->rx_fds[0] = iface->sockfd;
+	return iface->sockfd;
+}
+
+/*
+ * Steer datagrams to the receive shards with a hash of their source
+ * address and port. If the program can't be attached, the kernel hashes
+ * the whole 4-tuple, which keeps datagrams of a given source on the
+ * same shard as well.
+ */
+static void bxipktudp_shards_steer(struct bxipkt_iface *iface)
+{
+	struct sock_filter code[] = {
+		/* A = source address ^ source port */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + (int)offsetof(struct iphdr, saddr) },
+		{ BPF_MISC | BPF_TAX, 0, 0, 0 },
+		{ BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_NET_OFF + (int)sizeof(struct iphdr) },
+		{ BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+		/* return A % shards */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, iface->rx_nfds },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	if (setsockopt(iface->sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+		       sizeof(prog)) < 0)
+		LOGN(1, "%s: can't attach steering program: %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Open the other receive shards of the interface. The steering program
+ * is built once we know how many of them could be opened, so that it
+ * never returns the index of a missing socket.
+ */
+static void bxipktudp_shards_init(struct bxipkt_iface *iface)
+{
+	char err_msg[PTL_LOG_BUF_SIZE];
+	int i, fd;
+
+	for (i = 1; i < iface->rx_nfds; i++) {
+		fd = bxipktudp_createsocket(iface, iface->pid + BXIPKT_UDP_PORT_MIN, err_msg);
+		if (fd < 0) {
+			LOGN(0, "%s: can't create receive shard: %s\n", __func__, err_msg);
+			break;
+		}
+		iface->rx_fds[i] = fd;
+	}
+	iface->rx_nfds = i;
+
+	if (iface->rx_nfds > 1)
+		bxipktudp_shards_steer(iface);
+
+	LOGN(2, "%s: receiving with %d sockets\n", __func__, iface->rx_nfds);
+}
+
 int bxipktudp_buflist_init(struct bxipkt_buflist *l)
 {
 	int i;
@@ -315,6 +494,84 @@ int bxipktudp_buflist_init(struct bxipkt_buflist *l)
 	return 1;
 }
 
+/*
+ * Enable segmentation offload on the socket, fall back to plain
+ * datagrams if the kernel doesn't support it.
+ */
+void bxipktudp_gso_init(struct bxipkt_iface *iface)
+{
+	int off = 0, on = 1;
+
+	if (setsockopt(iface->sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) < 0 ||
+	    setsockopt(iface->sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+		LOGN(1, "%s: segmentation offload not supported: %s\n", __func__,
+		     strerror(errno));
+		iface->tx_gso = 0;
+		iface->rx_gro = 0;
+		iface->rx_bufsize = BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size;
+		return;
+	}
+
+	LOGN(2, "%s: using segmentation offload, gso size = %zu\n", __func__, iface->gso_size);
+}
+
+/*
+ * Enable MSG_ZEROCOPY on the socket, or keep copying datagrams if the
+ * kernel doesn't support it.
+ */
+void bxipktudp_zc_init(struct bxipkt_iface *iface, size_t size)
+{
+	int on = 1;
+
+	if (setsockopt(iface->sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+		LOGN(1, "%s: zero-copy not supported: %s\n", __func__, strerror(errno));
+		return;
+	}
+
+	iface->zc_size = size;
+	LOGN(2, "%s: using zero-copy above %zu bytes\n", __func__, size);
+}
+
+/*
+ * Allocate the receive ring and the recvmmsg() vectors pointing to it
+ */
+int bxipktudp_rxring_init(struct bxipkt_iface *iface)
+{
+	struct msghdr *h;
+	int i;
+
+	iface->rx_slotsize = align_to(iface->rx_bufsize, 64);
+
+	iface->rx_buf = malloc(iface->rx_count * iface->rx_slotsize);
+	iface->rx_msgs = calloc(iface->rx_count, sizeof(struct mmsghdr));
+	iface->rx_iovs = calloc(iface->rx_count, sizeof(struct iovec));
+	iface->rx_addrs = calloc(iface->rx_count, sizeof(struct sockaddr_in));
+	iface->rx_cmsgs = calloc(iface->rx_count, CMSG_SPACE(sizeof(int)));
+	if (iface->rx_buf == NULL || iface->rx_msgs == NULL || iface->rx_iovs == NULL ||
+	    iface->rx_addrs == NULL || iface->rx_cmsgs == NULL) {
+		LOG("%s: malloc %s, %u buffers of size %zd\n", __func__, strerror(errno),
+		    iface->rx_count, iface->rx_bufsize);
+		return 0;
+	}
+
+	for (i = 0; i < iface->rx_count; i++) {
+		iface->rx_iovs[i].iov_base = iface->rx_buf + i * iface->rx_slotsize;
+		iface->rx_iovs[i].iov_len = iface->rx_bufsize;
+
+		h = &iface->rx_msgs[i].msg_hdr;
+		h->msg_name = &iface->rx_addrs[i];
+		h->msg_namelen = sizeof(struct sockaddr_in);
+		h->msg_iov = &iface->rx_iovs[i];
+		h->msg_iovlen = 1;
+		if (iface->rx_gro) {
+			h->msg_control = iface->rx_cmsgs + i * CMSG_SPACE(sizeof(int));
+			h->msg_controllen = CMSG_SPACE(sizeof(int));
+		}
+	}
+
+	return 1;
+}
+
 void bxipktudp_buflist_done(struct bxipkt_buflist *l)
 {
 	struct bxipkt_buf *b;
@@ -337,29 +594,85 @@ void bxipktudp_buflist_done(struct bxipkt_buflist *l)
 	l->pool_data = NULL;
 }
 
-int bxipktudp_common_send(struct bxipkt_iface *iface, char *buf, size_t buf_len,
-			  struct bximsg_hdr *hdr_data, int nid, int pid)
+void bxipktudp_mkaddr(struct bxipkt_iface *iface, struct sockaddr_in *sin, int nid, int pid)
 {
-	struct sockaddr_in si_other;
-	int len;
-	uint32_t remote_addr, tmp;
-	int log_level;
+	uint32_t remote_addr;
 
 	remote_addr = (iface->net_addr & iface->net_mask) | nid;
 
-	memset(&si_other, 0, sizeof(si_other));
-	si_other.sin_family = AF_INET;
-	si_other.sin_addr.s_addr = htonl(remote_addr);
-	si_other.sin_port = htons(pid + BXIPKT_UDP_PORT_MIN);
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(remote_addr);
+	sin->sin_port = htons(pid + BXIPKT_UDP_PORT_MIN);
+}
+
+/*
+ * Build bxipkt headers in the BXIPKT_UDP_HDR_SIZE bytes preceding the
+ * payload
+ */
+void bxipktudp_mkhdr(char *buf, struct bximsg_hdr *hdr_data)
+{
+	int len;
+	uint32_t tmp;
 
 	buf -= BXIPKT_UDP_HDR_SIZE;
-	buf_len += BXIPKT_UDP_HDR_SIZE;
 
-	/* Build bxipkt headers */
 	len = sizeof(BXIPKT_MAGIC_NUMBER);
 	tmp = BXIPKT_MAGIC_NUMBER;
 	memcpy(buf, &tmp, len);
 	memcpy(buf + len, hdr_data, sizeof(*hdr_data));
+}
+
+/*
+ * Fill the given array (of at least BXIPKT_IOV_MAX + 1 entries) with
+ * the segments of the given packet, starting with the UDP header if
+ * hdr is set, and return the number of segments
+ */
+int bxipktudp_mkiov(struct bxipkt_buf *b, struct iovec *iov, int hdr)
+{
+	int i;
+
+	iov[0].iov_base = b->addr;
+	iov[0].iov_len = b->iovcnt > 0 ? b->inlen : b->size;
+	if (hdr) {
+		bxipktudp_mkhdr(b->addr, &b->hdr);
+		iov[0].iov_base = (char *)b->addr - BXIPKT_UDP_HDR_SIZE;
+		iov[0].iov_len += BXIPKT_UDP_HDR_SIZE;
+	}
+
+	for (i = 0; i < b->iovcnt; i++)
+		iov[i + 1] = b->iov[i];
+
+	return b->iovcnt + 1;
+}
+
+static void bxipktudp_send_error(const char *func, size_t buf_len)
+{
+	int log_level;
+
+	log_level = 0;
+
+	if (errno == EAGAIN)
+		log_level = 2;
+	else if (errno == EPERM)
+		log_level = 1;
+
+	if (log_level >= 0)
+		LOGN(log_level, "%s: send error (buf_len=%lu): %s\n", func, buf_len,
+		     strerror(errno));
+}
+
+int bxipktudp_common_send(struct bxipkt_iface *iface, char *buf, size_t buf_len,
+			  struct bximsg_hdr *hdr_data, int nid, int pid)
+{
+	struct sockaddr_in si_other;
+	int len;
+
+	bxipktudp_mkaddr(iface, &si_other, nid, pid);
+	bxipktudp_mkhdr(buf, hdr_data);
+
+	buf -= BXIPKT_UDP_HDR_SIZE;
+	buf_len += BXIPKT_UDP_HDR_SIZE;
 
 	dump_sockaddr_in(__func__, &si_other);
 
@@ -367,17 +680,7 @@ int bxipktudp_common_send(struct bxipkt_iface *iface, char *buf, size_t buf_len,
 		     sizeof(si_other));
 
 	if (len < 0) {
-		log_level = 0;
-
-		if (errno == EAGAIN)
-			log_level = 2;
-		else if (errno == EPERM)
-			log_level = 1;
-
-		if (log_level >= 0)
-			LOGN(log_level, "sendto call error (buf_len=%lu): %s\n", buf_len,
-			     strerror(errno));
-
+		bxipktudp_send_error(__func__, buf_len);
 		return 0;
 	}
 
@@ -385,6 +688,85 @@ int bxipktudp_common_send(struct bxipkt_iface *iface, char *buf, size_t buf_len,
 	return 1;
 }
 
+/*
+ * Copy a packet in the shared memory ring of a process of this node,
+ * and wake it up if it's sleeping. Return -1 if the network must be
+ * used, otherwise the result of bxipkt_shm_send().
+ */
+static int bxipktudp_shm_post(struct bxipkt_iface *iface, struct bximsg_hdr *hdr_data,
+			      const struct iovec *iov, int iovcnt, int nid, int pid)
+{
+	struct sockaddr_in si_other;
+	uint32_t magic = BXIPKT_MAGIC_NUMBER;
+	int ret, wakeup;
+
+	if (iface->shm == NULL || nid != iface->nid)
+		return -1;
+
+	ret = bxipkt_shm_send(iface->shm, pid, hdr_data, iov, iovcnt, &wakeup);
+	if (ret > 0 && wakeup) {
+		bxipktudp_mkaddr(iface, &si_other, nid, pid);
+		if (sendto(iface->sockfd, &magic, sizeof(magic), 0, (struct sockaddr *)&si_other,
+			   sizeof(si_other)) < 0)
+			bxipktudp_send_error(__func__, sizeof(magic));
+	}
+
+	return ret;
+}
+
+/*
+ * Send a packet through shared memory, see bxipktudp_shm_post()
+ */
+int bxipktudp_shm_send(struct bxipkt_iface *iface, struct bxipkt_buf *b)
+{
+	struct iovec iov[BXIPKT_IOV_MAX + 1];
+	int ret;
+
+	if (iface->shm == NULL || b->nid != iface->nid)
+		return -1;
+
+	ret = bxipktudp_shm_post(iface, &b->hdr, iov, bxipktudp_mkiov(b, iov, 0), b->nid, b->pid);
+	if (ret > 0) {
+		b->reliable = 1;
+		bxipktudp_sent(iface, b);
+	}
+
+	return ret;
+}
+
+static int bxipktudp_shm_input(void *arg, void *data, size_t size, struct bximsg_hdr *hdr, int pid)
+{
+	struct bxipkt_iface *iface = arg;
+
+	if (size > 0)
+		iface->ipkts++;
+	else
+		iface->iipkts++;
+
+	if (iface->input == NULL)
+		return 1;
+
+	return iface->input(iface->arg, SWPTL_TRP_OK, data, size, hdr, iface->nid, pid, geteuid());
+}
+
+/*
+ * Return the poll events to wait for: if packets are pending in the
+ * shared memory rings, don't sleep.
+ */
+int bxipktudp_shm_events(struct bxipkt_iface *iface, int events)
+{
+	if (iface->shm != NULL && bxipkt_shm_arm(iface->shm))
+		events |= POLLOUT;
+
+	return events;
+}
+
+void bxipktudp_shm_progress(struct bxipkt_iface *iface)
+{
+	if (iface->shm != NULL)
+		bxipkt_shm_progress(iface->shm, bxipktudp_shm_input, iface);
+}
+
 /*
  * Post a "inline" PUT command (without SEND event).
  */
@@ -396,6 +778,13 @@ int bxipktudp_send_inline(struct bxipkt_iface *iface, struct bximsg_hdr *hdr_dat
 	LOGN(3, "%s: hdr.data_seq=%d hdr.ack_seq=%d\n", __func__, hdr_data->data_seq,
 	     hdr_data->ack_seq);
 
+	ret = bxipktudp_shm_post(iface, hdr_data, NULL, 0, nid, pid);
+	if (ret >= 0) {
+		if (ret != 0)
+			iface->iopkts++;
+		return ret;
+	}
+
 	ret = bxipktudp_common_send(iface, buf + BXIPKT_UDP_HDR_SIZE, 0, hdr_data, nid, pid);
 	if (ret != 0)
 		iface->iopkts++;
@@ -403,6 +792,156 @@ int bxipktudp_send_inline(struct bxipkt_iface *iface, struct bximsg_hdr *hdr_dat
 	return ret;
 }
 
+/*
+ * Account a sent packet and give it back to the upper layer
+ */
+void bxipktudp_sent(struct bxipkt_iface *iface, struct bxipkt_buf *b)
+{
+	iface->opkts++;
+	iface->apkts++;
+
+	if (iface->sent_pkt)
+		iface->sent_pkt(b);
+
+	if (iface->output != NULL)
+		iface->output(iface->arg, b);
+}
+
+/*
+ * Account a packet sent with MSG_ZEROCOPY, and keep it until the kernel
+ * reports the completion of the given send, as it may still read the
+ * buffer and the payload segments
+ */
+static void bxipktudp_zc_hold(struct bxipkt_iface *iface, struct bxipkt_buf *b, uint32_t txid)
+{
+	iface->opkts++;
+	iface->apkts++;
+	iface->tx_zc_pkts++;
+
+	if (iface->sent_pkt)
+		iface->sent_pkt(b);
+
+	b->txid = txid;
+	b->next = NULL;
+	*iface->zc_tail = b;
+	iface->zc_tail = &b->next;
+}
+
+/*
+ * Read the zero-copy completions from the socket error queue, and give
+ * the completed packets back to the upper layer
+ */
+static void bxipktudp_zc_progress(struct bxipkt_iface *iface)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct bxipkt_buf *b, **pb;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	uint32_t lo, hi;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(iface->sockfd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno != EAGAIN)
+				LOGN(0, "%s: can't read error queue: %s\n", __func__,
+				     strerror(errno));
+			break;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || (cmsg->cmsg_level != SOL_IP && cmsg->cmsg_level != SOL_IPV6))
+			continue;
+
+		serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+			LOGN(1, "%s: ignored error: %s\n", __func__, strerror(serr->ee_errno));
+			continue;
+		}
+
+		/*
+		 * The kernel had to copy the data anyway (ex. loopback, or
+		 * the device can't gather), so stop paying for zero-copy
+		 */
+		if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+			iface->tx_zc_copied++;
+			if (iface->zc_size > 0) {
+				LOGN(1, "%s: datagrams copied by the kernel, zero-copy disabled\n",
+				     __func__);
+				iface->zc_size = 0;
+			}
+		}
+
+		/* sends lo to hi (included) are complete */
+		lo = serr->ee_info;
+		hi = serr->ee_data;
+		pb = &iface->zc_head;
+		while ((b = *pb) != NULL) {
+			if (b->txid - lo > hi - lo) {
+				pb = &b->next;
+				continue;
+			}
+			*pb = b->next;
+			if (iface->output != NULL)
+				iface->output(iface->arg, b);
+		}
+		iface->zc_tail = pb;
+	}
+}
+
+/*
+ * Wait for the completion of the pending zero-copy sends, so that their
+ * packets are given back to the upper layer before the socket is
+ * closed. If the kernel takes too long, give them back anyway: the
+ * pages it still references are freed once it's done with them.
+ */
+static void bxipktudp_zc_drain(struct bxipkt_iface *iface)
+{
+	struct bxipkt_buf *b;
+	struct pollfd pfd;
+	int i;
+
+	for (i = 0; iface->zc_head != NULL && i < BXIPKT_UDP_ZC_DRAIN_MS / 10; i++) {
+		/* completions are signaled by POLLERR, which is always polled */
+		pfd.fd = iface->sockfd;
+		pfd.events = 0;
+		if (poll(&pfd, 1, 10) > 0)
+			bxipktudp_zc_progress(iface);
+	}
+
+	if (iface->zc_head != NULL)
+		LOGN(0, "%s: zero-copy sends not completed, buffers released\n", __func__);
+	while ((b = iface->zc_head) != NULL) {
+		iface->zc_head = b->next;
+		if (iface->output != NULL)
+			iface->output(iface->arg, b);
+	}
+	iface->zc_tail = &iface->zc_head;
+}
+
+/*
+ * Return 1 if the given segments may be sent with MSG_ZEROCOPY
+ */
+static int bxipktudp_zc_fits(const struct iovec *iov, int iovcnt)
+{
+	uintptr_t start, end;
+	int i, frags = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		start = (uintptr_t)iov[i].iov_base / BXIPKT_UDP_ZC_PAGE_SIZE;
+		end = ((uintptr_t)iov[i].iov_base + iov[i].iov_len - 1) / BXIPKT_UDP_ZC_PAGE_SIZE;
+		frags += end - start + 1;
+	}
+
+	return frags <= BXIPKT_UDP_ZC_FRAGS_MAX;
+}
+
+static int bxipktudp_send_mmsg(struct bxipkt_iface *iface, struct bxipkt_buf **bufs, int count);
+
 /*
  * Post a PUT command.
  */
@@ -412,20 +951,225 @@ int bxipktudp_send(struct bxipkt_iface *iface, struct bxipkt_buf *b, size_t len,
 
 	LOGN(3, "%s: nid=%d, pid=%d\n", __func__, nid, pid);
 
+	b->size = len;
+	b->nid = nid;
+	b->pid = pid;
+	ret = bxipktudp_shm_send(iface, b);
+	if (ret >= 0)
+		return ret;
+
+	/* gathering the payload and zero-copy require sendmsg() */
+	if (b->iovcnt > 0 || (iface->zc_size > 0 && len + BXIPKT_UDP_HDR_SIZE >= iface->zc_size))
+		return bxipktudp_send_mmsg(iface, &b, 1);
+
 	ret = bxipktudp_common_send(iface, b->addr, len, &b->hdr, nid, pid);
 
-	if (ret != 0) {
-		iface->opkts++;
-		iface->apkts++;
+	if (ret != 0)
+		bxipktudp_sent(iface, b);
 
-		if (iface->sent_pkt)
-			iface->sent_pkt(b);
+	return ret;
+}
 
-		if (iface->output != NULL)
-			iface->output(iface->arg, b);
+/*
+ * Post a PUT command with a payload gathered from user memory
+ */
+int bxipktudp_send_iov(struct bxipkt_iface *iface, struct bxipkt_buf *b, int nid, int pid)
+{
+	return bxipktudp_send(iface, b, b->size, nid, pid);
+}
+
+/*
+ * Return the number of packets, starting at bufs[0], that can be sent
+ * as a single GSO super-packet: they must have the same destination and
+ * all but the last one must be exactly gso_size bytes long.
+ */
+static int bxipktudp_gso_count(struct bxipkt_iface *iface, struct bxipkt_buf **bufs, int count)
+{
+	size_t len;
+	int n, niov;
+
+	if (!iface->tx_gso)
+		return 1;
+
+	len = 0;
+	niov = 0;
+	for (n = 0; n < count && n < BXIPKT_UDP_GSO_SEGS_MAX; n++) {
+		if (bufs[n]->nid != bufs[0]->nid || bufs[n]->pid != bufs[0]->pid)
+			break;
+		len += bufs[n]->size + BXIPKT_UDP_HDR_SIZE;
+		if (len > BXIPKT_UDP_GSO_SIZE_MAX)
+			break;
+		niov += bufs[n]->iovcnt + 1;
+		if (niov > IOV_MAX)
+			break;
+		if (bufs[n]->size + BXIPKT_UDP_HDR_SIZE != iface->gso_size) {
+			n++;
+			break;
+		}
 	}
 
-	return ret;
+	return n > 0 ? n : 1;
+}
+
+/*
+ * Post a vector of PUT commands, using a single sendmmsg() call for
+ * up to BXIPKT_UDP_TX_BATCH packets. If segmentation offload is
+ * enabled, each message may carry multiple packets. Consecutive large
+ * messages are sent with MSG_ZEROCOPY, if enabled.
+ */
+static int bxipktudp_send_mmsg(struct bxipkt_iface *iface, struct bxipkt_buf **bufs, int count)
+{
+	struct mmsghdr msgs[BXIPKT_UDP_TX_BATCH];
+	struct iovec iovs[BXIPKT_UDP_TX_BATCH * (BXIPKT_IOV_MAX + 1)];
+	int iovidx[BXIPKT_UDP_TX_BATCH + 1];
+	struct sockaddr_in addrs[BXIPKT_UDP_TX_BATCH];
+	char cmsgs[BXIPKT_UDP_TX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+	int segs[BXIPKT_UDP_TX_BATCH];
+	struct msghdr *h;
+	struct cmsghdr *cmsg;
+	struct bxipkt_buf *b;
+	uint16_t gso_size;
+	size_t len;
+	int i, j, k, n, nmsgs, todo, done, sent = 0;
+	int zc, msgzc, zcok = 1;
+
+	while (sent < count) {
+		todo = count - sent;
+		if (todo > BXIPKT_UDP_TX_BATCH)
+			todo = BXIPKT_UDP_TX_BATCH;
+
+		/* the segments of the i-th packet start at iovs[iovidx[i]] */
+		iovidx[0] = 0;
+		for (i = 0; i < todo; i++) {
+			n = bxipktudp_mkiov(bufs[sent + i], iovs + iovidx[i], 1);
+			iovidx[i + 1] = iovidx[i] + n;
+		}
+
+		memset(msgs, 0, todo * sizeof(struct mmsghdr));
+		nmsgs = 0;
+		zc = -1;
+		for (i = 0; i < todo; i += segs[nmsgs++]) {
+			b = bufs[sent + i];
+			segs[nmsgs] = bxipktudp_gso_count(iface, bufs + sent + i, todo - i);
+
+			bxipktudp_mkaddr(iface, &addrs[nmsgs], b->nid, b->pid);
+			h = &msgs[nmsgs].msg_hdr;
+			h->msg_name = &addrs[nmsgs];
+			h->msg_namelen = sizeof(struct sockaddr_in);
+			h->msg_iov = &iovs[iovidx[i]];
+			h->msg_iovlen = iovidx[i + segs[nmsgs]] - iovidx[i];
+
+			/* zero-copy applies to all messages of the call, or none */
+			len = 0;
+			for (j = 0; j < segs[nmsgs]; j++)
+				len += bufs[sent + i + j]->size + BXIPKT_UDP_HDR_SIZE;
+			msgzc = zcok && iface->zc_size > 0 && len >= iface->zc_size &&
+				bxipktudp_zc_fits(h->msg_iov, h->msg_iovlen);
+			if (zc == -1)
+				zc = msgzc;
+			else if (msgzc != zc)
+				break;
+			if (segs[nmsgs] > 1) {
+				h->msg_control = cmsgs[nmsgs];
+				h->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				cmsg = CMSG_FIRSTHDR(h);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				gso_size = iface->gso_size;
+				memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+			}
+		}
+
+		todo = i;
+
+		n = sendmmsg(iface->sockfd, msgs, nmsgs, zc ? MSG_ZEROCOPY : 0);
+		if (n < 0) {
+			if (zc && (errno == ENOBUFS || errno == EMSGSIZE)) {
+				/*
+				 * too many pending completions, or too many
+				 * pages: copy the datagrams
+				 */
+				zcok = 0;
+				continue;
+			}
+			bxipktudp_send_error(__func__, bufs[sent]->size + BXIPKT_UDP_HDR_SIZE);
+			if (segs[0] > 1 && (errno == EIO || errno == EINVAL)) {
+				/*
+				 * the device can't segment, send plain datagrams,
+				 * the socket still coalesces the received ones
+				 */
+				LOGN(0, "%s: segmentation offload failed, disabled\n", __func__);
+				iface->tx_gso = 0;
+				continue;
+			}
+			break;
+		}
+
+		LOGN(3, "%s: sent %d of %d messages\n", __func__, n, nmsgs);
+
+		/*
+		 * The output callback may recycle the buffer, so this
+		 * must be the last use of it. Each zero-copy message gets
+		 * the next completion id.
+		 */
+		done = 0;
+		for (i = 0; i < n; i++) {
+			if (segs[i] > 1) {
+				iface->tx_gso_pkts++;
+				iface->tx_gso_segs += segs[i];
+			}
+			for (k = 0; k < segs[i]; k++, done++) {
+				if (zc)
+					bxipktudp_zc_hold(iface, bufs[sent + done], iface->zc_next);
+				else
+					bxipktudp_sent(iface, bufs[sent + done]);
+			}
+			if (zc)
+				iface->zc_next++;
+		}
+
+		iface->tx_batches++;
+		iface->tx_batch_pkts += done;
+
+		sent += done;
+		if (n < nmsgs)
+			break;
+	}
+
+	return sent;
+}
+
+/*
+ * Post a vector of PUT commands: packets to processes of this node
+ * go through shared memory, the others are batched with sendmmsg().
+ */
+int bxipktudp_send_batch(struct bxipkt_iface *iface, struct bxipkt_buf **bufs, int count)
+{
+	int ret, n, sent = 0;
+
+	while (sent < count) {
+		ret = bxipktudp_shm_send(iface, bufs[sent]);
+		if (ret == 0)
+			break;
+		if (ret > 0) {
+			sent++;
+			continue;
+		}
+
+		/* send all packets up to the next one for this node */
+		for (n = 1; sent + n < count; n++) {
+			if (iface->shm != NULL && bufs[sent + n]->nid == iface->nid)
+				break;
+		}
+
+		ret = bxipktudp_send_mmsg(iface, bufs + sent, n);
+		sent += ret;
+		if (ret < n)
+			break;
+	}
+
+	return sent;
 }
 
 struct bxipkt_buf *bxipktudp_getbuf(struct bxipkt_iface *iface)
@@ -450,119 +1194,374 @@ void bxipktudp_putbuf(struct bxipkt_iface *iface, struct bxipkt_buf *b)
 	l->freelist = b;
 }
 
-int bxipktudp_rx_progress(struct bxipkt_iface *iface)
+/*
+ * Get the nid and the pid of the sender of a datagram from its address,
+ * return 0 if it's not a valid portals address.
+ */
+static int bxipktudp_rx_addr(struct bxipkt_iface *iface, struct sockaddr_in *client_address,
+			     int *rnid, int *rpid)
+{
+	int nid, pid;
+
+	if (client_address->sin_family != AF_INET) {
+		LOGN(0, "%s: not inet address family from %s:%d\n", __func__,
+		     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
+		return 0;
+	}
+
+	pid = ntohs(client_address->sin_port) - BXIPKT_UDP_PORT_MIN;
+	if (pid < 0 || pid > PTL_PID_MAX) {
+		LOGN(0, "%s: %d: pid out of range from %s:%d\n", __func__, pid,
+		     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
+		return 0;
+	}
+
+	nid = ntohl(client_address->sin_addr.s_addr);
+	if (((nid ^ iface->net_addr) & iface->net_mask) != 0) {
+		LOGN(0, "%s: client IP (%s:%d) not in the expected network\n", __func__,
+		     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
+		return 0;
+	}
+
+	nid &= ~iface->net_mask;
+	if (nid < 0 || nid >= (1 << 24)) {
+		LOGN(0, "%s: %d: nid out of range from %s:%d\n", __func__, nid,
+		     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
+		return 0;
+	}
+
+	*rnid = nid;
+	*rpid = pid;
+	return 1;
+}
+
+/*
+ * Process a single datagram of the receive ring
+ */
+static void bxipktudp_rx_datagram(struct bxipkt_iface *iface, unsigned char *buf, int len,
+				  struct sockaddr_in *client_address)
 {
-	int len;
-	struct sockaddr_in client_address;
-	socklen_t client_address_len;
 	int nid = 0;
 	int pid = 0;
 	unsigned char *p;
 	uint32_t tmp;
 
-	for (;;) {
-		client_address_len = sizeof(struct sockaddr_in);
+	tmp = BXIPKT_MAGIC_NUMBER;
+	/* Check bxipkt UDP magic number */
+	if (len < sizeof(BXIPKT_MAGIC_NUMBER) ||
+	    memcmp(buf, &tmp, sizeof(BXIPKT_MAGIC_NUMBER)) != 0) {
+		LOGN(2, "%s: magic number not found from %s:%d\n", __func__,
+		     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
+		return;
+	}
 
-		len = recvfrom(iface->sockfd, iface->rx_buf, iface->rx_bufsize, 0,
-			       (struct sockaddr *)&client_address, &client_address_len);
-		if (len < 0) {
-			if (errno == EAGAIN)
-				break;
-			LOGN(0, "%s: can't receive from %s:%d: %s\n", __func__,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port),
-			     strerror(errno));
-			return POLLHUP;
-		}
+	if (!bxipktudp_rx_addr(iface, client_address, &nid, &pid))
+		return;
 
-		tmp = BXIPKT_MAGIC_NUMBER;
-		/* Check bxipkt UDP magic number */
-		if (len < sizeof(BXIPKT_MAGIC_NUMBER) ||
-		    memcmp(iface->rx_buf, &tmp, sizeof(BXIPKT_MAGIC_NUMBER)) != 0) {
-			LOGN(2, "%s: magic number not found from %s:%d\n", __func__,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-			continue;
-		}
+	LOGN(3, "received %d bytes from nid (%d, %d), client addr: %s:%d\n", len, nid, pid,
+	     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
 
-		if (client_address.sin_family != AF_INET) {
-			LOGN(0, "%s: not inet address family from %s:%d\n", __func__,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-			continue;
-		}
+	/* wake-up for packets posted in the shared memory rings */
+	if (len == sizeof(BXIPKT_MAGIC_NUMBER)) {
+		iface->shm_wakeups++;
+		return;
+	}
 
-		pid = ntohs(client_address.sin_port) - BXIPKT_UDP_PORT_MIN;
-		if (pid < 0 || pid > PTL_PID_MAX) {
-			LOGN(0, "%s: %d: pid out of range from %s:%d\n", __func__, pid,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-			continue;
-		}
+	if (len < BXIPKT_UDP_HDR_SIZE) {
+		LOGN(0, "%s: Received message too short from %s:%d\n", __func__,
+		     inet_ntoa(client_address->sin_addr), ntohs(client_address->sin_port));
+		return;
+	}
 
-		nid = ntohl(client_address.sin_addr.s_addr);
-		if (((nid ^ iface->net_addr) & iface->net_mask) != 0) {
-			LOGN(0, "%s: client IP (%s:%d) not in the expected network\n", __func__,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-			continue;
-		}
+	if (len > BXIPKT_UDP_HDR_SIZE)
+		iface->ipkts++;
+	else
+		iface->iipkts++;
 
-		nid &= ~iface->net_mask;
-		if (nid < 0 || nid >= (1 << 24)) {
-			LOGN(0, "%s: %d: nid out of range from %s:%d\n", __func__, nid,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-			continue;
+	/* a full packet is likely followed by the rest of its message */
+	iface->rx_direct = len == BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size;
+
+	if (iface->input != NULL) {
+		p = buf + sizeof(BXIPKT_MAGIC_NUMBER);
+		iface->input(iface->arg, SWPTL_TRP_OK, buf + BXIPKT_UDP_HDR_SIZE,
+			     len - BXIPKT_UDP_HDR_SIZE, (struct bximsg_hdr *)p, nid, pid, geteuid());
+	}
+}
+
+/*
+ * Process a single datagram, unless it's dropped or held to be
+ * processed after the next one, as requested for testing.
+ */
+void bxipktudp_rx_input(struct bxipkt_iface *iface, unsigned char *buf, int len,
+			struct sockaddr_in *client_address)
+{
+	unsigned int r;
+
+	if (iface->rx_drop == 0 && iface->rx_reorder == 0) {
+		bxipktudp_rx_datagram(iface, buf, len, client_address);
+		return;
+	}
+
+	r = rand_r(&iface->rx_seed) % 1000;
+	if (r < iface->rx_drop) {
+		iface->rx_dropped++;
+		return;
+	}
+	r -= iface->rx_drop;
+	if (r < iface->rx_reorder && iface->rx_held_len == 0 &&
+	    len <= BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size) {
+		memcpy(iface->rx_held, buf, len);
+		iface->rx_held_len = len;
+		iface->rx_held_addr = *client_address;
+		iface->rx_reordered++;
+		return;
+	}
+
+	bxipktudp_rx_datagram(iface, buf, len, client_address);
+
+	if (iface->rx_held_len > 0) {
+		len = iface->rx_held_len;
+		iface->rx_held_len = 0;
+		bxipktudp_rx_datagram(iface, iface->rx_held, len, &iface->rx_held_addr);
+	}
+}
+
+/*
+ * Process a datagram of the receive ring, possibly made of multiple
+ * segments coalesced by GRO.
+ */
+static void bxipktudp_rx_gro_input(struct bxipkt_iface *iface, struct msghdr *h,
+				   unsigned char *buf, int len)
+{
+	struct cmsghdr *cmsg;
+	int seglen, segsize = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(h); cmsg != NULL; cmsg = CMSG_NXTHDR(h, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&segsize, CMSG_DATA(cmsg), sizeof(int));
+			break;
 		}
+	}
 
-		LOGN(3, "received %d bytes from nid (%d, %d), client addr: %s:%d\n", len, nid, pid,
-		     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+	if (segsize <= 0 || segsize >= len) {
+		bxipktudp_rx_input(iface, buf, len, h->msg_name);
+		return;
+	}
 
-		if (len < BXIPKT_UDP_HDR_SIZE) {
-			LOGN(0, "%s: Received message too short from %s:%d\n", __func__,
-			     inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-			continue;
+	iface->rx_gro_pkts++;
+	while (len > 0) {
+		seglen = len < segsize ? len : segsize;
+		bxipktudp_rx_input(iface, buf, seglen, h->msg_name);
+		iface->rx_gro_segs++;
+		buf += seglen;
+		len -= seglen;
+	}
+}
+
+/*
+ * Peek the header of the next datagram and, if the upper layer knows
+ * where its payload goes, receive it there without going through the
+ * receive ring. Return 1 if the datagram was processed, 0 if it must be
+ * received in the ring and -1 if the socket is drained.
+ */
+static int bxipktudp_rx_direct(struct bxipkt_iface *iface, int fd)
+{
+	uint64_t hdr[(BXIPKT_UDP_HDR_SIZE + 7) / 8];
+	struct iovec iov[BXIPKT_UDP_RX_IOV_MAX + 1];
+	struct bximsg_hdr *hdr_data;
+	struct sockaddr_in addr;
+	struct msghdr msg;
+	ssize_t len, n;
+	int nid, pid, cnt;
+	uint32_t tmp;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = BXIPKT_UDP_HDR_SIZE;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	/* with MSG_TRUNC, the full datagram length is returned */
+	len = recvmsg(fd, &msg, MSG_PEEK | MSG_TRUNC);
+	if (len < 0)
+		return errno == EAGAIN ? -1 : 0;
+
+	tmp = BXIPKT_MAGIC_NUMBER;
+	if (len <= BXIPKT_UDP_HDR_SIZE || memcmp(hdr, &tmp, sizeof(BXIPKT_MAGIC_NUMBER)) != 0)
+		return 0;
+
+	if (!bxipktudp_rx_addr(iface, &addr, &nid, &pid)) {
+		/* drop it */
+		recv(fd, hdr, 0, 0);
+		return 1;
+	}
+
+	hdr_data = (struct bximsg_hdr *)((char *)hdr + sizeof(BXIPKT_MAGIC_NUMBER));
+	cnt = iface->place(iface->arg, hdr_data, nid, pid, len - BXIPKT_UDP_HDR_SIZE, iov + 1,
+			   BXIPKT_UDP_RX_IOV_MAX);
+	if (cnt == 0)
+		return 0;
+
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iovlen = cnt + 1;
+	n = recvmsg(fd, &msg, 0);
+	if (n != len) {
+		/* we're the only reader, the peeked datagram can't change */
+		ptl_panic("%s: got %zd bytes instead of %zd\n", __func__, n, len);
+	}
+
+	LOGN(3, "received %zd bytes from nid (%d, %d) at their location\n", len, nid, pid);
+
+	iface->ipkts++;
+	iface->rx_direct_pkts++;
+	iface->rx_direct = len == BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size;
+	iface->input(iface->arg, SWPTL_TRP_OK, NULL, len - BXIPKT_UDP_HDR_SIZE, hdr_data, nid,
+		     pid, geteuid());
+	return 1;
+}
+
+/*
+ * Fill the receive ring with a single recvmmsg() call on the given
+ * socket, then hand the whole batch to the upper layer. Loop until the
+ * socket is drained. Continuations of large messages are received at
+ * their location.
+ */
+int bxipktudp_rx_progress(struct bxipkt_iface *iface, int fd)
+{
+	int i, n;
+
+	for (;;) {
+		if (iface->rx_direct && iface->place != NULL && !iface->rx_gro &&
+		    iface->rx_drop == 0 && iface->rx_reorder == 0) {
+			n = bxipktudp_rx_direct(iface, fd);
+			if (n > 0)
+				continue;
+			if (n < 0)
+				break;
 		}
 
-		if (len > BXIPKT_UDP_HDR_SIZE)
-			iface->ipkts++;
-		else
-			iface->iipkts++;
+		for (i = 0; i < iface->rx_count; i++) {
+			iface->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			if (iface->rx_gro)
+				iface->rx_msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+		}
 
-		if (iface->input != NULL) {
-			p = iface->rx_buf + sizeof(BXIPKT_MAGIC_NUMBER);
-			iface->input(iface->arg, SWPTL_TRP_OK, iface->rx_buf + BXIPKT_UDP_HDR_SIZE,
-				     len - BXIPKT_UDP_HDR_SIZE, (struct bximsg_hdr *)p, nid, pid,
-				     geteuid());
+		n = recvmmsg(fd, iface->rx_msgs, iface->rx_count, 0, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+			LOGN(0, "%s: can't receive: %s\n", __func__, strerror(errno));
+			return POLLHUP;
 		}
+
+		iface->rx_batches++;
+		iface->rx_batch_pkts += n;
+		if (n == iface->rx_count)
+			iface->rx_batch_full++;
+
+		LOGN(3, "%s: received a batch of %d/%u datagrams\n", __func__, n, iface->rx_count);
+
+		for (i = 0; i < n; i++) {
+			if (iface->rx_gro) {
+				bxipktudp_rx_gro_input(iface, &iface->rx_msgs[i].msg_hdr,
+						       iface->rx_buf + i * iface->rx_slotsize,
+						       iface->rx_msgs[i].msg_len);
+			} else {
+				bxipktudp_rx_input(iface, iface->rx_buf + i * iface->rx_slotsize,
+						   iface->rx_msgs[i].msg_len, &iface->rx_addrs[i]);
+			}
+		}
+
+		/* a partial batch means the socket receive queue is empty */
+		if (n < iface->rx_count)
+			break;
 	}
 
 	return 0;
 }
 
+static void bxipktudp_dump_batches(struct bxipkt_iface *iface)
+{
+	ptl_log("rx batches = %lu, rx batch size = %u, avg fill = %lu%%, full batches = %lu\n",
+		iface->rx_batches, iface->rx_count,
+		iface->rx_batches ? 100 * iface->rx_batch_pkts / (iface->rx_batches * iface->rx_count) :
+				    0,
+		iface->rx_batch_full);
+	ptl_log("tx batches = %lu, avg size = %lu\n", iface->tx_batches,
+		iface->tx_batches ? iface->tx_batch_pkts / iface->tx_batches : 0);
+	ptl_log("rx pkts placed directly = %lu\n", iface->rx_direct_pkts);
+	if (iface->rx_drop != 0 || iface->rx_reorder != 0) {
+		ptl_log("rx pkts dropped = %lu, reordered = %lu\n", iface->rx_dropped,
+			iface->rx_reordered);
+	}
+	ptl_log("tx zero-copy pkts = %lu, copied by the kernel = %lu\n", iface->tx_zc_pkts,
+		iface->tx_zc_copied);
+	if (iface->tx_gso || iface->rx_gro) {
+		ptl_log("gso size = %zu, tx gso pkts = %lu (%lu segs), rx gro pkts = %lu (%lu segs)\n",
+			iface->gso_size, iface->tx_gso_pkts, iface->tx_gso_segs,
+			iface->rx_gro_pkts, iface->rx_gro_segs);
+	}
+	if (iface->shm != NULL) {
+		ptl_log("shm wakeups received = %lu\n", iface->shm_wakeups);
+		bxipkt_shm_dump(iface->shm);
+	}
+}
+
 void bxipktudp_done(struct bxipkt_iface *iface)
 {
+	int i;
+
+	if (iface->sockfd >= 0)
+		bxipktudp_zc_drain(iface);
+
 #ifdef DEBUG
 	if (bxipkt_debug >= 2 || iface->ctx->opts.stats) {
 		ptl_log("%s: ipkts = %lu, opkts = %lu, iipkts = %lu, iopkts = %lu\n", __func__,
 			iface->ipkts, iface->opkts, iface->iipkts, iface->iopkts);
+		bxipktudp_dump_batches(iface);
 	}
 #endif
 	free(iface->rx_buf);
+	free(iface->rx_msgs);
+	free(iface->rx_iovs);
+	free(iface->rx_addrs);
+	free(iface->rx_cmsgs);
+	free(iface->rx_held);
+	if (iface->shm != NULL)
+		bxipkt_shm_destroy(iface->shm);
 	if (iface->sockfd >= 0) {
 		shutdown(iface->sockfd, SHUT_RDWR);
 		close(iface->sockfd);
 	}
+	for (i = 1; i < iface->rx_nfds; i++) {
+		if (iface->rx_fds[i] >= 0)
+			close(iface->rx_fds[i]);
+	}
+	if (iface->claimfd >= 0)
+		close(iface->claimfd);
 
 	bxipktudp_buflist_done(&iface->tx_buflist);
 	free(iface);
 }
 
-struct bxipkt_iface *bxipktudp_init(struct bxipkt_ctx *ctx, int service, int nic_iface, int uid,
-				    int pid, int nbufs, void *arg,
-				    void (*input)(void *, enum swptl_transport_status, void *,
-						  size_t, struct bximsg_hdr *, int, int, int),
-				    void (*output)(void *, struct bxipkt_buf *),
-				    void (*sent_pkt)(struct bxipkt_buf *pkt), int *rnid, int *rpid,
-				    int *rmtu)
+/*
+ * Create an interface with its bound socket and its transmit buffers,
+ * common to all UDP transports.
+ */
+struct bxipkt_iface *bxipktudp_iface_create(struct bxipkt_ctx *ctx, int pid, int nbufs, void *arg,
+					    int (*input)(void *, enum swptl_transport_status,
+							 void *, size_t, struct bximsg_hdr *,
+							 int, int, int),
+					    int (*place)(void *, struct bximsg_hdr *, int, int,
+							 size_t, struct iovec *, int),
+					    void (*output)(void *, struct bxipkt_buf *),
+					    void (*sent_pkt)(struct bxipkt_buf *pkt), int gso,
+					    int shards)
 {
 	struct bxipkt_iface *iface;
-	int port;
+	int i, port;
 	char err_msg[PTL_LOG_BUF_SIZE];
 
 	if (nbufs <= 0) {
@@ -579,11 +1578,22 @@ struct bxipkt_iface *bxipktudp_init(struct bxipkt_ctx *ctx, int service, int nic
 	iface->ctx = ctx;
 	iface->arg = arg;
 	iface->input = input;
+	iface->place = place;
 	iface->output = output;
 	iface->sent_pkt = sent_pkt;
 	iface->pid = -1;
 	iface->sockfd = -1;
+	for (i = 0; i < BXIPKT_UDP_SHARDS_MAX; i++)
+		iface->rx_fds[i] = -1;
+	iface->rx_nfds = shards;
+	iface->claimfd = -1;
 	iface->tx_buflist.count = nbufs;
+	iface->rx_count = ((struct bxipkt_udp_ctx *)ctx->priv)->rx_batch;
+	iface->tx_gso = gso;
+	iface->rx_gro = gso;
+	iface->zc_tail = &iface->zc_head;
+	iface->rx_drop = ((struct bxipkt_udp_ctx *)ctx->priv)->drop;
+	iface->rx_reorder = ((struct bxipkt_udp_ctx *)ctx->priv)->reorder;
 
 	if (!bxipktudp_netconfig(iface)) {
 		bxipktudp_done(iface);
@@ -596,11 +1606,19 @@ struct bxipkt_iface *bxipktudp_init(struct bxipkt_ctx *ctx, int service, int nic
 		return NULL;
 	}
 
+	if (iface->rx_reorder > 0) {
+		iface->rx_held = malloc(BXIPKT_UDP_HDR_SIZE + iface->tx_buflist.size);
+		if (iface->rx_held == NULL) {
+			LOGN(0, "malloc(%s): %s\n", __func__, strerror(errno));
+			bxipktudp_done(iface);
+			return NULL;
+		}
+	}
+
 	if (pid == PTL_PID_ANY) {
 		for (port = BXIPKT_UDP_PORT_MIN + 1; port <= BXIPKT_UDP_PORT_MIN + PTL_PID_MAX;
 		     port++) {
-			iface->sockfd = bxipktudp_createsocket(iface, port, err_msg);
-			if (iface->sockfd >= 0) {
+			if (bxipktudp_openport(iface, port, err_msg) >= 0) {
 				iface->pid = port - BXIPKT_UDP_PORT_MIN;
 				break;
 			}
@@ -612,8 +1630,7 @@ struct bxipkt_iface *bxipktudp_init(struct bxipkt_ctx *ctx, int service, int nic
 			return NULL;
 		}
 		port = pid + BXIPKT_UDP_PORT_MIN;
-		iface->sockfd = bxipktudp_createsocket(iface, port, err_msg);
-		if (iface->sockfd >= 0)
+		if (bxipktudp_openport(iface, port, err_msg) >= 0)
 			iface->pid = pid;
 	}
 
@@ -622,10 +1639,47 @@ struct bxipkt_iface *bxipktudp_init(struct bxipkt_ctx *ctx, int service, int nic
 		bxipktudp_done(iface);
 		return NULL;
 	}
+	iface->rx_seed = iface->pid;
+
+	/*
+	 * without shared memory, processes of this node use the network,
+	 * which is needed to lose or reorder their packets
+	 */
+	if (((struct bxipkt_udp_ctx *)ctx->priv)->shm && iface->rx_drop == 0 &&
+	    iface->rx_reorder == 0)
+		iface->shm = bxipkt_shm_create(iface->net_addr, iface->pid, iface->tx_buflist.size);
 
-	iface->rx_buf = malloc(iface->rx_bufsize);
-	if (iface->rx_buf == NULL) {
-		LOG("%s: malloc %s size %zd\n", __func__, strerror(errno), iface->rx_bufsize);
+	return iface;
+}
+
+struct bxipkt_iface *bxipktudp_init(struct bxipkt_ctx *ctx, int service, int nic_iface, int uid,
+				    int pid, int nbufs, void *arg,
+				    int (*input)(void *, enum swptl_transport_status, void *,
+						 size_t, struct bximsg_hdr *, int, int, int),
+				    int (*place)(void *, struct bximsg_hdr *, int, int, size_t,
+						 struct iovec *, int),
+				    void (*output)(void *, struct bxipkt_buf *),
+				    void (*sent_pkt)(struct bxipkt_buf *pkt), int *rnid, int *rpid,
+				    int *rmtu)
+{
+	struct bxipkt_iface *iface;
+
+	iface = bxipktudp_iface_create(ctx, pid, nbufs, arg, input, place, output, sent_pkt,
+				       ((struct bxipkt_udp_ctx *)ctx->priv)->gso,
+				       ((struct bxipkt_udp_ctx *)ctx->priv)->rx_shards);
+	if (iface == NULL)
+		return NULL;
+
+	if (iface->rx_nfds > 1)
+		bxipktudp_shards_init(iface);
+
+	if (iface->tx_gso)
+		bxipktudp_gso_init(iface);
+
+	if (((struct bxipkt_udp_ctx *)ctx->priv)->zerocopy > 0)
+		bxipktudp_zc_init(iface, ((struct bxipkt_udp_ctx *)ctx->priv)->zerocopy);
+
+	if (!bxipktudp_rxring_init(iface)) {
 		bxipktudp_done(iface);
 		return NULL;
 	}
@@ -641,35 +1695,56 @@ void bxipktudp_dump(struct bxipkt_iface *iface)
 {
 	ptl_log("ipkts = %lu, opkts = %lu, iipkts = %lu, iopkts = %lu, apkts = %lu\n", iface->ipkts,
 		iface->opkts, iface->iipkts, iface->iopkts, iface->apkts);
+	bxipktudp_dump_batches(iface);
 }
 
 int bxipktudp_nfds(struct bxipkt_iface *iface)
 {
-	return 1;
+	return iface->rx_nfds;
 }
 
 int bxipktudp_pollfd(struct bxipkt_iface *iface, struct pollfd *pfds, int events)
 {
+	int i;
+
 	pfds[0].fd = iface->sockfd;
-	pfds[0].events = POLLIN | events;
+	pfds[0].events = POLLIN | bxipktudp_shm_events(iface, events);
 
-	return 1;
+	for (i = 1; i < iface->rx_nfds; i++) {
+		pfds[i].fd = iface->rx_fds[i];
+		pfds[i].events = POLLIN;
+	}
+
+	return iface->rx_nfds;
 }
 
 int bxipktudp_revents(struct bxipkt_iface *iface, struct pollfd *pfds)
 {
-	if (pfds[0].revents & POLLHUP)
-		return POLLHUP;
+	int i;
 
-	if (pfds[0].revents & POLLIN) {
-		if (bxipktudp_rx_progress(iface) & POLLHUP)
+	for (i = 0; i < iface->rx_nfds; i++) {
+		if (pfds[i].revents & POLLHUP)
 			return POLLHUP;
 	}
 
+	/* zero-copy completions are queued on the socket error queue */
+	if (pfds[0].revents & POLLERR)
+		bxipktudp_zc_progress(iface);
+
+	for (i = 0; i < iface->rx_nfds; i++) {
+		if (!(pfds[i].revents & POLLIN))
+			continue;
+		if (bxipktudp_rx_progress(iface, iface->rx_fds[i]) & POLLHUP)
+			return POLLHUP;
+	}
+
+	bxipktudp_shm_progress(iface);
+
 	return pfds[0].revents & POLLOUT;
 }
 
-struct bxipkt_ops bxipkt_udp = { bxipktudp_libinit, bxipktudp_libfini, bxipktudp_init,
-				 bxipktudp_done,    bxipktudp_send,    bxipktudp_send_inline,
-				 bxipktudp_getbuf,  bxipktudp_putbuf,  bxipktudp_dump,
-				 bxipktudp_nfds,    bxipktudp_pollfd,  bxipktudp_revents };
+struct bxipkt_ops bxipkt_udp = { bxipktudp_libinit,    bxipktudp_libfini,     bxipktudp_init,
+				 bxipktudp_done,       bxipktudp_send,        bxipktudp_send_batch,
+				 bxipktudp_send_iov,   bxipktudp_send_inline, bxipktudp_getbuf,
+				 bxipktudp_putbuf,     bxipktudp_dump,        bxipktudp_nfds,
+				 bxipktudp_pollfd,     bxipktudp_revents };
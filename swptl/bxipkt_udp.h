@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+#ifndef BXIPKT_UDP_H
+#define BXIPKT_UDP_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "bxipkt.h"
+
+#define BXIPKT_UDP_PORT_MIN 8000
+
+/* Maximum number of sockets receiving on the port of an interface */
+#define BXIPKT_UDP_SHARDS_MAX 16
+
+#define BXIPKT_MAGIC_NUMBER ((uint32_t)0x82D6A19F)
+
+/* The BXIPKT_MAGIC_NUMBER length is 4 and the struct bximsg_hdr is 12, so
+ * the payload is aligned on 8 bytes. The last 4 bytes of the header used to be
+ * padding, so peers using 16-bit seq. numbers have the same header size.
+ * It is used in the header buffer which is allocated to send/receive messages
+ */
+#define BXIPKT_UDP_HDR_SIZE (sizeof(BXIPKT_MAGIC_NUMBER) + sizeof(struct bximsg_hdr))
+
+struct bxipkt_buflist {
+	struct bxipkt_buf *freelist, *pool_data;
+	size_t size;
+	unsigned int count;
+};
+
+struct bxipkt_iface {
+	void *arg;
+	int (*input)(void *arg, enum swptl_transport_status status, void *data, size_t size,
+		     struct bximsg_hdr *hdr, int nid, int pid, int uid);
+	int (*place)(void *arg, struct bximsg_hdr *hdr, int nid, int pid, size_t size,
+		     struct iovec *iov, int iovmax);
+	void (*output)(void *arg, struct bxipkt_buf *pkt);
+	void (*sent_pkt)(struct bxipkt_buf *pkt);
+	unsigned long ipkts;
+	unsigned long opkts;
+	unsigned long apkts;
+	unsigned long iipkts;
+	unsigned long iopkts;
+	struct bxipkt_buflist tx_buflist;
+
+	/*
+	 * Receive ring: rx_count buffers of rx_bufsize bytes each (rx_slotsize
+	 * apart), filled by a single recvmmsg() call
+	 */
+	unsigned char *rx_buf;
+	size_t rx_bufsize;
+	size_t rx_slotsize;
+	unsigned int rx_count;
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iovs;
+	struct sockaddr_in *rx_addrs;
+	char *rx_cmsgs;
+
+	/* recvmmsg() batch fill statistics */
+	unsigned long rx_batches;
+	unsigned long rx_batch_pkts;
+	unsigned long rx_batch_full;
+
+	/*
+	 * Direct placement: if set, the last datagram was a full packet,
+	 * so the next one is likely the continuation of a large message.
+	 * Its header is then peeked and its payload received straight at
+	 * the location returned by the place call-back.
+	 */
+	int rx_direct;
+	unsigned long rx_direct_pkts;
+
+	/*
+	 * Loss and reordering, for testing: rx_drop and rx_reorder datagrams
+	 * per 1000 are dropped or copied in rx_held and processed after the
+	 * next one. Direct placement is disabled then.
+	 */
+	unsigned int rx_drop;
+	unsigned int rx_reorder;
+	unsigned int rx_seed;
+	unsigned char *rx_held;
+	int rx_held_len;
+	struct sockaddr_in rx_held_addr;
+	unsigned long rx_dropped;
+	unsigned long rx_reordered;
+
+	/* sendmmsg() batch statistics */
+	unsigned long tx_batches;
+	unsigned long tx_batch_pkts;
+
+	/*
+	 * Segmentation offload: if tx_gso is set, consecutive packets to
+	 * the same destination are sent as a single super-packet of
+	 * gso_size segments. If rx_gro is set, the socket may coalesce
+	 * received datagrams, which must be split. A device unable to
+	 * segment clears tx_gso only, the socket still coalesces.
+	 */
+	int tx_gso;
+	int rx_gro;
+	size_t gso_size;
+	unsigned long tx_gso_pkts;
+	unsigned long tx_gso_segs;
+	unsigned long rx_gro_pkts;
+	unsigned long rx_gro_segs;
+
+	/*
+	 * Zero-copy transmission: datagrams of at least zc_size bytes are
+	 * sent with MSG_ZEROCOPY (0 if disabled). Their buffers are kept
+	 * on the zc_head list until the kernel reports their completion,
+	 * matched by txid. zc_next is the id of the next zero-copy send.
+	 */
+	size_t zc_size;
+	uint32_t zc_next;
+	struct bxipkt_buf *zc_head, **zc_tail;
+	unsigned long tx_zc_pkts;
+	unsigned long tx_zc_copied;
+
+	uint32_t net_addr;
+	uint32_t net_mask;
+	int nid;
+
+	struct bxipkt_ctx *ctx;
+
+	/*
+	 * The portals pid is based on the port of the socket and follow
+	 * this rule: <socket port> = <portals pid> + 1024
+	 */
+	int pid;
+	int sockfd;
+
+	/*
+	 * Receive shards: rx_nfds sockets bound to the port with
+	 * SO_REUSEPORT, rx_fds[0] being sockfd. Datagrams of a given
+	 * source always go to the same shard, so they stay in order.
+	 * claimfd reserves the port, as any process of the same user
+	 * could join the SO_REUSEPORT group otherwise.
+	 */
+	int rx_fds[BXIPKT_UDP_SHARDS_MAX];
+	int rx_nfds;
+	int claimfd;
+
+	/* io_uring backend state, see bxipkt_uring.c */
+	struct bxipkt_uring *uring;
+
+	/*
+	 * Shared memory rings for processes of the same node, NULL if
+	 * disabled. A datagram made of the magic number only wakes us up
+	 * when packets are posted in the rings while we sleep.
+	 */
+	struct bxipkt_shm *shm;
+	unsigned long shm_wakeups;
+};
+
+struct bxipkt_udp_ctx {
+	int mtu;
+	uint32_t net;
+	unsigned int rx_batch;
+	int gso;
+	int shm;
+	size_t zerocopy;
+	unsigned int rx_shards;
+	unsigned int drop;
+	unsigned int reorder;
+};
+
+/*
+ * Functions shared by the UDP transports
+ */
+int bxipktudp_libinit(struct bxipkt_options *o, struct bxipkt_ctx *ctx);
+void bxipktudp_libfini(struct bxipkt_ctx *ctx);
+struct bxipkt_iface *bxipktudp_iface_create(struct bxipkt_ctx *ctx, int pid, int nbufs, void *arg,
+					    int (*input)(void *, enum swptl_transport_status,
+							 void *, size_t, struct bximsg_hdr *,
+							 int, int, int),
+					    int (*place)(void *, struct bximsg_hdr *, int, int,
+							 size_t, struct iovec *, int),
+					    void (*output)(void *, struct bxipkt_buf *),
+					    void (*sent_pkt)(struct bxipkt_buf *pkt), int gso,
+					    int shards);
+void bxipktudp_done(struct bxipkt_iface *iface);
+void bxipktudp_mkaddr(struct bxipkt_iface *iface, struct sockaddr_in *sin, int nid, int pid);
+void bxipktudp_mkhdr(char *buf, struct bximsg_hdr *hdr_data);
+int bxipktudp_mkiov(struct bxipkt_buf *b, struct iovec *iov, int hdr);
+void bxipktudp_sent(struct bxipkt_iface *iface, struct bxipkt_buf *b);
+void bxipktudp_rx_input(struct bxipkt_iface *iface, unsigned char *buf, int len,
+			struct sockaddr_in *client_address);
+int bxipktudp_send_inline(struct bxipkt_iface *iface, struct bximsg_hdr *hdr_data, int nid,
+			  int pid);
+struct bxipkt_buf *bxipktudp_getbuf(struct bxipkt_iface *iface);
+void bxipktudp_putbuf(struct bxipkt_iface *iface, struct bxipkt_buf *b);
+int bxipktudp_shm_send(struct bxipkt_iface *iface, struct bxipkt_buf *b);
+int bxipktudp_shm_events(struct bxipkt_iface *iface, int events);
+void bxipktudp_shm_progress(struct bxipkt_iface *iface);
+void bxipktudp_dump(struct bxipkt_iface *iface);
+int bxipktudp_nfds(struct bxipkt_iface *iface);
+
+#endif
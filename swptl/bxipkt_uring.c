@@ -0,0 +1,661 @@
+/*
+ * Copyright (C) Bull S.A.S - 2024
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program; if
+ * not, write to the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * BXI Low Level Team
+ *
+ */
+
+/*
+ * UDP transport driven through io_uring: a single multishot recvmsg
+ * request fills provided buffers as datagrams arrive, and packets are
+ * sent with queued sendmsg requests submitted once per batch. The ring
+ * signals completions through an eventfd, which is the file descriptor
+ * exposed to the poll loop.
+ *
+ * Addressing, buffers and the wire format are the same as the plain UDP
+ * transport, both can talk to each other.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "bxipkt.h"
+#include "bxipkt_udp.h"
+#include "utils.h"
+#include "ptl_log.h"
+
+/* Number of submission queue entries */
+#define BXIPKT_URING_SQ_ENTRIES 256
+
+/* Number of provided receive buffers, must be a power of two */
+#define BXIPKT_URING_RX_BUFS 64
+
+/* Provided buffer group used by the receive request */
+#define BXIPKT_URING_BGID 0
+
+/* user_data of the receive request, other requests carry the packet */
+#define BXIPKT_URING_RX_TAG ((uint64_t)-1)
+
+#ifdef DEBUG
+/*
+ * log to stderr, with the give debug level
+ */
+#define LOGN(n, ...)                                                                               \
+	do {                                                                                       \
+		if (bxipkt_debug >= (n))                                                           \
+			ptl_log(__VA_ARGS__);                                                      \
+	} while (0)
+
+#define LOG(...) LOGN(1, __VA_ARGS__)
+#else
+#define LOGN(n, ...)                                                                               \
+	do {                                                                                       \
+	} while (0)
+#define LOG(...)                                                                                   \
+	do {                                                                                       \
+	} while (0)
+#endif
+
+/*
+ * sendmsg() arguments of a packet, must stay valid until completion
+ */
+struct bxipkt_uring_tx {
+	struct msghdr msg;
+	struct iovec iov[BXIPKT_IOV_MAX + 1];
+	struct sockaddr_in addr;
+};
+
+struct bxipkt_uring {
+	int fd; /* io_uring */
+	int efd; /* eventfd signaled on completions */
+
+	void *ring;
+	size_t ring_size;
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int sq_local_tail; /* prepared entries */
+	unsigned int sq_submitted; /* entries consumed by the kernel */
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* provided buffers of the multishot receive request */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;
+	unsigned char *rx_bufs;
+	size_t rx_bufsize;
+	struct msghdr rx_msg;
+	int rx_armed;
+
+	/* send requests, indexed by the packet buffer index */
+	struct bxipkt_uring_tx *tx;
+	unsigned int tx_inflight;
+
+	unsigned long enters;
+	unsigned long rx_rearms;
+	unsigned long rx_nobufs;
+	unsigned long tx_errors;
+};
+
+static int bxipkturing_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int bxipkturing_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			     unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int bxipkturing_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Return a zeroed submission queue entry, or NULL if the queue is full
+ */
+static struct io_uring_sqe *bxipkturing_get_sqe(struct bxipkt_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (u->sq_local_tail - head >= u->sq_entries)
+		return NULL;
+
+	sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_local_tail++;
+
+	return sqe;
+}
+
+/*
+ * Submit all prepared entries with a single system call
+ */
+static void bxipkturing_submit(struct bxipkt_uring *u)
+{
+	unsigned int todo;
+	int ret;
+
+	todo = u->sq_local_tail - u->sq_submitted;
+	if (todo == 0)
+		return;
+
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+	ret = bxipkturing_enter(u->fd, todo, 0, 0);
+	u->enters++;
+	if (ret < 0) {
+		/* entries stay in the queue, retried on next progress */
+		LOGN(2, "%s: io_uring_enter: %s\n", __func__, strerror(errno));
+		return;
+	}
+
+	u->sq_submitted += ret;
+}
+
+/*
+ * Give a receive buffer back to the kernel; the new tail is published
+ * by bxipkturing_rx_publish()
+ */
+static void bxipkturing_rx_recycle(struct bxipkt_uring *u, unsigned int bid)
+{
+	struct io_uring_buf *b;
+
+	b = &u->br->bufs[u->br_tail & (BXIPKT_URING_RX_BUFS - 1)];
+	b->addr = (uintptr_t)(u->rx_bufs + bid * u->rx_bufsize);
+	b->len = u->rx_bufsize;
+	b->bid = bid;
+	u->br_tail++;
+}
+
+static void bxipkturing_rx_publish(struct bxipkt_uring *u)
+{
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Queue the multishot receive request
+ */
+static void bxipkturing_rx_arm(struct bxipkt_iface *iface)
+{
+	struct bxipkt_uring *u = iface->uring;
+	struct io_uring_sqe *sqe;
+
+	sqe = bxipkturing_get_sqe(u);
+	if (sqe == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = iface->sockfd;
+	sqe->addr = (uintptr_t)&u->rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BXIPKT_URING_BGID;
+	sqe->user_data = BXIPKT_URING_RX_TAG;
+
+	u->rx_armed = 1;
+	u->rx_rearms++;
+}
+
+static void bxipkturing_rx_complete(struct bxipkt_iface *iface, struct io_uring_cqe *cqe)
+{
+	struct bxipkt_uring *u = iface->uring;
+	struct io_uring_recvmsg_out *out;
+	unsigned char *buf, *payload;
+	unsigned int bid;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		u->rx_armed = 0;
+
+	if (cqe->res < 0) {
+		if (cqe->res == -ENOBUFS)
+			u->rx_nobufs++;
+		else
+			LOGN(0, "%s: can't receive: %s\n", __func__, strerror(-cqe->res));
+		return;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = u->rx_bufs + bid * u->rx_bufsize;
+	out = (struct io_uring_recvmsg_out *)buf;
+	payload = buf + sizeof(*out) + u->rx_msg.msg_namelen + u->rx_msg.msg_controllen;
+
+	if (out->flags & MSG_TRUNC) {
+		LOGN(0, "%s: truncated datagram\n", __func__);
+	} else if (out->namelen != sizeof(struct sockaddr_in)) {
+		LOGN(0, "%s: unexpected address length %u\n", __func__, out->namelen);
+	} else {
+		bxipktudp_rx_input(iface, payload, out->payloadlen,
+				   (struct sockaddr_in *)(buf + sizeof(*out)));
+	}
+
+	bxipkturing_rx_recycle(u, bid);
+}
+
+static void bxipkturing_tx_complete(struct bxipkt_iface *iface, struct io_uring_cqe *cqe)
+{
+	struct bxipkt_uring *u = iface->uring;
+	struct bxipkt_buf *b = (struct bxipkt_buf *)(uintptr_t)cqe->user_data;
+
+	u->tx_inflight--;
+
+	/*
+	 * The packet is lost, but it's still released: bximsg will
+	 * retransmit it on time-out.
+	 */
+	if (cqe->res < 0) {
+		u->tx_errors++;
+		LOGN(cqe->res == -EAGAIN ? 2 : 0, "%s: send error: %s\n", __func__,
+		     strerror(-cqe->res));
+	}
+
+	bxipktudp_sent(iface, b);
+}
+
+/*
+ * Process all available completions, without any system call
+ */
+static void bxipkturing_cq_progress(struct bxipkt_iface *iface)
+{
+	struct bxipkt_uring *u = iface->uring;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	unsigned short br_tail;
+
+	br_tail = u->br_tail;
+	head = *u->cq_head;
+	for (;;) {
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		while (head != tail) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->user_data == BXIPKT_URING_RX_TAG)
+				bxipkturing_rx_complete(iface, cqe);
+			else
+				bxipkturing_tx_complete(iface, cqe);
+			head++;
+		}
+
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (u->br_tail != br_tail)
+		bxipkturing_rx_publish(u);
+}
+
+static void bxipkturing_ring_done(struct bxipkt_iface *iface)
+{
+	struct bxipkt_uring *u = iface->uring;
+
+	if (u->fd >= 0) {
+		/*
+		 * Wait for in-flight sends, they reference packet
+		 * buffers, but don't pass incoming packets to the upper
+		 * layer anymore.
+		 */
+		iface->input = NULL;
+		bxipkturing_submit(u);
+		while (u->tx_inflight > 0) {
+			if (bxipkturing_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR)
+				break;
+			bxipkturing_cq_progress(iface);
+		}
+		close(u->fd);
+	}
+	if (u->efd >= 0)
+		close(u->efd);
+	if (u->ring != NULL)
+		munmap(u->ring, u->ring_size);
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_size);
+	if (u->br != NULL)
+		munmap(u->br, u->br_size);
+	free(u->rx_bufs);
+	free(u->tx);
+	free(u);
+	iface->uring = NULL;
+}
+
+static int bxipkturing_ring_init(struct bxipkt_iface *iface)
+{
+	struct bxipkt_uring *u;
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned int *sq_array;
+	unsigned int i;
+
+	u = calloc(1, sizeof(struct bxipkt_uring));
+	if (u == NULL) {
+		LOGN(0, "malloc(%s): %s\n", __func__, strerror(errno));
+		return 0;
+	}
+	u->fd = -1;
+	u->efd = -1;
+	iface->uring = u;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * (BXIPKT_URING_RX_BUFS + iface->tx_buflist.count);
+	u->fd = bxipkturing_setup(BXIPKT_URING_SQ_ENTRIES, &p);
+	if (u->fd < 0) {
+		LOGN(0, "%s: io_uring_setup: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		LOGN(0, "%s: io_uring too old, single mmap not supported\n", __func__);
+		return 0;
+	}
+
+	/* Map the submission and completion queues */
+	u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if (u->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		u->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		u->ring = NULL;
+		LOGN(0, "%s: mmap: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		LOGN(0, "%s: mmap: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	u->sq_head = (unsigned int *)((char *)u->ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	sq_array = (unsigned int *)((char *)u->ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+	u->sq_local_tail = u->sq_submitted = *u->sq_tail;
+
+	u->cq_head = (unsigned int *)((char *)u->ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->ring + p.cq_off.cqes);
+
+	/* Signal completions through an eventfd, this is what we poll */
+	u->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (u->efd < 0) {
+		LOGN(0, "%s: eventfd: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+	if (bxipkturing_register(u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1) < 0) {
+		LOGN(0, "%s: can't register eventfd: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	/*
+	 * Receive buffers: each holds the recvmsg header, the source
+	 * address and the datagram
+	 */
+	u->rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+	u->rx_bufsize = align_to(sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) +
+					 iface->rx_bufsize,
+				 64);
+	u->rx_bufs = malloc(BXIPKT_URING_RX_BUFS * u->rx_bufsize);
+	u->tx = calloc(iface->tx_buflist.count, sizeof(struct bxipkt_uring_tx));
+	if (u->rx_bufs == NULL || u->tx == NULL) {
+		LOGN(0, "malloc(%s): %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	u->br_size = align_to(BXIPKT_URING_RX_BUFS * sizeof(struct io_uring_buf),
+			      sysconf(_SC_PAGESIZE));
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		LOGN(0, "%s: mmap: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = BXIPKT_URING_RX_BUFS;
+	reg.bgid = BXIPKT_URING_BGID;
+	if (bxipkturing_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		LOGN(0, "%s: can't register provided buffers: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	for (i = 0; i < BXIPKT_URING_RX_BUFS; i++)
+		bxipkturing_rx_recycle(u, i);
+	bxipkturing_rx_publish(u);
+
+	bxipkturing_rx_arm(iface);
+	bxipkturing_submit(u);
+	if (u->sq_submitted != u->sq_local_tail) {
+		LOGN(0, "%s: can't start receiving\n", __func__);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Library initialization, segmentation offload is not used. */
+int bxipkturing_libinit(struct bxipkt_options *o, struct bxipkt_ctx *ctx)
+{
+	int ret;
+
+	ret = bxipktudp_libinit(o, ctx);
+	if (ret == PTL_OK)
+		((struct bxipkt_udp_ctx *)ctx->priv)->gso = 0;
+
+	return ret;
+}
+
+static void bxipkturing_dump_stats(struct bxipkt_iface *iface)
+{
+	struct bxipkt_uring *u = iface->uring;
+
+	ptl_log("io_uring: enters = %lu, rx rearms = %lu, rx no buffers = %lu, tx errors = %lu, "
+		"tx in flight = %u\n",
+		u->enters, u->rx_rearms, u->rx_nobufs, u->tx_errors, u->tx_inflight);
+}
+
+void bxipkturing_done(struct bxipkt_iface *iface)
+{
+	if (iface->uring != NULL) {
+#ifdef DEBUG
+		if (bxipkt_debug >= 2 || iface->ctx->opts.stats)
+			bxipkturing_dump_stats(iface);
+#endif
+		bxipkturing_ring_done(iface);
+	}
+
+	bxipktudp_done(iface);
+}
+
+struct bxipkt_iface *bxipkturing_init(struct bxipkt_ctx *ctx, int service, int nic_iface, int uid,
+				      int pid, int nbufs, void *arg,
+				      int (*input)(void *, enum swptl_transport_status, void *,
+						   size_t, struct bximsg_hdr *, int, int, int),
+				      int (*place)(void *, struct bximsg_hdr *, int, int, size_t,
+						   struct iovec *, int),
+				      void (*output)(void *, struct bxipkt_buf *),
+				      void (*sent_pkt)(struct bxipkt_buf *pkt), int *rnid,
+				      int *rpid, int *rmtu)
+{
+	struct bxipkt_iface *iface;
+
+	iface = bxipktudp_iface_create(ctx, pid, nbufs, arg, input, place, output, sent_pkt, 0, 1);
+	if (iface == NULL)
+		return NULL;
+
+	if (!bxipkturing_ring_init(iface)) {
+		bxipkturing_done(iface);
+		return NULL;
+	}
+
+	*rnid = iface->nid;
+	*rpid = iface->pid;
+	*rmtu = iface->tx_buflist.size;
+
+	return iface;
+}
+
+/*
+ * Queue a sendmsg request per packet and submit them with a single
+ * system call. Packets are released when their request completes.
+ */
+int bxipkturing_send_batch(struct bxipkt_iface *iface, struct bxipkt_buf **bufs, int count)
+{
+	struct bxipkt_uring *u = iface->uring;
+	struct bxipkt_uring_tx *tx;
+	struct io_uring_sqe *sqe;
+	struct bxipkt_buf *b;
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		b = bufs[i];
+
+		/* processes of this node are reached through shared memory */
+		ret = bxipktudp_shm_send(iface, b);
+		if (ret == 0)
+			break;
+		if (ret > 0)
+			continue;
+
+		sqe = bxipkturing_get_sqe(u);
+		if (sqe == NULL) {
+			bxipkturing_submit(u);
+			sqe = bxipkturing_get_sqe(u);
+			if (sqe == NULL)
+				break;
+		}
+
+		tx = &u->tx[b->index];
+		bxipktudp_mkaddr(iface, &tx->addr, b->nid, b->pid);
+		tx->msg.msg_name = &tx->addr;
+		tx->msg.msg_namelen = sizeof(struct sockaddr_in);
+		tx->msg.msg_iov = tx->iov;
+		tx->msg.msg_iovlen = bxipktudp_mkiov(b, tx->iov, 1);
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = iface->sockfd;
+		sqe->addr = (uintptr_t)&tx->msg;
+		sqe->len = 1;
+		sqe->user_data = (uintptr_t)b;
+
+		u->tx_inflight++;
+	}
+
+	bxipkturing_submit(u);
+
+	LOGN(3, "%s: queued %d of %d packets\n", __func__, i, count);
+
+	return i;
+}
+
+int bxipkturing_send(struct bxipkt_iface *iface, struct bxipkt_buf *b, size_t len, int nid,
+		     int pid)
+{
+	b->size = len;
+	b->nid = nid;
+	b->pid = pid;
+
+	return bxipkturing_send_batch(iface, &b, 1);
+}
+
+int bxipkturing_send_iov(struct bxipkt_iface *iface, struct bxipkt_buf *b, int nid, int pid)
+{
+	return bxipkturing_send(iface, b, b->size, nid, pid);
+}
+
+void bxipkturing_dump(struct bxipkt_iface *iface)
+{
+	bxipktudp_dump(iface);
+	bxipkturing_dump_stats(iface);
+}
+
+int bxipkturing_pollfd(struct bxipkt_iface *iface, struct pollfd *pfds, int events)
+{
+	pfds[0].fd = iface->uring->efd;
+	pfds[0].events = POLLIN | bxipktudp_shm_events(iface, events);
+
+	return 1;
+}
+
+int bxipkturing_revents(struct bxipkt_iface *iface, struct pollfd *pfds)
+{
+	struct bxipkt_uring *u = iface->uring;
+	uint64_t count;
+
+	if (pfds[0].revents & POLLIN) {
+		if (read(u->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			LOGN(0, "%s: can't read eventfd: %s\n", __func__, strerror(errno));
+	}
+
+	/* the completion queue is in shared memory, always check it */
+	bxipkturing_cq_progress(iface);
+	bxipktudp_shm_progress(iface);
+
+	if (!u->rx_armed)
+		bxipkturing_rx_arm(iface);
+
+	bxipkturing_submit(u);
+
+	return pfds[0].revents & POLLOUT;
+}
+
+struct bxipkt_ops bxipkt_uring = { bxipkturing_libinit,  bxipktudp_libfini,
+				   bxipkturing_init,     bxipkturing_done,
+				   bxipkturing_send,     bxipkturing_send_batch,
+				   bxipkturing_send_iov, bxipktudp_send_inline,
+				   bxipktudp_getbuf,     bxipktudp_putbuf,
+				   bxipkturing_dump,     bxipktudp_nfds,
+				   bxipkturing_pollfd,   bxipkturing_revents };
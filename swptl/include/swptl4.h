@@ -49,32 +49,80 @@ struct bxipkt_udp_options {
 
 	bool default_mtu; /* Use the default MTU (ETHERMTU) */
 	const char *ip; /* IP address, must be provided */
+	uint rx_batch; /* default: BXIPKT_UDP_RX_BATCH, max datagrams per recvmmsg() call */
+	bool gso; /* default: false, use UDP segmentation offload (UDP_SEGMENT and UDP_GRO) */
+	bool shm; /* default: true, use shared memory rings for processes of the same node */
+	size_t zerocopy; /* default: BXIPKT_UDP_ZEROCOPY, min. size of datagrams sent with
+			  * MSG_ZEROCOPY, 0 disables
+			  */
+	uint rx_shards; /* default: 1, sockets receiving on the port with SO_REUSEPORT */
+	uint drop; /* default: 0, received datagrams dropped per 1000, for testing */
+	uint reorder; /* default: 0, received datagrams per 1000 processed after the next one, for
+		       * testing
+		       */
 };
 
 extern struct bxipkt_ops bxipkt_udp;
+extern struct bxipkt_ops bxipkt_uring; /* UDP through io_uring, uses bxipkt_udp_options */
+
+/* Virtual circuits, one per combination of the PTL_NI_PHYSICAL and PTL_NI_MATCHING options */
+#define BXIMSG_VC_COUNT 4
 
 struct bximsg_options {
 	int debug; /* default: 0 */
 	uint stats; /* default: 0. Can be 1 or 2 depending on the amount of stats required */
 	int max_retries; /* default: -1, -1 means INT_MAX retries */
-	int nack_max; /* default: BXIMSG_NACK_MAX, maximum of non-acked packets in flight */
-	ulong tx_timeout; /* default: BXIMSG_TX_NET_TIMEOUT, base timeout in 24-th of a microsecond
+	int nack_max; /* default: BXIMSG_NACK_MAX, maximum of non-acked packets in flight, the
+		       * congestion window grows up to it. Peers using 16-bit seq. numbers get
+		       * at most BXIMSG_SEQ16_WND_MAX
+		       */
+	ulong tx_timeout; /* default: BXIMSG_TX_NET_TIMEOUT, timeout in microseconds until the
+			   * round-trip time is measured
 			   */
 	ulong tx_timeout_max; /* default: BXIMSG_TX_NET_TIMEOUT_MAX, maximum timeout */
 	bool tx_timeout_var; /* default: true, add some randomness to the timeout */
+	uint ack_every; /* default: BXIMSG_ACK_EVERY, received packets acked at once */
+	ulong ack_delay; /* default: BXIMSG_ACK_DELAY, max. time in microseconds an ack waits for
+			  * more packets or for data to carry it, 0 disables delayed acks
+			  */
+	ulong conn_idle; /* default: BXIMSG_CONN_IDLE, time in microseconds after which an idle
+			  * connection is freed, 0 disables, at least 2 * tx_timeout_max. Must be the
+			  * same on all peers
+			  */
+	uint seq_start; /* default: 0, added to the initial sequence numbers, to test their
+			 * wraparound. Must be the same on all peers
+			 */
+	ulong interleave; /* default: BXIMSG_INTERLEAVE, bytes a message sends in a row, rounded up
+			   * to packets, before the other messages of the connection get a turn. 0
+			   * sends messages one after another
+			   */
+	uint vc_weight[BXIMSG_VC_COUNT]; /* default: 1, share of the send queue of the
+					  * connections of each virtual circuit, indexed by the
+					  * PTL_NI_PHYSICAL | PTL_NI_MATCHING bits of the NI options
+					  */
 	uint nbufs; /* default: BXIMSG_NBUFS, number of buffers per PID used by the transport layer
 		     */
 	bool wthreads; /* default: false, enable threaded memcpy */
+	bool gather; /* default: true, send payloads from user memory without copying them, if the
+		      * transport supports it
+		      */
+	bool aggregate; /* default: true, pack small messages queued for the same connection into
+			 * one packet
+			 */
 	struct bxipkt_ops *transport; /* default: UDP, this requires to set the ip as a pkt option
 				       */
 };
 
 struct swptl_options {
 	int debug; /* default: 0 */
+	size_t vm_rdv; /* default: SWPTL_VM_RDV, min. size of PUT/GET payloads moved with
+			* process_vm_readv/writev between processes of the same node, 0 disables
+			*/
 };
 
 void bximsg_options_set_default(struct bximsg_options *opts);
 void bxipkt_options_set_default(struct bxipkt_options *opts);
+void bxipkt_udp_options_set_default(struct bxipkt_udp_options *opts);
 void swptl_options_set_default(struct swptl_options *opts);
 
 struct swptl_ctx;
@@ -25,22 +25,45 @@
 #include <stdbool.h>
 #include <poll.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "swptl4.h"
 
 /*
- * Protocol layer header, must fit in 8-byte BXI header data
+ * Protocol layer header. The first 8 bytes fit in BXI header data,
+ * peers that only send them use 16-bit seq. numbers.
  */
 struct bximsg_hdr {
 	uint16_t data_seq; /* seq of this packet */
 	uint16_t ack_seq; /* seq this packet acks */
+	/*
+	 * virtual circuit in the low byte, and in the high byte the lane,
+	 * i.e. the message of the connection the packet belongs to. Lanes
+	 * other than 0 are used only if the peer sets BXIMSG_HDR_FLAG_V2,
+	 * older peers take the whole field as the virtual circuit.
+	 */
 	uint16_t vc;
+#define BXIMSG_HDR_VC(hdr) ((hdr)->vc & 0xff)
+#define BXIMSG_HDR_LANE(hdr) ((hdr)->vc >> 8)
+#define BXIMSG_HDR_VCLANE(vc, lane) ((vc) | (lane) << 8)
+#define BXIMSG_LANE_MAX 16
+#define BXIMSG_LANE_AGGR 0xff /* several whole messages, see bximsg_pkt_fill_aggr() */
 	uint8_t flags;
 #define BXIMSG_HDR_FLAG_SYN 0x01
 #define BXIMSG_HDR_FLAG_SYN_ACK 0x02
 #define BXIMSG_HDR_FLAG_NACK_RST 0x04
+#define BXIMSG_HDR_FLAG_BUSY 0x08 /* receiver out of resources, stop sending */
+#define BXIMSG_HDR_FLAG_DUPACK 0x10 /* receiver is missing packet ack_seq */
+#define BXIMSG_HDR_FLAG_EXT 0x20 /* data_seq_hi and ack_seq_hi are set */
+#define BXIMSG_HDR_FLAG_RESUME 0x40 /* sender was idle, continue with its seq. numbers */
+#define BXIMSG_HDR_FLAG_V2 0x80 /* sender handles lanes, packed packets and headers */
+
+	uint8_t sack; /* bit i set if packet ack_seq + 1 + i was received */
+#define BXIMSG_SACK_MAX 8
 
-	uint8_t __pad;
+	/* high 16 bits of the seq. numbers */
+	uint16_t data_seq_hi;
+	uint16_t ack_seq_hi;
 };
 
 enum swptl_transport_status {
@@ -49,6 +72,9 @@ enum swptl_transport_status {
 	SWPTL_TRP_NO_PID,
 };
 
+/* Max. number of payload segments gathered by send_iov() */
+#define BXIPKT_IOV_MAX 8
+
 struct bxipkt_buf {
 	struct bxipkt_buf *next;
 	struct bximsg_hdr hdr;
@@ -56,6 +82,17 @@ struct bxipkt_buf {
 	unsigned int index; /* bxipkt md index */
 	struct bximsg_conn *conn; /* packet owner */
 	int size; /* all headers included */
+	int nid, pid; /* destination, used by send_batch() */
+	int reliable; /* set by the transport if the packet can't be lost */
+	unsigned int txid; /* used by the transport to match send completions */
+	/*
+	 * If iovcnt is not zero, only the first inlen bytes of the payload
+	 * are stored in the buffer, the rest is gathered from the iov
+	 * segments when the packet is sent
+	 */
+	int inlen;
+	int iovcnt;
+	struct iovec iov[BXIPKT_IOV_MAX];
 	unsigned int is_small_pkt; /* indicate if use "small message" channel */
 	/* The number of pending memcpy, only used when sending data. */
 	volatile uint64_t send_pending_memcpy;
@@ -103,10 +140,42 @@ struct bxipkt_ops {
 	 *      pid:    pid the packet come from
 	 *      uid:    uid the packet come from
 	 *
-	 *  output: call-back invoked when packet was sent.
-	 *      Arguments are as follows:
+	 *      Returns 0 if the packet couldn't be processed, in which
+	 *      case transports that don't lose packets may deliver it
+	 *      again later, others just drop it.
+	 *
+	 *      If data is NULL, the payload was already stored at the
+	 *      location returned by the place call-back.
+	 *
+	 *  place:  call-back the transport may invoke with the header
+	 *      of a packet it's about to receive, to store its payload
+	 *      directly at its final location. Arguments are as
+	 *      follows:
 	 *
 	 *      arg:    pointer passed to bxipkt_init()
+	 *      hdr:    hdr data of the packet
+	 *      nid:    nid the packet come from
+	 *      pid:    pid the packet come from
+	 *      size:   size of the payload
+	 *      iov:    array to fill with the payload location
+	 *      iovmax: number of elements of the iov array
+	 *
+	 *      Returns the number of iov elements set, or 0 if the
+	 *      location is unknown, in which case the packet is passed
+	 *      to the input call-back as usual. Otherwise, the input
+	 *      call-back must be invoked right after the payload is
+	 *      stored, with a NULL data pointer.
+	 *
+	 *  output: call-back invoked when packet was sent and its buffer
+	 *      may be reused, possibly long after the send function
+	 *      returned. Arguments are as follows:
+	 *
+	 *      arg:    pointer passed to bxipkt_init()
+	 *
+	 *      If the transport delivered the packet through a path that
+	 *      can't lose it (ex. shared memory), it sets the reliable
+	 *      field of the buffer, and packets of the same connection
+	 *      sent through such a path are delivered in order.
 	 *
 	 *  sent_pkt: call-back invoked when a packet has been send
 	 *      Arguments are as follows:
@@ -124,9 +193,12 @@ struct bxipkt_ops {
 	 */
 	struct bxipkt_iface *(*init)(struct bxipkt_ctx *ctx, int vn, int nic_iface, int uid,
 				     int pid, int nbufs, void *arg,
-				     void (*input)(void *arg, enum swptl_transport_status status,
-						   void *data, size_t size, struct bximsg_hdr *hdr,
-						   int nid, int pid, int uid),
+				     int (*input)(void *arg, enum swptl_transport_status status,
+						  void *data, size_t size, struct bximsg_hdr *hdr,
+						  int nid, int pid, int uid),
+				     int (*place)(void *arg, struct bximsg_hdr *hdr, int nid,
+						  int pid, size_t size, struct iovec *iov,
+						  int iovmax),
 				     void (*output)(void *arg, struct bxipkt_buf *),
 				     void (*sent_pkt)(struct bxipkt_buf *pkt), int *rnid, int *rpid,
 				     int *rmtu);
@@ -154,6 +226,41 @@ struct bxipkt_ops {
 	 */
 	int (*send)(struct bxipkt_iface *iface, struct bxipkt_buf *buf, size_t len, int nid,
 		    int pid);
+
+	/*
+	 * Start sending a vector of packets, in order. Return the number
+	 * of packets sent; if less than count, the remaining packets
+	 * couldn't be sent and the caller may retry them later. May be
+	 * NULL, in which case send() is used for each packet.
+	 *
+	 *  iface:  interface that will send the packets
+	 *
+	 *  bufs:   buffers returned by bxipkt_getbuf(), with the size
+	 *      (payload length), nid and pid fields set
+	 *
+	 *  count:  number of buffers
+	 */
+	int (*send_batch)(struct bxipkt_iface *iface, struct bxipkt_buf **bufs, int count);
+
+	/*
+	 * Start sending a packet whose payload is gathered from the
+	 * buffer and the iov segments, without copying them. Return 0
+	 * if the packet couldn't be sent, in which case the caller may
+	 * retry later. May be NULL if not supported, otherwise such
+	 * packets may be passed to send_batch() as well. The segments
+	 * must stay valid until the output call-back is invoked.
+	 *
+	 *  iface:  interface that will send the packet
+	 *
+	 *  buf:    buffer structure returned by bxipkt_getbuf(), with
+	 *      the size (payload length), inlen, iovcnt and iov fields set
+	 *
+	 *  nid:    destination nid
+	 *
+	 *  pid:    destination pid
+	 */
+	int (*send_iov)(struct bxipkt_iface *iface, struct bxipkt_buf *buf, int nid, int pid);
+
 	/*
 	 * Start sending a small packet (< 64). Return 0 if the packet couldn't
 	 * be sent, in which case the caller may retry later.
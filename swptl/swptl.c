@@ -17,6 +17,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <complex.h>
 #include <errno.h>
 #include <float.h>
@@ -32,6 +36,9 @@
 #include <time.h>
 #include <stdbool.h>
 #include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "swptl.h"
 #include "bximsg.h"
@@ -61,17 +68,18 @@
 int swptl_ct_cmd(int, struct swptl_ct *, ptl_size_t, ptl_size_t);
 void swptl_snd_qstart(struct swptl_ni *, struct swptl_sodata *, struct swptl_query *);
 void swptl_snd_rstart(struct swptl_ni *, struct swptl_sodata *, struct swptl_reply *);
+static size_t swptl_hdr_getsize(struct swptl_ni *, struct swptl_sodata *);
 void swptl_snd_qdat(struct swptl_ni *, struct swptl_sodata *, size_t, void **, size_t *);
 void swptl_snd_rdat(struct swptl_ni *, struct swptl_sodata *, size_t, void **, size_t *);
 void swptl_snd_qend(struct swptl_ni *, struct swptl_sodata *, enum swptl_transport_status status);
 void swptl_snd_rend(struct swptl_ni *, struct swptl_sodata *, enum swptl_transport_status status);
 
-int swptl_rcv_qstart(struct swptl_ni *, struct swptl_query *, int, int, int, struct swptl_sodata **,
-		     size_t *);
+int swptl_rcv_qstart(struct swptl_ni *, struct swptl_query *, int, size_t, int, int, int,
+		     struct swptl_sodata **, size_t *);
 void swptl_rcv_qdat(struct swptl_ni *, struct swptl_sodata *, size_t, void **, size_t *);
 void swptl_rcv_qend(struct swptl_ni *, struct swptl_sodata *, enum swptl_transport_status status);
-int swptl_rcv_rstart(struct swptl_ni *, struct swptl_reply *, int, int, int, struct swptl_sodata **,
-		     size_t *);
+int swptl_rcv_rstart(struct swptl_ni *, struct swptl_reply *, int, size_t, int, int, int,
+		     struct swptl_sodata **, size_t *);
 void swptl_rcv_rdat(struct swptl_ni *, struct swptl_sodata *, size_t, void **, size_t *);
 void swptl_rcv_rend(struct swptl_ni *, struct swptl_sodata *, enum swptl_transport_status status);
 void swptl_tend(struct swptl_ni *, struct swptl_sodata *, enum swptl_transport_status status);
@@ -102,6 +110,7 @@ int swptl_init_count = 0;
 void swptl_options_set_default(struct swptl_options *opts)
 {
 	opts->debug = 0;
+	opts->vm_rdv = SWPTL_VM_RDV;
 }
 
 /*
@@ -132,12 +141,6 @@ void swptl_log_hex(const char *fmt, void *addr, size_t len)
 	ptl_log("%s", buf);
 }
 
-static size_t swptl_qhdr_getsize(uint8_t cmd)
-{
-	return (cmd == SWPTL_SWAP) ? offsetof(struct swptl_hdr, u) + sizeof(struct swptl_query) :
-				     offsetof(struct swptl_hdr, u.query.swapcst);
-}
-
 /*
  * Print an array of one of the given atomic types
  */
@@ -353,6 +356,176 @@ size_t swptl_iovlen(void *base, int iovcnt)
 	return len;
 }
 
+/*
+ * Move len bytes between the given buffer (possibly an iovec) and the
+ * rendezvous buffer of another process, with process_vm_writev() if
+ * write is set, else with process_vm_readv(). Return -1 on failure.
+ */
+static int swptl_vm_copy(struct swptl_rdv *rdv, void *base, int iovcnt, size_t offs, size_t len,
+			 int write)
+{
+#define SWPTL_VM_IOV_MAX 64
+	struct iovec liov[SWPTL_VM_IOV_MAX], riov;
+	size_t done, todo, size;
+	void *data;
+	ssize_t n;
+	int cnt;
+
+	done = 0;
+	while (done < len) {
+		todo = 0;
+		for (cnt = 0; cnt < SWPTL_VM_IOV_MAX && done + todo < len; cnt++) {
+			swptl_iovseg(base, iovcnt, offs + done + todo, len - done - todo, &data,
+				     &size);
+			liov[cnt].iov_base = data;
+			liov[cnt].iov_len = size;
+			todo += size;
+		}
+		riov.iov_base = (void *)(uintptr_t)(rdv->addr + done);
+		riov.iov_len = todo;
+
+		if (write)
+			n = process_vm_writev(rdv->ospid, liov, cnt, &riov, 1, 0);
+		else
+			n = process_vm_readv(rdv->ospid, liov, cnt, &riov, 1, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			LOGN(2, "%s: %u: %zu bytes at 0x%lx: %s\n", __func__, rdv->ospid, todo,
+			     rdv->addr + done, n < 0 ? strerror(errno) : "no progress");
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Check that the rendezvous buffer of another process is accessible
+ */
+static int swptl_vm_probe(struct swptl_rdv *rdv)
+{
+	char c;
+
+	return swptl_vm_copy(rdv, &c, -1, 0, 1, 0);
+}
+
+/*
+ * Build the address of the abstract unix socket of the process with the
+ * given portals nid and pid, return its length
+ */
+static socklen_t swptl_rdv_addr(struct sockaddr_un *addr, int nid, int pid)
+{
+	int len;
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "swptl-rdv-%d-%d", nid,
+		       pid);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*
+ * Listen on the rendezvous socket of the given device. Targets connect
+ * to it to get our OS pid with SO_PEERCRED, which is set by the kernel,
+ * so a peer can't make them access the memory of another process.
+ */
+static int swptl_rdv_listen(struct swptl_dev *dev)
+{
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	len = swptl_rdv_addr(&addr, dev->nid, dev->pid);
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Close the connections of the targets, they only needed our pid
+ */
+static void swptl_rdv_accept(struct swptl_dev *dev)
+{
+	int fd;
+
+	while ((fd = accept(dev->rdv_fd, NULL, NULL)) >= 0)
+		close(fd);
+}
+
+/*
+ * Return the OS pid of the peer of the given connection, as vouched by
+ * the kernel, or -1 if it's not available (ex. rendezvous disabled or
+ * other pid namespace). It's kept until the peer restarts.
+ */
+static int swptl_rdv_ospid(struct bximsg_conn *conn)
+{
+	struct sockaddr_un addr;
+	struct ucred cred;
+	socklen_t len;
+	int fd, rc;
+
+	if (conn->ospid > 0)
+		return conn->ospid;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	len = swptl_rdv_addr(&addr, conn->nid, conn->pid);
+	rc = connect(fd, (struct sockaddr *)&addr, len);
+	if (rc == 0) {
+		len = sizeof(cred);
+		rc = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+	}
+	close(fd);
+	if (rc < 0) {
+		LOGN(2, "%s: %d, %d: %s\n", __func__, conn->nid, conn->pid, strerror(errno));
+		return -1;
+	}
+
+	/* the pid is 0 if the peer is not in our pid namespace */
+	if (cred.pid <= 0)
+		return -1;
+	conn->ospid = cred.pid;
+	return conn->ospid;
+}
+
+/*
+ * Return the SWPTL_HDR_xxx flags of the given query. Large PUT and GET
+ * payloads from or to contiguous MDs are not sent to processes of the
+ * same node; instead the target moves them with process_vm_readv/writev,
+ * unless it told us it can't.
+ */
+static int swptl_qflags(struct swptl_ni *ni, struct swptl_sodata *f)
+{
+	struct swptl_ictx *ctx = &f->u.ictx;
+	struct swptl_md *md;
+
+	/* the flags are sent only in packed headers */
+	if (ni->dev->vm_rdv == 0 || ctx->rlen < ni->dev->vm_rdv || f->conn->nid != ni->dev->nid ||
+	    !f->conn->v2 || f->conn->rdv_nak)
+		return 0;
+
+	switch (ctx->cmd) {
+	case SWPTL_PUT:
+		md = ctx->put_md;
+		break;
+	case SWPTL_GET:
+		md = ctx->get_md;
+		break;
+	default:
+		return 0;
+	}
+	return md->niov < 0 ? SWPTL_HDR_RDV : 0;
+}
+
 /*
  * copy volatile data
  */
@@ -424,9 +597,9 @@ int swptl_msgunev(int cmd)
 }
 
 /*
- * Return the size in bytes of the given atomic type.
+ * Return the size in bytes of the given atomic type, or 0 if it's unknown
  */
-int ptl_atsize(ptl_datatype_t atype)
+static int swptl_atsize(int atype)
 {
 	switch (atype) {
 	case PTL_INT8_T:
@@ -454,9 +627,269 @@ int ptl_atsize(ptl_datatype_t atype)
 	case PTL_LONG_DOUBLE_COMPLEX:
 		return sizeof(long double complex);
 	default:
+		return 0;
+	}
+}
+
+/*
+ * Return the size in bytes of the given atomic type.
+ */
+int ptl_atsize(ptl_datatype_t atype)
+{
+	int size;
+
+	size = swptl_atsize(atype);
+	if (size == 0)
 		ptl_panic("ptl_atsize: unknown type\n");
-		return 0; /* Suppress compilation warning */
+	return size;
+}
+
+/*
+ * Bits of the first byte of a packed header: the type, the flags, and
+ * the optional fields present, the others are zero. The marker tells
+ * it apart from the legacy layout, which starts with SWPTL_QUERY or
+ * SWPTL_REPLY.
+ */
+#define SWPTL_PACK_TYPE 0x01
+#define SWPTL_PACK_FLAGS_SHIFT 1
+#define SWPTL_PACK_FLAGS 0x06
+#define SWPTL_PACK_MEOFFS 0x08
+#define SWPTL_PACK_BITS 0x10
+#define SWPTL_PACK_HDR_DATA 0x20
+#define SWPTL_PACK_ATOMIC 0x40 /* aop, atype, and swapcst of swaps */
+#define SWPTL_PACK_MARK 0x80
+
+static unsigned char *swptl_varint_put(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/*
+ * Decode a varint, return NULL if it doesn't end before the given limit
+ */
+static const unsigned char *swptl_varint_get(const unsigned char *p, const unsigned char *end,
+					     uint64_t *rv)
+{
+	uint64_t v = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*rv = v;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Return the size of the given header in the legacy layout
+ */
+static size_t swptl_hdr_legacy_size(struct swptl_hdr *hdr)
+{
+	if (hdr->type == SWPTL_REPLY)
+		return offsetof(struct swptl_hdr, u) + sizeof(struct swptl_reply);
+	/* swapcst and its padding end the layout */
+	if (hdr->u.query.cmd == SWPTL_SWAP)
+		return offsetof(struct swptl_hdr, u.query.rdv);
+	return offsetof(struct swptl_hdr, u.query.swapcst);
+}
+
+/*
+ * Return true if the given received query has a known command, a known
+ * type if it's an atomic, and the rendezvous flag only if it's a PUT or
+ * a GET
+ */
+static int swptl_query_valid(struct swptl_query *query, int flags)
+{
+	if (query->cmd >= SWPTL_CMD_COUNT)
+		return 0;
+	if ((flags & SWPTL_HDR_RDV) && query->cmd != SWPTL_PUT && query->cmd != SWPTL_GET)
+		return 0;
+	return !SWPTL_ISATOMIC(query->cmd) || swptl_atsize(query->atype) != 0;
+}
+
+/*
+ * Store the given header in the given buffer of at least SWPTL_HDR_MAX
+ * bytes, return its size. If packed, zero fields aren't sent, and the
+ * integers are varints, so a small PUT takes about 10 bytes. Otherwise
+ * the legacy layout is used.
+ */
+static size_t swptl_hdr_pack(struct swptl_hdr *hdr, int packed, unsigned char *buf)
+{
+	struct swptl_query *query = &hdr->u.query;
+	struct swptl_reply *reply = &hdr->u.reply;
+	unsigned char *p = buf + 1;
+	size_t size;
+
+	if (!packed) {
+		size = swptl_hdr_legacy_size(hdr);
+		memcpy(buf, hdr, size);
+		memset(buf + 1, 0, offsetof(struct swptl_hdr, u) - 1);
+		return size;
+	}
+
+	buf[0] = SWPTL_PACK_MARK | (hdr->type == SWPTL_REPLY ? SWPTL_PACK_TYPE : 0) |
+		 (hdr->flags << SWPTL_PACK_FLAGS_SHIFT & SWPTL_PACK_FLAGS);
+
+	if (hdr->type == SWPTL_REPLY) {
+		*p++ = reply->ack;
+		*p++ = reply->list;
+		p = swptl_varint_put(p, reply->fail);
+		p = swptl_varint_put(p, reply->serial);
+		p = swptl_varint_put(p, reply->cookie);
+		p = swptl_varint_put(p, reply->mlen);
+		if (reply->meoffs != 0) {
+			buf[0] |= SWPTL_PACK_MEOFFS;
+			p = swptl_varint_put(p, reply->meoffs);
+		}
+		return p - buf;
+	}
+
+	*p++ = query->cmd | query->ack << 4;
+	*p++ = query->pte;
+	p = swptl_varint_put(p, query->serial);
+	p = swptl_varint_put(p, query->cookie);
+	p = swptl_varint_put(p, query->rlen);
+	if (query->meoffs != 0) {
+		buf[0] |= SWPTL_PACK_MEOFFS;
+		p = swptl_varint_put(p, query->meoffs);
+	}
+	if (query->bits != 0) {
+		buf[0] |= SWPTL_PACK_BITS;
+		p = swptl_varint_put(p, query->bits);
+	}
+	if (query->hdr_data != 0) {
+		buf[0] |= SWPTL_PACK_HDR_DATA;
+		p = swptl_varint_put(p, query->hdr_data);
+	}
+	if (SWPTL_ISATOMIC(query->cmd)) {
+		buf[0] |= SWPTL_PACK_ATOMIC;
+		*p++ = query->aop;
+		*p++ = query->atype;
+		if (query->cmd == SWPTL_SWAP) {
+			memcpy(p, query->swapcst, swptl_atsize(query->atype));
+			p += swptl_atsize(query->atype);
+		}
+	}
+	if (hdr->flags & SWPTL_HDR_RDV) {
+		memcpy(p, &query->rdv.addr, sizeof(query->rdv.addr));
+		p += sizeof(query->rdv.addr);
+	}
+	return p - buf;
+}
+
+/*
+ * Decode the header in the legacy layout in the given buffer, return
+ * its size, or 0 if it's truncated or invalid
+ */
+static size_t swptl_hdr_unpack_legacy(struct swptl_hdr *hdr, const unsigned char *buf,
+				      size_t size)
+{
+	size_t hdrsize;
+
+	if (buf[0] != SWPTL_QUERY && buf[0] != SWPTL_REPLY)
+		return 0;
+
+	memset(hdr, 0, sizeof(struct swptl_hdr));
+	memcpy(hdr, buf, size < sizeof(struct swptl_hdr) ? size : sizeof(struct swptl_hdr));
+	hdrsize = swptl_hdr_legacy_size(hdr);
+	if (size < hdrsize)
+		return 0;
+	memset((unsigned char *)hdr + hdrsize, 0, sizeof(struct swptl_hdr) - hdrsize);
+
+	/* the flags byte is padding for older peers */
+	hdr->flags = 0;
+	if (hdr->type == SWPTL_QUERY && !swptl_query_valid(&hdr->u.query, hdr->flags))
+		return 0;
+	return hdrsize;
+}
+
+/*
+ * Decode the header in the given buffer, packed or not, return its
+ * size, or 0 if it's truncated or invalid
+ */
+static size_t swptl_hdr_unpack(struct swptl_hdr *hdr, const unsigned char *buf, size_t size,
+			       int *packed)
+{
+	struct swptl_query *query = &hdr->u.query;
+	struct swptl_reply *reply = &hdr->u.reply;
+	const unsigned char *p = buf + 3, *end = buf + size;
+	uint64_t v[4];
+	int i, n;
+
+	if (size < 1)
+		return 0;
+	*packed = (buf[0] & SWPTL_PACK_MARK) != 0;
+	if (!*packed)
+		return swptl_hdr_unpack_legacy(hdr, buf, size);
+	if (size < 3)
+		return 0;
+
+	memset(hdr, 0, sizeof(struct swptl_hdr));
+	hdr->type = (buf[0] & SWPTL_PACK_TYPE) ? SWPTL_REPLY : SWPTL_QUERY;
+	hdr->flags = (buf[0] & SWPTL_PACK_FLAGS) >> SWPTL_PACK_FLAGS_SHIFT;
+
+	/* fields always present */
+	n = hdr->type == SWPTL_REPLY ? 4 : 3;
+	for (i = 0; i < n; i++) {
+		p = swptl_varint_get(p, end, &v[i]);
+		if (p == NULL)
+			return 0;
+	}
+
+	if (hdr->type == SWPTL_REPLY) {
+		reply->ack = buf[1];
+		reply->list = buf[2];
+		reply->fail = v[0];
+		reply->serial = v[1];
+		reply->cookie = v[2];
+		reply->mlen = v[3];
+		if ((buf[0] & SWPTL_PACK_MEOFFS) && (p = swptl_varint_get(p, end, &reply->meoffs)) == NULL)
+			return 0;
+		return p - buf;
+	}
+
+	query->cmd = buf[1] & 0xf;
+	query->ack = buf[1] >> 4;
+	query->pte = buf[2];
+	query->serial = v[0];
+	query->cookie = v[1];
+	query->rlen = v[2];
+	if ((buf[0] & SWPTL_PACK_MEOFFS) && (p = swptl_varint_get(p, end, &query->meoffs)) == NULL)
+		return 0;
+	if ((buf[0] & SWPTL_PACK_BITS) && (p = swptl_varint_get(p, end, &query->bits)) == NULL)
+		return 0;
+	if ((buf[0] & SWPTL_PACK_HDR_DATA) &&
+	    (p = swptl_varint_get(p, end, &query->hdr_data)) == NULL)
+		return 0;
+	if (buf[0] & SWPTL_PACK_ATOMIC) {
+		if (end - p < 2)
+			return 0;
+		query->aop = *p++;
+		query->atype = *p++;
+		if (query->cmd == SWPTL_SWAP) {
+			if (swptl_atsize(query->atype) == 0 || end - p < swptl_atsize(query->atype))
+				return 0;
+			memcpy(query->swapcst, p, swptl_atsize(query->atype));
+			p += swptl_atsize(query->atype);
+		}
 	}
+	if (!swptl_query_valid(query, hdr->flags))
+		return 0;
+	if (hdr->flags & SWPTL_HDR_RDV) {
+		if (end - p < sizeof(query->rdv.addr))
+			return 0;
+		memcpy(&query->rdv.addr, p, sizeof(query->rdv.addr));
+		p += sizeof(query->rdv.addr);
+	}
+	return p - buf;
 }
 
 /*
@@ -1274,6 +1707,7 @@ void swptl_trig(struct swptl_ni *ni)
 			sodata->u.ictx = trig->u.tx.ictx;
 			sodata->conn = bximsg_getconn(ni->dev->iface, trig->u.tx.nid,
 						      trig->u.tx.pid, ni->vc);
+			bximsg_conn_ref(sodata->conn);
 
 			/*
 			 * If rank is not set (i.e. setmap() not called when
@@ -1291,9 +1725,12 @@ void swptl_trig(struct swptl_ni *ni)
 
 			ctx = &sodata->u.ictx;
 			swptl_volmove(ctx);
-			sodata->hdrsize = swptl_qhdr_getsize(ctx->cmd);
+			sodata->flags = swptl_qflags(ni, sodata);
+			sodata->hdrsize = swptl_hdr_getsize(ni, sodata);
 			bximsg_enqueue(ni->dev->iface, sodata,
-				       SWPTL_ISPUT(sodata->u.ictx.cmd) ? sodata->u.ictx.rlen : 0);
+				       SWPTL_ISPUT(ctx->cmd) && !(sodata->flags & SWPTL_HDR_RDV) ?
+					       ctx->rlen :
+					       0);
 			LOGN(2,
 			     "%s: %u: triggered %zd byte %s query (%d, %d) "
 			     "-> (%d, %d), ictx = %zu\n",
@@ -1639,6 +2076,7 @@ int swptl_dev_new(struct swptl_ctx *ctx, int nic_iface, int uid, int pid, size_t
 		  struct swptl_dev **out)
 {
 	struct swptl_dev *dev, **pdev;
+	struct swptl_rdv self;
 	int cnt;
 
 	ptl_mutex_lock(&ctx->init_mutex, __func__);
@@ -1656,12 +2094,32 @@ int swptl_dev_new(struct swptl_ctx *ctx, int nic_iface, int uid, int pid, size_t
 
 	dev->nic_iface = nic_iface;
 	dev->rdv_put = rdv_put;
+	dev->vm_rdv = ctx->opts.vm_rdv;
+	if (dev->vm_rdv != 0) {
+		/* process_vm_readv() may be missing or forbidden (ex. seccomp) */
+		self.addr = (uintptr_t)&self;
+		self.ospid = getpid();
+		if (swptl_vm_probe(&self) < 0) {
+			LOG("%s: process_vm_readv() not usable, rendezvous disabled\n", __func__);
+			dev->vm_rdv = 0;
+		}
+	}
 	dev->ctx = ctx;
 	dev->iface = bximsg_init(&ctx->msg_ctx, dev, &swptl_bximsg_ops, nic_iface, uid, pid,
 				 &dev->nid, &dev->pid);
 	if (dev->iface == NULL)
 		goto fail_free;
 
+	dev->rdv_fd = -1;
+	if (dev->vm_rdv != 0) {
+		dev->rdv_fd = swptl_rdv_listen(dev);
+		if (dev->rdv_fd < 0) {
+			LOG("%s: can't listen on rendezvous socket, rendezvous disabled\n",
+			    __func__);
+			dev->vm_rdv = 0;
+		}
+	}
+
 	memset(dev->nis, 0, sizeof(dev->nis));
 	dev->uid = uid;
 
@@ -1692,6 +2150,8 @@ int swptl_dev_new(struct swptl_ctx *ctx, int nic_iface, int uid, int pid, size_t
 fail_mutex_free:
 	pthread_mutex_destroy(&dev->lock);
 fail_iface_free:
+	if (dev->rdv_fd >= 0)
+		close(dev->rdv_fd);
 	bximsg_done(dev->iface);
 fail_free:
 	xfree(dev);
@@ -1714,6 +2174,8 @@ void swptl_dev_del(struct swptl_dev *dev)
 	ptl_mutex_unlock(&dev->lock, __func__);
 
 	pthread_mutex_destroy(&dev->lock);
+	if (dev->rdv_fd >= 0)
+		close(dev->rdv_fd);
 
 	LOGN(2, "%s: nid = %d, pid = %d\n", __func__, dev->nid, dev->pid);
 	xfree(dev);
@@ -2292,6 +2754,7 @@ int swptl_cmd(int cmd, struct swptl_ni *ni, struct swptl_md *get_md, ptl_size_t
 		sodata = pool_get(&ni->ictx_pool);
 		sodata->init = 1;
 		sodata->conn = bximsg_getconn(ni->dev->iface, nid, pid, ni->vc);
+		bximsg_conn_ref(sodata->conn);
 
 		/*
 		 * If rank is not set (i.e. setmap() not called when
@@ -2303,6 +2766,8 @@ int swptl_cmd(int cmd, struct swptl_ni *ni, struct swptl_md *get_md, ptl_size_t
 			sodata->conn->rank = swptl_ni_p2l(ni, sodata->conn->nid, sodata->conn->pid);
 			if (sodata->conn->rank == -1) {
 				LOGN(2, "%s: rank not set\n", __func__);
+				bximsg_conn_unref(sodata->conn);
+				pool_put(&ni->ictx_pool, sodata);
 				return 0;
 			}
 		}
@@ -2366,6 +2831,7 @@ int swptl_cmd(int cmd, struct swptl_ni *ni, struct swptl_md *get_md, ptl_size_t
 			swptl_postack(ctx->put_md, PTL_EVENT_SEND, PTL_NI_SEGV, 0, ctx->rlen, 0,
 				      ctx->uptr);
 			LOGN(2, "%s: %u: tx transfer complete\n", __func__, ctx->serial);
+			bximsg_conn_unref(sodata->conn);
 			pool_put(&ni->ictx_pool, sodata);
 			return 1;
 		}
@@ -2380,6 +2846,7 @@ int swptl_cmd(int cmd, struct swptl_ni *ni, struct swptl_md *get_md, ptl_size_t
 			swptl_postack(ctx->get_md, PTL_EVENT_REPLY, PTL_NI_SEGV, 0, ctx->rlen, 0,
 				      ctx->uptr);
 			LOGN(2, "%s: %u: tx transfer complete\n", __func__, ctx->serial);
+			bximsg_conn_unref(sodata->conn);
 			pool_put(&ni->ictx_pool, sodata);
 			return 1;
 		}
@@ -2395,10 +2862,12 @@ int swptl_cmd(int cmd, struct swptl_ni *ni, struct swptl_md *get_md, ptl_size_t
 	if (trig_ct)
 		swptl_trig(ni);
 	else {
-		sodata->hdrsize = swptl_qhdr_getsize(ctx->cmd);
+		sodata->flags = swptl_qflags(ni, sodata);
+		sodata->hdrsize = swptl_hdr_getsize(ni, sodata);
 		swptl_volmove(ctx);
 		swptl_ctx_add(&ni->txops, sodata);
-		bximsg_enqueue(ni->dev->iface, sodata, SWPTL_ISPUT(cmd) ? len : 0);
+		bximsg_enqueue(ni->dev->iface, sodata,
+			       SWPTL_ISPUT(cmd) && !(sodata->flags & SWPTL_HDR_RDV) ? len : 0);
 		LOGN(2, "%s: %u: %zd byte %s query (%d, %d) -> (%d, %d), ictx = %zu\n", __func__,
 		     ctx->serial, ctx->rlen, swptl_cmdname[ctx->cmd], ni->dev->nid, ni->dev->pid,
 		     sodata->conn->nid, sodata->conn->pid,
@@ -2427,6 +2896,13 @@ void swptl_iend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_transpor
 		break;
 	}
 
+	/* with rendezvous, the buffer may be reused only once the target replied */
+	if (ctx->cmd == SWPTL_PUT && (f->flags & SWPTL_HDR_RDV)) {
+		swptl_postack(ctx->put_md, PTL_EVENT_SEND,
+			      status == SWPTL_TRP_OK ? PTL_NI_OK : PTL_NI_UNDELIVERABLE, 0,
+			      ctx->rlen, 0, ctx->uptr);
+	}
+
 	if (SWPTL_ISPUT(ctx->cmd))
 		ctx->put_md->refs--;
 
@@ -2462,6 +2938,7 @@ void swptl_iend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_transpor
 	LOGN(2, "%s: %u: tx transfer complete: %s\n", __func__, ctx->serial,
 	     status != SWPTL_TRP_OK ? "failed" : "ok");
 	swptl_ctx_rm(&ni->txops, f);
+	bximsg_conn_unref(f->conn);
 	pool_put(&ni->ictx_pool, f);
 	ni->txcnt++;
 }
@@ -2486,9 +2963,15 @@ void swptl_snd_qstart(struct swptl_ni *ni, struct swptl_sodata *f, struct swptl_
 	query->atype = ctx->atype;
 	query->ack = ctx->ack;
 	query->pte = ctx->pte;
-	f->hdrsize = swptl_qhdr_getsize(ctx->cmd);
 	if (ctx->cmd == SWPTL_SWAP)
 		memcpy(query->swapcst, ctx->swapcst, sizeof(query->swapcst));
+	if (f->flags & SWPTL_HDR_RDV) {
+		if (ctx->cmd == SWPTL_PUT)
+			query->rdv.addr = (uintptr_t)(ctx->put_md->buf + ctx->put_mdoffs);
+		else
+			query->rdv.addr = (uintptr_t)(ctx->get_md->buf + ctx->get_mdoffs);
+		swptl_rdv_accept(ni->dev);
+	}
 }
 
 /*
@@ -2533,7 +3016,7 @@ void swptl_snd_qend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_tran
 	LOGN(2, "%s: %u: query complete, %s\n", __func__, ctx->serial,
 	     status != SWPTL_TRP_OK ? "failed" : "ok");
 
-	if (SWPTL_ISPUT(ctx->cmd) && !SWPTL_ISVOLATILE(ctx)) {
+	if (SWPTL_ISPUT(ctx->cmd) && !SWPTL_ISVOLATILE(ctx) && !(f->flags & SWPTL_HDR_RDV)) {
 		int ptl_rc;
 
 		switch (status) {
@@ -2550,7 +3033,9 @@ void swptl_snd_qend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_tran
 		swptl_postack(ctx->put_md, PTL_EVENT_SEND, ptl_rc, 0, ctx->rlen, 0, ctx->uptr);
 	}
 
-	if (status != SWPTL_TRP_OK || (!SWPTL_ISGET(ctx->cmd) && ctx->ack == PTL_NO_ACK_REQ))
+	/* rendezvous queries are always replied to */
+	if (status != SWPTL_TRP_OK ||
+	    (!SWPTL_ISGET(ctx->cmd) && ctx->ack == PTL_NO_ACK_REQ && f->flags == 0))
 		swptl_iend(ni, f, status);
 }
 
@@ -2558,8 +3043,8 @@ void swptl_snd_qend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_tran
  * Called by the network layer whenever a query header was just
  * received.  Prepare to receive the payload, if any.
  */
-int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int nid, int pid, int uid,
-		     struct swptl_sodata **pctx, size_t *rsize)
+int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int flags, size_t hdrsize,
+		     int nid, int pid, int uid, struct swptl_sodata **pctx, size_t *rsize)
 {
 	struct swptl_sodata *f;
 	struct swptl_tctx *ctx;
@@ -2568,7 +3053,7 @@ int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int nid, in
 	struct poolent *ev;
 	struct pool *ev_pool;
 	size_t avail;
-	int i, nev;
+	int i, nev, ospid;
 
 	if (pool_isempty(&ni->tctx_pool)) {
 		LOGN(2, "%s: out of pool enties\n", __func__);
@@ -2577,7 +3062,9 @@ int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int nid, in
 
 	f = *pctx = pool_get(&ni->tctx_pool);
 	f->init = 0;
+	f->flags = 0;
 	f->conn = bximsg_getconn(ni->dev->iface, nid, pid, ni->vc);
+	bximsg_conn_ref(f->conn);
 
 	/*
 	 * If rank is not set (i.e. setmap() not called when
@@ -2589,6 +3076,9 @@ int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int nid, in
 		f->conn->rank = swptl_ni_p2l(ni, nid, pid);
 		if (f->conn->rank == -1) {
 			LOGN(2, "%s: rank not set\n", __func__);
+			bximsg_conn_unref(f->conn);
+			pool_put(&ni->tctx_pool, f);
+			*pctx = NULL;
 			return 0;
 		}
 	}
@@ -2606,7 +3096,7 @@ int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int nid, in
 	ctx->cmd = query->cmd;
 	ctx->aop = query->aop;
 	ctx->atype = query->atype;
-	ctx->pte = ni->pte[query->pte];
+	ctx->pte = query->pte <= ni->npte ? ni->pte[query->pte] : NULL;
 	ctx->rlen = query->rlen;
 	ctx->hdr_data = query->hdr_data;
 	ctx->query_meoffs = query->meoffs;
@@ -2616,13 +3106,31 @@ int swptl_rcv_qstart(struct swptl_ni *ni, struct swptl_query *query, int nid, in
 	ctx->unex = NULL;
 	ctx->evs = NULL;
 	ctx->me = NULL;
-	f->hdrsize = swptl_qhdr_getsize(ctx->cmd);
+	f->hdrsize = hdrsize;
 	if (ctx->cmd == SWPTL_SWAP)
 		memcpy(ctx->swapcst, query->swapcst, sizeof(ctx->swapcst));
 	swptl_ctx_add(&ni->rxops, f);
 
 	*rsize = SWPTL_ISPUT(ctx->cmd) ? ctx->rlen : 0;
 
+	if (flags & SWPTL_HDR_RDV) {
+		/*
+		 * Only the initiator buffer address was sent. Check
+		 * we can access it before matching, otherwise the
+		 * initiator must resend the query with its payload.
+		 */
+		*rsize = 0;
+		ospid = swptl_rdv_ospid(f->conn);
+		ctx->rdv.addr = query->rdv.addr;
+		ctx->rdv.ospid = ospid;
+		if (ospid < 0 || swptl_vm_probe(&ctx->rdv) < 0) {
+			LOGN(2, "%s: %u: can't access initiator memory\n", __func__, ctx->serial);
+			f->flags = SWPTL_HDR_RDV_NAK;
+			return 1;
+		}
+		f->flags = SWPTL_HDR_RDV;
+	}
+
 	if (ctx->pte == NULL) {
 		/*
 		 * According to the Portals4 specification, the PTL_NI_UNDELIVERABLE
@@ -2886,7 +3394,17 @@ void swptl_rcv_qend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_tran
 		}
 	}
 
-	if (status != SWPTL_TRP_OK || (!SWPTL_ISGET(ctx->cmd) && ctx->ack == PTL_NO_ACK_REQ)) {
+	if (status == SWPTL_TRP_OK && (f->flags & SWPTL_HDR_RDV) && ctx->mlen > 0) {
+		LOGN(2, "%s: %u: %s %zu bytes of process %u\n", __func__, ctx->serial,
+		     SWPTL_ISGET(ctx->cmd) ? "writing" : "reading", ctx->mlen, ctx->rdv.ospid);
+		if (swptl_vm_copy(&ctx->rdv, ctx->me->buf, ctx->me->niov, ctx->reply_meoffs,
+				  ctx->mlen, SWPTL_ISGET(ctx->cmd)) < 0)
+			ctx->fail = PTL_NI_UNDELIVERABLE;
+	}
+
+	/* rendezvous queries are always replied to, the initiator waits for us */
+	if (status != SWPTL_TRP_OK ||
+	    (!SWPTL_ISGET(ctx->cmd) && ctx->ack == PTL_NO_ACK_REQ && f->flags == 0)) {
 		swptl_tend(ni, f, status);
 		return;
 	}
@@ -2895,8 +3413,8 @@ void swptl_rcv_qend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_tran
 		ctx->ack = PTL_NO_ACK_REQ;
 
 	/* build reply message header */
-	f->hdrsize = offsetof(struct swptl_hdr, u) + sizeof(struct swptl_reply);
-	bximsg_enqueue(ni->dev->iface, f, SWPTL_ISGET(ctx->cmd) ? ctx->mlen : 0);
+	f->hdrsize = swptl_hdr_getsize(ni, f);
+	bximsg_enqueue(ni->dev->iface, f, SWPTL_ISGET(ctx->cmd) && f->flags == 0 ? ctx->mlen : 0);
 }
 
 /*
@@ -2919,32 +3437,57 @@ void swptl_snd_rstart(struct swptl_ni *ni, struct swptl_sodata *f, struct swptl_
 	reply->ack = ctx->ack;
 }
 
+/*
+ * Return the size of the header of the given message, which must not
+ * change until it's sent. Queries are packed if the peer handles it,
+ * replies are in the layout of their query.
+ */
+static size_t swptl_hdr_getsize(struct swptl_ni *ni, struct swptl_sodata *f)
+{
+	unsigned char buf[SWPTL_HDR_MAX];
+	struct swptl_hdr hdr;
+
+	hdr.flags = f->flags;
+	if (f->init) {
+		f->hdrpack = f->conn->v2;
+		hdr.type = SWPTL_QUERY;
+		swptl_snd_qstart(ni, f, &hdr.u.query);
+	} else {
+		hdr.type = SWPTL_REPLY;
+		swptl_snd_rstart(ni, f, &hdr.u.reply);
+	}
+	return swptl_hdr_pack(&hdr, f->hdrpack, buf);
+}
+
 bool swptl_transport_make_error_reply(void *input_hdr, size_t input_len, void *rsp, size_t *rsp_len)
 {
-	struct swptl_hdr *hdr = input_hdr;
-	struct swptl_hdr *rsp_hdr = rsp;
-	size_t rsp_hdr_size = offsetof(struct swptl_hdr, u) + sizeof(struct swptl_reply);
+	unsigned char buf[SWPTL_HDR_MAX];
+	struct swptl_hdr hdr, rsp_hdr;
+	size_t rsp_hdr_size;
+	int packed;
 
-	if (hdr->type == SWPTL_REPLY)
-		/* Errors for replies not handled */
+	if (swptl_hdr_unpack(&hdr, input_hdr, input_len, &packed) == 0)
 		return false;
 
-	if (input_len < rsp_hdr_size)
+	if (hdr.type == SWPTL_REPLY)
+		/* Errors for replies not handled */
 		return false;
 
+	/* All other fields will be ignored because the transport layer will raise an error */
+	memset(&rsp_hdr, 0, sizeof(rsp_hdr));
+	rsp_hdr.type = SWPTL_REPLY;
+	rsp_hdr.u.reply.cookie = hdr.u.query.cookie;
+	rsp_hdr.u.reply.serial = hdr.u.query.serial;
+	rsp_hdr.u.reply.ack = hdr.u.query.ack;
+	rsp_hdr_size = swptl_hdr_pack(&rsp_hdr, packed, buf);
+
 	if (*rsp_len < rsp_hdr_size)
 		/* Not enough space in the response */
 		return false;
 
+	memcpy(rsp, buf, rsp_hdr_size);
 	*rsp_len = rsp_hdr_size;
 
-	/* All other fields will be ignored because the transport layer will raise an error */
-	memset(rsp_hdr, 0, rsp_hdr_size);
-	rsp_hdr->type = SWPTL_REPLY;
-	rsp_hdr->u.reply.cookie = hdr->u.query.cookie;
-	rsp_hdr->u.reply.serial = hdr->u.query.serial;
-	rsp_hdr->u.reply.ack = hdr->u.query.ack;
-
 	return true;
 }
 
@@ -3076,6 +3619,7 @@ end:
 	LOGN(2, "%s: %u: rx transfer complete, %s\n", __func__, ctx->serial,
 	     status != SWPTL_TRP_OK ? "failed" : "ok");
 	swptl_ctx_rm(&ni->rxops, f);
+	bximsg_conn_unref(f->conn);
 	pool_put(&ni->tctx_pool, f);
 	ni->rxcnt++;
 }
@@ -3106,8 +3650,8 @@ void swptl_conn_err(void *arg, struct bximsg_conn *conn)
 /*
  * Called from the network layer when a reply header was received.
  */
-int swptl_rcv_rstart(struct swptl_ni *ni, struct swptl_reply *reply, int nid, int pid, int uid,
-		     struct swptl_sodata **pctx, size_t *rsize)
+int swptl_rcv_rstart(struct swptl_ni *ni, struct swptl_reply *reply, int flags, size_t hdrsize,
+		     int nid, int pid, int uid, struct swptl_sodata **pctx, size_t *rsize)
 {
 	struct swptl_sodata *f;
 	struct swptl_ictx *ctx;
@@ -3119,7 +3663,7 @@ int swptl_rcv_rstart(struct swptl_ni *ni, struct swptl_reply *reply, int nid, in
 	if (reply->cookie >= SWPTL_ICTX_COUNT)
 		ptl_panic("%d: bad reply cookie %p\n", reply->serial, reply);
 	f = *pctx = (struct swptl_sodata *)ni->ictx_pool.data + reply->cookie;
-	f->hdrsize = offsetof(struct swptl_hdr, u) + sizeof(struct swptl_reply);
+	f->hdrsize = hdrsize;
 	ctx = &f->u.ictx;
 
 	if (ctx->serial != reply->serial)
@@ -3143,7 +3687,9 @@ int swptl_rcv_rstart(struct swptl_ni *ni, struct swptl_reply *reply, int nid, in
 	if (ctx->ack == PTL_ACK_REQ && reply->ack == PTL_NO_ACK_REQ)
 		ctx->ack = PTL_NO_ACK_REQ;
 
-	*rsize = SWPTL_ISGET(ctx->cmd) ? ctx->mlen : 0;
+	/* with rendezvous, the payload is already in place */
+	f->flags |= flags & SWPTL_HDR_RDV_NAK;
+	*rsize = SWPTL_ISGET(ctx->cmd) && f->flags == 0 ? ctx->mlen : 0;
 	return 1;
 }
 
@@ -3175,6 +3721,22 @@ void swptl_rcv_rdat(struct swptl_ni *ni, struct swptl_sodata *f, size_t msgoffs,
 
 void swptl_rcv_rend(struct swptl_ni *ni, struct swptl_sodata *f, enum swptl_transport_status status)
 {
+	struct swptl_ictx *ctx = &f->u.ictx;
+
+	if (status == SWPTL_TRP_OK && (f->flags & SWPTL_HDR_RDV_NAK)) {
+		/*
+		 * The target can't access our memory (ex. other user),
+		 * send the query again with its payload, and the next
+		 * ones to this peer as well.
+		 */
+		LOGN(2, "%s: %u: peer can't access our memory, rendezvous disabled\n", __func__,
+		     ctx->serial);
+		f->conn->rdv_nak = 1;
+		f->flags = 0;
+		f->hdrsize = swptl_hdr_getsize(ni, f);
+		bximsg_enqueue(ni->dev->iface, f, SWPTL_ISPUT(ctx->cmd) ? ctx->rlen : 0);
+		return;
+	}
 	swptl_iend(ni, f, status);
 }
 
@@ -3182,15 +3744,20 @@ void swptl_snd_start(void *arg, struct swptl_sodata *f, void *buf)
 {
 	struct swptl_dev *dev = arg;
 	struct swptl_ni *ni = dev->nis[f->conn->vc];
-	struct swptl_hdr *hdr = buf;
+	struct swptl_hdr hdr;
 
+	hdr.flags = f->flags;
 	if (f->init) {
-		hdr->type = SWPTL_QUERY;
-		swptl_snd_qstart(ni, f, &hdr->u.query);
+		hdr.type = SWPTL_QUERY;
+		swptl_snd_qstart(ni, f, &hdr.u.query);
 	} else {
-		hdr->type = SWPTL_REPLY;
-		swptl_snd_rstart(ni, f, &hdr->u.reply);
+		hdr.type = SWPTL_REPLY;
+		swptl_snd_rstart(ni, f, &hdr.u.reply);
 	}
+
+	/* the packet layout was set when the message was queued */
+	if (swptl_hdr_pack(&hdr, f->hdrpack, buf) != f->hdrsize)
+		ptl_panic("swptl_snd_start: header size changed\n");
 }
 
 void swptl_snd_data(void *arg, struct swptl_sodata *f, size_t msgoffs, void **rdata, size_t *rsize)
@@ -3221,26 +3788,29 @@ int swptl_rcv_start(void *arg, void *buf, int size, int nid, int pid, int vc, in
 {
 	struct swptl_dev *dev = arg;
 	struct swptl_ni *ni;
-	struct swptl_hdr *hdr = buf;
+	struct swptl_hdr hdr;
+	size_t hdrsize;
+	int packed;
 
 	if (vc >= SWPTL_NI_COUNT || (ni = dev->nis[vc]) == NULL) {
 		LOG("%s: %d: bad vc\n", __func__, vc);
 		return 0;
 	}
 
-	/*
-	 * We need to check a minimum size for header independently whether it
-	 * is a query or a reply. As a result, the lower bound is the minimum
-	 * between the smallest query header (corresponding to all operations
-	 * except SWAP) and reply header.
-	 */
-	if (size < offsetof(struct swptl_hdr, u.query.swapcst) &&
-	    size < offsetof(struct swptl_hdr, u) + sizeof(struct swptl_reply))
-		ptl_panic("swptl_rcv_start: short header\n");
+	hdrsize = swptl_hdr_unpack(&hdr, buf, size, &packed);
+	if (hdrsize == 0) {
+		ptl_log("%s: bad header from nid %d, pid = %d, dropped\n", __func__, nid, pid);
+		return 0;
+	}
+
+	if (hdr.type == SWPTL_REPLY)
+		return swptl_rcv_rstart(ni, &hdr.u.reply, hdr.flags, hdrsize, nid, pid, uid, pctx,
+					rsize);
 
-	return hdr->type == SWPTL_QUERY ?
-		       swptl_rcv_qstart(ni, &hdr->u.query, nid, pid, uid, pctx, rsize) :
-		       swptl_rcv_rstart(ni, &hdr->u.reply, nid, pid, uid, pctx, rsize);
+	if (!swptl_rcv_qstart(ni, &hdr.u.query, hdr.flags, hdrsize, nid, pid, uid, pctx, rsize))
+		return 0;
+	(*pctx)->hdrpack = packed;
+	return 1;
 }
 
 void swptl_rcv_data(void *arg, struct swptl_sodata *f, size_t msgoffs, void **rdata, size_t *rsize)
@@ -3401,6 +3971,7 @@ void swptl_dev_progress_many(struct swptl_dev **devices, size_t device_count, in
 		size_t nfd;
 
 		ptl_mutex_lock(&devices[i]->lock, __func__);
+		timo_clock(&devices[i]->ctx->timo);
 		nfd = bximsg_pollfd(devices[i]->iface, &pfds[nfds]);
 		ptl_mutex_unlock(&devices[i]->lock, __func__);
 
@@ -3421,6 +3992,7 @@ void swptl_dev_progress_many(struct swptl_dev **devices, size_t device_count, in
 	for (int i = 0; i < device_count; i++) {
 		ptl_mutex_lock(&devices[i]->lock, __func__);
 
+		timo_clock(&devices[i]->ctx->timo);
 		bximsg_revents(devices[i]->iface, &pfds[fd_starts[i]]);
 		timo_update(&devices[i]->ctx->timo);
 
@@ -3436,6 +4008,7 @@ void swptl_dev_progress(struct swptl_dev *dev, int timeout)
 
 	swptl_check_dump(dev);
 
+	timo_clock(&dev->ctx->timo);
 	nfds = bximsg_pollfd(dev->iface, pfds);
 
 	if (nfds > 0) {
@@ -3449,6 +4022,7 @@ void swptl_dev_progress(struct swptl_dev *dev, int timeout)
 			ptl_panic("poll: %s\n", strerror(errno));
 		}
 		ptl_mutex_lock(&dev->lock, __func__);
+		timo_clock(&dev->ctx->timo);
 	}
 
 	bximsg_revents(dev->iface, pfds);
@@ -3465,6 +4039,8 @@ void swptl_progress(struct swptl_ctx *ctx, int timeout)
 	int rc;
 	int i;
 
+	timo_clock(&ctx->timo);
+
 	i = 0;
 	nfds = 0;
 	for (dev = ctx->devs; dev != NULL; dev = dev->next) {
@@ -3483,6 +4059,7 @@ void swptl_progress(struct swptl_ctx *ctx, int timeout)
 				return;
 			ptl_panic("poll: %s\n", strerror(errno));
 		}
+		timo_clock(&ctx->timo);
 	}
 
 	i = 0;
@@ -4140,6 +4717,7 @@ int swptl_func_eq_poll(struct swptl_ctx *ctx, const struct swptl_eq **eqhlist, u
 
 	if (timeout != PTL_TIME_FOREVER && timeout > 0) {
 		timo_set(&ctx->timo, &timo, swptl_setflag_cb, &expired);
+		timo_clock(&ctx->timo);
 		timo_add(&timo, 1000 * timeout);
 	}
 	while (!expired) {
@@ -4249,6 +4827,7 @@ int swptl_func_ct_poll(struct swptl_ctx *ctx, const struct swptl_ct **cthlist,
 
 	if (timeout != PTL_TIME_FOREVER && timeout > 0) {
 		timo_set(&ctx->timo, &timo, swptl_setflag_cb, &expired);
+		timo_clock(&ctx->timo);
 		timo_add(&timo, 1000 * timeout);
 	}
 	while (!expired) {
@@ -37,6 +37,7 @@
 #define SWPTL_SWAP 4
 #define SWPTL_CTSET 5
 #define SWPTL_CTINC 6
+#define SWPTL_CMD_COUNT 7
 
 #define SWPTL_OPINT 1
 #define SWPTL_OPFLOAT 2
@@ -51,6 +52,9 @@
 
 #define SWPTL_NI_COUNT 4
 
+/* default min. size of payloads moved with process_vm_readv/writev */
+#define SWPTL_VM_RDV 0x10000
+
 #define SWPTL_ISMATCHING(opt) (((opt) & (PTL_NI_MATCHING | PTL_NI_NO_MATCHING)) == PTL_NI_MATCHING)
 
 #define SWPTL_ISPHYSICAL(opt) (((opt) & (PTL_NI_PHYSICAL | PTL_NI_LOGICAL)) == PTL_NI_PHYSICAL)
@@ -201,6 +205,8 @@ struct swptl_dev {
 	struct bximsg_iface *iface;
 	int nic_iface;
 	size_t rdv_put;
+	size_t vm_rdv; /* min. payload moved with process_vm_readv/writev, 0 if disabled */
+	int rdv_fd; /* socket vouching our OS pid to rendezvous targets */
 	ptl_uid_t uid;
 	int nid, pid;
 	pthread_mutex_t lock;
@@ -237,7 +243,7 @@ struct swptl_ni {
 };
 
 /*
- * query, as it passes on the network
+ * query, as decoded from the network, see swptl_hdr_pack()
  */
 struct swptl_query {
 	uint64_t hdr_data;
@@ -251,12 +257,17 @@ struct swptl_query {
 	uint8_t atype;
 	uint8_t ack;
 	uint8_t pte;
-	/* swapcst field must remain the last */
+	/* swapcst field must remain the last of the legacy layout */
 	uint8_t swapcst[32];
+	/* initiator buffer, if SWPTL_HDR_RDV is set */
+	struct swptl_rdv {
+		uint64_t addr;
+		uint32_t ospid; /* not sent, see swptl_rdv_ospid() */
+	} rdv;
 };
 
 /*
- * reply, as it passes on the network
+ * reply, as decoded from the network
  */
 struct swptl_reply {
 	uint64_t meoffs;
@@ -310,6 +321,7 @@ struct swptl_tctx {
 	uint64_t hdr_data;
 	uint64_t bits;
 	unsigned char swapcst[32];
+	struct swptl_rdv rdv;
 	/* reply event */
 	int fail;
 	int list;
@@ -326,14 +338,16 @@ struct swptl_sodata {
 	struct swptl_sodata *next;
 	struct swptl_sodata *ni_next, **ni_prev;
 	struct bximsg_conn *conn;
-	struct swptl_sodata *ret_next;
-	unsigned int seq; /* seq number of first packet */
 	unsigned int pkt_count; /* number of packets if the message */
 	unsigned int pkt_next; /* packets already sent */
+	unsigned int lane; /* lane the message is sent on */
+	struct swptl_sodata *aggr_next; /* next message packed in the same packet */
 	unsigned int pkt_acked; /* packets already acked */
 	size_t hdrsize; /* header size */
+	int hdrpack; /* header packed by swptl_hdr_pack(), see struct swptl_hdr */
 	size_t msgsize; /* payload size */
 	int init; /* initiator ? */
+	int flags; /* SWPTL_HDR_xxx flags of the message */
 	union {
 		struct swptl_ictx ictx;
 		struct swptl_tctx tctx;
@@ -368,11 +382,23 @@ struct swptl_trig {
 	ptl_size_t thres;
 };
 
+/*
+ * Message header. To peers with BXIMSG_HDR_FLAG_V2, it's packed by
+ * swptl_hdr_pack() into at most SWPTL_HDR_MAX bytes: a first byte with
+ * a marker bit, the type, the flags and bits telling which optional
+ * fields follow, a few bytes for the small fields, then the integers
+ * as varints. Older peers get this structure as is, truncated after
+ * the last field used, and without flags.
+ */
+#define SWPTL_HDR_MAX 96
 struct swptl_hdr {
 #define SWPTL_QUERY 0 /* message is a query */
 #define SWPTL_REPLY 1 /* message is a reply */
 	uint8_t type; /* one of above */
-	uint8_t _pad[7];
+#define SWPTL_HDR_RDV 0x01 /* payload moved by the target with process_vm_readv/writev */
+#define SWPTL_HDR_RDV_NAK 0x02 /* target can't access our memory, payload must be sent */
+	uint8_t flags;
+	uint8_t _pad[6];
 	union {
 		struct swptl_query query;
 		struct swptl_reply reply;
@@ -18,8 +18,9 @@
  * trivial timeouts implementation.
  *
  * A timeout is used to schedule the call of a routine (the callback)
- * there is a global list of timeouts that is processed inside the
- * event loop ie mux_run(). Timeouts work as follows:
+ * there is a global timing wheel of timeouts that is processed inside
+ * the event loop ie mux_run(), so adding or aborting a timeout takes
+ * constant time. Timeouts work as follows:
  *
  *	first the timo structure must be initialized with timo_set()
  *
@@ -55,6 +56,21 @@ unsigned long long timo_gettime(void)
 	return date;
 }
 
+/*
+ * Read the clock and cache it in the context: timeouts added until the
+ * next call count from it, and timo_now() returns it, so the clock is
+ * read once per event loop iteration rather than for each packet. Must
+ * also be called after any blocking call.
+ */
+unsigned long long timo_clock(struct timo_ctx *ctx)
+{
+	unsigned long long now;
+
+	now = timo_gettime();
+	__atomic_store_n(&ctx->now, now, __ATOMIC_RELAXED);
+	return now;
+}
+
 /*
  * initialise a timeout structure, arguments are callback and argument
  * that will be passed to the callback
@@ -68,13 +84,53 @@ void timo_set(struct timo_ctx *ctx, struct timo *o, void (*cb)(void *), void *ar
 }
 
 /*
- * schedule the callback in 'delta' 24-th of microseconds. The timeout
- * must not be already scheduled
+ * link the timeout in the slot of the wheel matching its expire date:
+ * the first wheel if it expires within TIMO_SLOTS ticks, the second
+ * one if it expires within TIMO_SLOTS^2 ticks, and so on. Timeouts
+ * are moved to the lower wheel as the tick reaches their slot
+ */
+static void timo_link(struct timo_ctx *ctx, struct timo *o)
+{
+	struct timo **slot;
+	unsigned long long tick, delta;
+	int level;
+
+	/* round up, so that the timeout never expires early */
+	tick = (o->expire + (1 << TIMO_TICK_SHIFT) - 1) >> TIMO_TICK_SHIFT;
+	if (tick < ctx->tick)
+		tick = ctx->tick;
+
+	delta = tick - ctx->tick;
+	for (level = 0; level < TIMO_LEVELS - 1; level++) {
+		if (delta < 1ULL << ((level + 1) * TIMO_SLOTS_SHIFT))
+			break;
+	}
+
+	/* too far in the future, wait in the last slot of the last wheel */
+	if (delta >= 1ULL << (TIMO_LEVELS * TIMO_SLOTS_SHIFT))
+		tick = ctx->tick + (1ULL << (TIMO_LEVELS * TIMO_SLOTS_SHIFT)) - 1;
+
+	slot = &ctx->wheel[level][(tick >> (level * TIMO_SLOTS_SHIFT)) & (TIMO_SLOTS - 1)];
+	o->next = *slot;
+	if (o->next != NULL)
+		o->next->prev = &o->next;
+	o->prev = slot;
+	*slot = o;
+}
+
+static void timo_unlink(struct timo *o)
+{
+	*o->prev = o->next;
+	if (o->next != NULL)
+		o->next->prev = o->prev;
+}
+
+/*
+ * schedule the callback in 'delta' microseconds, counted from the
+ * last timo_clock() call. The timeout must not be already scheduled
  */
 void timo_add(struct timo *o, unsigned delta)
 {
-	struct timo **i;
-	unsigned long long expire;
 	struct timo_ctx *ctx = o->ctx;
 
 	ptl_mutex_lock(&ctx->queue_mutex, __func__);
@@ -86,15 +142,10 @@ void timo_add(struct timo *o, unsigned delta)
 	if (delta == 0)
 		ptl_panic("timo_add: zero timeout is evil\n");
 #endif
-	expire = timo_gettime() + delta;
-	for (i = &ctx->queue; *i != NULL; i = &(*i)->next) {
-		if ((*i)->expire > expire)
-			break;
-	}
 	o->set = 1;
-	o->expire = expire;
-	o->next = *i;
-	*i = o;
+	o->expire = timo_now(ctx) + delta;
+	timo_link(ctx, o);
+	ctx->count++;
 
 	ptl_mutex_unlock(&ctx->queue_mutex, __func__);
 }
@@ -104,18 +155,16 @@ void timo_add(struct timo *o, unsigned delta)
  */
 void timo_del(struct timo *o)
 {
-	struct timo **i;
 	struct timo_ctx *ctx = o->ctx;
 
 	ptl_mutex_lock(&ctx->queue_mutex, __func__);
 
-	for (i = &ctx->queue; *i != NULL; i = &(*i)->next) {
-		if (*i == o) {
-			*i = o->next;
-			o->set = 0;
-			ptl_mutex_unlock(&ctx->queue_mutex, __func__);
-			return;
-		}
+	if (o->set) {
+		timo_unlink(o);
+		o->set = 0;
+		ctx->count--;
+		ptl_mutex_unlock(&ctx->queue_mutex, __func__);
+		return;
 	}
 
 	ptl_mutex_unlock(&ctx->queue_mutex, __func__);
@@ -125,31 +174,74 @@ void timo_del(struct timo *o)
 }
 
 /*
- * routine to be called by the timer when 'delta' 24-th of microsecond
- * elapsed. This routine updates time referece used by timeouts and
- * calls expired timeouts
+ * move the timeouts of the given slot of the given wheel to the lower
+ * wheels
+ */
+static void timo_cascade(struct timo_ctx *ctx, int level, unsigned int index)
+{
+	struct timo *o, *next;
+
+	o = ctx->wheel[level][index];
+	ctx->wheel[level][index] = NULL;
+	for (; o != NULL; o = next) {
+		next = o->next;
+		timo_link(ctx, o);
+	}
+}
+
+/*
+ * routine to be called periodically, after timo_clock(). This routine
+ * calls the timeouts expired at the time of the last timo_clock() call
  */
 void timo_update(struct timo_ctx *ctx)
 {
-	struct timo *to;
+	struct timo *to, *expired;
 	unsigned long long now;
+	unsigned int index;
+	int level;
 
-	now = timo_gettime();
+	now = timo_now(ctx) >> TIMO_TICK_SHIFT;
 
 	ptl_mutex_lock(&ctx->queue_mutex, __func__);
 
-	/*
-	 * remove from the queue and run expired timeouts
-	 */
-	while (ctx->queue != NULL) {
-		if (now < ctx->queue->expire)
+	while (ctx->tick <= now) {
+		/* nothing to expire, skip the ticks until now */
+		if (ctx->count == 0) {
+			ctx->tick = now + 1;
 			break;
-		to = ctx->queue;
-		ctx->queue = to->next;
-		to->set = 0;
-		ptl_mutex_unlock(&ctx->queue_mutex, __func__);
-		to->cb(to->arg);
-		ptl_mutex_lock(&ctx->queue_mutex, __func__);
+		}
+
+		/*
+		 * when the first wheel wraps, bring the timeouts of the
+		 * next slot of the upper wheels down
+		 */
+		for (level = 1; level < TIMO_LEVELS; level++) {
+			if ((ctx->tick >> ((level - 1) * TIMO_SLOTS_SHIFT)) & (TIMO_SLOTS - 1))
+				break;
+			timo_cascade(ctx, level,
+				     (ctx->tick >> (level * TIMO_SLOTS_SHIFT)) & (TIMO_SLOTS - 1));
+		}
+
+		/*
+		 * detach the expired timeouts before running them, so
+		 * that the ones they add go in the next tick
+		 */
+		index = ctx->tick & (TIMO_SLOTS - 1);
+		expired = ctx->wheel[0][index];
+		ctx->wheel[0][index] = NULL;
+		if (expired != NULL)
+			expired->prev = &expired;
+		ctx->tick++;
+
+		while (expired != NULL) {
+			to = expired;
+			timo_unlink(to);
+			to->set = 0;
+			ctx->count--;
+			ptl_mutex_unlock(&ctx->queue_mutex, __func__);
+			to->cb(to->arg);
+			ptl_mutex_lock(&ctx->queue_mutex, __func__);
+		}
 	}
 
 	ptl_mutex_unlock(&ctx->queue_mutex, __func__);
@@ -160,7 +252,10 @@ void timo_update(struct timo_ctx *ctx)
  */
 void timo_init(struct timo_ctx *ctx)
 {
-	ctx->queue = NULL;
+	memset(ctx->wheel, 0, sizeof(ctx->wheel));
+	ctx->now = timo_gettime();
+	ctx->tick = ctx->now >> TIMO_TICK_SHIFT;
+	ctx->count = 0;
 	ctx->debug = 0;
 	pthread_mutex_init(&ctx->queue_mutex, NULL);
 }
@@ -170,9 +265,8 @@ void timo_init(struct timo_ctx *ctx)
  */
 void timo_done(struct timo_ctx *ctx)
 {
-	if (ctx->queue != NULL)
+	if (ctx->count != 0)
 		ptl_panic("timo_done: timo_queue not empty!\n");
 
-	ctx->queue = (struct timo *)0xdeadbeef;
 	pthread_mutex_destroy(&ctx->queue_mutex);
 }
@@ -19,14 +19,27 @@
 
 #include <pthread.h>
 
+/*
+ * timing wheel: TIMO_LEVELS wheels of TIMO_SLOTS slots, slots of the
+ * first wheel are TIMO_TICK_SHIFT-th power of 2 microseconds long,
+ * slots of the next wheel are TIMO_SLOTS times longer
+ */
+#define TIMO_TICK_SHIFT 6
+#define TIMO_SLOTS_SHIFT 8
+#define TIMO_SLOTS (1 << TIMO_SLOTS_SHIFT)
+#define TIMO_LEVELS 4
+
 struct timo_ctx {
 	pthread_mutex_t queue_mutex;
-	struct timo *queue;
+	struct timo *wheel[TIMO_LEVELS][TIMO_SLOTS];
+	unsigned long long tick; /* next tick to process */
+	unsigned long long now; /* clock cached by timo_clock() */
+	unsigned int count; /* number of timeouts set */
 	unsigned int debug;
 };
 
 struct timo {
-	struct timo *next;
+	struct timo *next, **prev;
 	unsigned long long expire; /* expire date */
 	unsigned set; /* true if the timeout is set */
 	void (*cb)(void *arg); /* routine to call on expiration */
@@ -35,6 +48,8 @@ struct timo {
 	struct timo_ctx *ctx;
 };
 
+unsigned long long timo_gettime(void);
+unsigned long long timo_clock(struct timo_ctx *ctx);
 void timo_set(struct timo_ctx *ctx, struct timo *, void (*)(void *), void *);
 void timo_add(struct timo *, unsigned);
 void timo_del(struct timo *);
@@ -42,4 +57,12 @@ void timo_update(struct timo_ctx *ctx);
 void timo_init(struct timo_ctx *ctx);
 void timo_done(struct timo_ctx *ctx);
 
+/*
+ * time of the last timo_clock() call, in microseconds
+ */
+static inline unsigned long long timo_now(struct timo_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->now, __ATOMIC_RELAXED);
+}
+
 #endif /* MIDISH_TIMO_H */